@@ -0,0 +1,996 @@
+/****************************************************************
+
+  AVL tree benchmarks
+  by Ron Niles
+
+  this software is placed in the public domain
+  provided that you use it at your own risk
+
+  build with: cc -O2 -pthread avlbench.c -o avlbench -lm
+  usage: avlbench [nodes [maxthreads]]
+
+****************************************************************/
+
+#define AVL_PTHREADS
+#include "avlsearch.h"
+#include "avldurable.h"
+#include "avlpaged.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <math.h>
+
+typedef struct benchtree_ {
+  struct avltree tree;
+  unsigned long long key;
+} benchtree;
+
+typedef struct benchnode_ {
+  struct avlbind node;
+  unsigned long long key;
+} benchnode;
+
+static int compare(struct avltree *tree, struct avlbind *node) {
+  unsigned long long lhs = ((benchtree*)tree)->key;
+  unsigned long long rhs = ((benchnode*)node)->key;
+  return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+
+static int compare_nodes(struct avltree *tree, struct avlbind *lhs,
+                         struct avlbind *rhs) {
+  unsigned long long l = ((benchnode*)lhs)->key;
+  unsigned long long r = ((benchnode*)rhs)->key;
+  return l < r ? -1 : l > r ? 1 : 0;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* xorshift, so runs are repeatable across libcs */
+static unsigned long long Seed = 88172645463325252ULL;
+static unsigned long long Random(void) {
+  Seed ^= Seed << 13;
+  Seed ^= Seed >> 7;
+  Seed ^= Seed << 17;
+  return Seed;
+}
+
+static void InitTree(benchtree *tree) {
+  memset(tree, 0, sizeof(*tree));
+  tree->tree.compare_key_tree = compare;
+  tree->tree.compare_nodes = compare_nodes;
+}
+
+/****************************************************************
+ BuildBench
+ Builds a tree from unsorted nodes with avl_insert() and with
+ avl_build_parallel() on 1 to maxthreads threads
+ ****************************************************************/
+static void BuildBench(benchnode *nodes, unsigned n, unsigned maxthreads) {
+  struct avlbind **array;
+  benchtree tree;
+  unsigned i, threads;
+  double start, base;
+
+  array = malloc(n * sizeof(*array));
+  assert(array);
+  for (i = 0; i < n; i++)
+    nodes[i].key = Random();
+
+  InitTree(&tree);
+  start = now();
+  for (i = 0; i < n; i++) {
+    tree.key = nodes[i].key;
+    avl_insert(&tree.tree, &nodes[i].node);
+  }
+  base = now() - start;
+  printf("avl_insert         %10u nodes %8.3f s\n", n, base);
+
+  for (threads = 1; threads <= maxthreads; threads *= 2) {
+    for (i = 0; i < n; i++)
+      array[i] = &nodes[i].node;
+    InitTree(&tree);
+    start = now();
+    avl_build_parallel(&tree.tree, array, n, threads);
+    start = now() - start;
+    printf("avl_build_parallel %10u nodes %8.3f s  %2u threads  %6.2fx\n", n,
+           start, threads, base / start);
+  }
+  free(array);
+}
+
+static void sum_map(struct avltree *tree, void *acc, struct avlbind *node) {
+  *(unsigned long long*)acc += ((benchnode*)node)->key >> 16;
+}
+
+static void sum_combine(struct avltree *tree, void *acc, const void *right) {
+  *(unsigned long long*)acc += *(const unsigned long long*)right;
+}
+
+/****************************************************************
+ ReduceBench
+ Sums the keys of a tree with avl_get_next() and with
+ avl_parallel_reduce() on 1 to maxthreads threads
+ ****************************************************************/
+static void ReduceBench(benchnode *nodes, unsigned n, unsigned maxthreads) {
+  struct avlbind **array;
+  struct avlsearch search;
+  struct avlbind *cur;
+  unsigned long long sum, check;
+  benchtree tree;
+  unsigned i, threads;
+  double start, base;
+
+  array = malloc(n * sizeof(*array));
+  assert(array);
+  for (i = 0; i < n; i++) {
+    nodes[i].key = Random();
+    array[i] = &nodes[i].node;
+  }
+  InitTree(&tree);
+  avl_build_parallel(&tree.tree, array, n, maxthreads);
+  free(array);
+
+  start = now();
+  check = 0;
+  for (cur = avl_get_first(&tree.tree, &search); cur; cur = avl_get_next(&search))
+    check += ((benchnode*)cur)->key >> 16;
+  base = now() - start;
+  printf("avl_get_next       %10u nodes %8.3f s\n", n, base);
+
+  for (threads = 1; threads <= maxthreads; threads *= 2) {
+    sum = 0;
+    start = now();
+    avl_parallel_reduce(&tree.tree, sum_map, sum_combine, &sum, sizeof(sum),
+                        threads);
+    start = now() - start;
+    assert(sum == check);
+    printf("avl_parallel_reduce %9u nodes %8.3f s  %2u threads  %6.2fx\n", n,
+           start, threads, base / start);
+  }
+}
+
+/****************************************************************
+ LookupTime
+ Times random lookups of keys known to be in the tree
+ ****************************************************************/
+static double LookupTime(benchtree *tree, benchnode *nodes, unsigned n) {
+  struct avlsearch search;
+  unsigned i;
+  double start = now();
+  for (i = 0; i < n; i++) {
+    tree->key = nodes[Random() % n].key;
+    avl_get_greater_equal(&tree->tree, &search);
+  }
+  return now() - start;
+}
+
+static void moved_node(struct avltree *tree, struct avlbind *from,
+                       struct avlbind *to, void *context) {
+}
+
+/****************************************************************
+ RelayoutBench
+ Times lookups and a full scan before and after avl_relayout()
+ ****************************************************************/
+static void RelayoutBench(benchnode *nodes, unsigned n) {
+  struct avlsearch search;
+  struct avlbind *cur;
+  benchnode *arena;
+  benchtree tree;
+  unsigned i;
+  double start;
+
+  InitTree(&tree);
+  for (i = 0; i < n; i++) {
+    tree.key = nodes[i].key = Random();
+    avl_insert(&tree.tree, &nodes[i].node);
+  }
+  printf("lookups, scattered %10u nodes %8.3f s\n", n,
+         LookupTime(&tree, nodes, n));
+  start = now();
+  for (cur = avl_get_first(&tree.tree, &search); cur; cur = avl_get_next(&search))
+    ;
+  printf("scan, scattered    %10u nodes %8.3f s\n", n, now() - start);
+
+  arena = malloc(tree.tree.num_nodes * sizeof(*arena));
+  assert(arena);
+  start = now();
+  avl_relayout(&tree.tree, arena, sizeof(*arena), moved_node, NULL);
+  printf("avl_relayout       %10u nodes %8.3f s\n", n, now() - start);
+  printf("lookups, relaid    %10u nodes %8.3f s\n", n,
+         LookupTime(&tree, nodes, n));
+  start = now();
+  for (cur = avl_get_first(&tree.tree, &search); cur; cur = avl_get_next(&search))
+    ;
+  printf("scan, relaid       %10u nodes %8.3f s\n", n, now() - start);
+  free(arena);
+}
+
+typedef struct urltree_ {
+  struct avltree tree;
+  const char *key;
+} urltree;
+
+typedef struct urlnode_ {
+  struct avlbind node;
+  const char *key;
+} urlnode;
+
+static int compare_url(struct avltree *tree, struct avlbind *node) {
+  return strcmp(((urltree*)tree)->key, ((urlnode*)node)->key);
+}
+
+/****************************************************************
+ StringBench
+ Times lookups of URL-like keys, each in its own allocation,
+ with strcmp() on every compare and with the cached prefix of
+ the avl_str_ trees. Full URLs all tie on their first 8 bytes,
+ so they are timed again with the scheme stripped
+ ****************************************************************/
+static void StringBench(unsigned n) {
+  static const char *hosts[] = { "http://www.example.com/", "https://example.org/",
+                                 "http://a.example.net/" };
+  struct avlsearch search;
+  struct avlstrtree stree;
+  struct avlstrnode *snodes;
+  urlnode *nodes;
+  urltree tree;
+  char **keys, buf[64];
+  size_t *lens;
+  unsigned i, k, pass;
+  double start;
+
+  keys = malloc(n * sizeof(*keys));
+  lens = malloc(n * sizeof(*lens));
+  nodes = malloc(n * sizeof(*nodes));
+  snodes = malloc(n * sizeof(*snodes));
+  assert(keys && lens && nodes && snodes);
+  for (pass = 0; pass < 2; pass++) {
+    for (i = 0; i < n; i++) {
+      if (pass == 0)
+        sprintf(buf, "%s%llx/%llu", hosts[Random() % 3], Random() % 4096,
+                Random() % 1000000);
+      else
+        sprintf(buf, "%llx.example.com/%llu", Random() % 65536,
+                Random() % 1000000);
+      keys[i] = strdup(buf);
+      assert(keys[i]);
+      lens[i] = strlen(buf);
+    }
+
+    memset(&tree, 0, sizeof(tree));
+    tree.tree.compare_key_tree = compare_url;
+    avl_str_init(&stree);
+    for (i = 0; i < n; i++) {
+      tree.key = nodes[i].key = keys[i];
+      avl_insert(&tree.tree, &nodes[i].node);
+      avl_str_insert(&stree, &snodes[i], keys[i], lens[i]);
+    }
+
+    start = now();
+    for (i = 0; i < n; i++) {
+      tree.key = keys[Random() % n];
+      avl_get_greater_equal(&tree.tree, &search);
+    }
+    printf("%-18s %10u nodes %8.3f s\n", pass ? "hosts, strcmp" : "urls, strcmp",
+           n, now() - start);
+    start = now();
+    for (i = 0; i < n; i++) {
+      k = Random() % n;
+      avl_str_key(&stree, keys[k], lens[k]);
+      avl_get_greater_equal(&stree.tree, &search);
+    }
+    printf("%-18s %10u nodes %8.3f s\n", pass ? "hosts, prefix" : "urls, prefix",
+           n, now() - start);
+
+    for (i = 0; i < n; i++)
+      free(keys[i]);
+  }
+  free(keys);
+  free(lens);
+  free(nodes);
+  free(snodes);
+}
+
+static unsigned long Mix(unsigned long long key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (unsigned long)key;
+}
+
+static unsigned long hash_key(struct avltree *tree) {
+  return Mix(((benchtree*)tree)->key);
+}
+
+static unsigned long hash_node(struct avltree *tree, struct avlbind *node) {
+  return Mix(((benchnode*)node)->key);
+}
+
+/****************************************************************
+ HashBench
+ Times exact matches through the tree and through the hash
+ side index, and reports what the index costs in memory
+ ****************************************************************/
+static void HashBench(benchnode *nodes, unsigned n) {
+  benchtree tree;
+  unsigned i;
+  double start;
+
+  InitTree(&tree);
+  tree.tree.hash_key = hash_key;
+  tree.tree.hash_node = hash_node;
+  for (i = 0; i < n; i++) {
+    tree.key = nodes[i].key = Random();
+    avl_insert(&tree.tree, &nodes[i].node);
+  }
+  start = now();
+  for (i = 0; i < n; i++) {
+    tree.key = nodes[Random() % n].key;
+    avl_find(&tree.tree);
+  }
+  printf("avl_find, tree     %10u nodes %8.3f s\n", n, now() - start);
+
+  start = now();
+  assert(avl_hash_enable(&tree.tree) == 0);
+  printf("avl_hash_enable    %10u nodes %8.3f s  %.1f bytes/node\n", n,
+         now() - start, (double)avl_hash_memory(&tree.tree) / n);
+  start = now();
+  for (i = 0; i < n; i++) {
+    tree.key = nodes[Random() % n].key;
+    avl_find(&tree.tree);
+  }
+  printf("avl_find, hashed   %10u nodes %8.3f s\n", n, now() - start);
+  start = now();
+  for (i = 0; i < n; i++) {
+    tree.key = Random();
+    avl_find(&tree.tree);
+  }
+  printf("avl_find, misses   %10u nodes %8.3f s\n", n, now() - start);
+  avl_hash_disable(&tree.tree);
+}
+
+/****************************************************************
+ BloomBench
+ Times lookups of absent keys through the tree alone and behind
+ Bloom filters of a few sizes, and hits behind the largest
+ ****************************************************************/
+static void BloomBench(benchnode *nodes, unsigned n) {
+  static const unsigned bits[] = { 6, 10, 16 };
+  benchtree tree;
+  unsigned i, b;
+  double start;
+
+  InitTree(&tree);
+  tree.tree.hash_key = hash_key;
+  tree.tree.hash_node = hash_node;
+  for (i = 0; i < n; i++) {
+    tree.key = nodes[i].key = Random();
+    avl_insert(&tree.tree, &nodes[i].node);
+  }
+  start = now();
+  for (i = 0; i < n; i++) {
+    tree.key = Random();
+    avl_find(&tree.tree);
+  }
+  printf("misses, tree       %10u nodes %8.3f s\n", n, now() - start);
+
+  for (b = 0; b < sizeof(bits) / sizeof(bits[0]); b++) {
+    assert(avl_bloom_enable(&tree.tree, bits[b]) == 0);
+    start = now();
+    for (i = 0; i < n; i++) {
+      tree.key = Random();
+      avl_find(&tree.tree);
+    }
+    printf("misses, bloom %2u   %10u nodes %8.3f s  %.1f bytes/node  %.3f%% passed\n",
+           bits[b], n, now() - start, (double)avl_bloom_memory(&tree.tree) / n,
+           100.0 * tree.tree.bloom->passed / n);
+  }
+  start = now();
+  for (i = 0; i < n; i++) {
+    tree.key = nodes[Random() % n].key;
+    avl_find(&tree.tree);
+  }
+  printf("hits, bloom 16     %10u nodes %8.3f s\n", n, now() - start);
+  avl_bloom_disable(&tree.tree);
+}
+
+/****************************************************************
+ BufferBench
+ Times random inserts straight into the tree and through write
+ buffers of a few sizes, then short lived keys, each deleted 64
+ inserts after it went in, over a tree of long lived ones. All
+ with a Bloom filter, to answer the check for an existing key
+ ****************************************************************/
+static void BufferBench(benchnode *nodes, unsigned n) {
+  static const unsigned sizes[] = { 0, 64, 256, 1024 };
+  benchtree tree;
+  unsigned i, c, pass, slot, base = n - 64;
+  double start;
+
+  for (pass = 0; pass < 2; pass++) {
+    for (c = 0; c < sizeof(sizes) / sizeof(sizes[0]); c++) {
+      if (pass && sizes[c] == 64)
+        continue;
+      for (i = 0; i < n; i++)
+        nodes[i].key = Random();
+      InitTree(&tree);
+      tree.tree.hash_key = hash_key;
+      tree.tree.hash_node = hash_node;
+      assert(avl_bloom_enable(&tree.tree, 10) == 0);
+      if (pass) {
+        for (i = 0; i < base; i++) {
+          tree.key = nodes[i].key;
+          avl_insert(&tree.tree, &nodes[i].node);
+        }
+      }
+      if (sizes[c])
+        assert(avl_buffer_enable(&tree.tree, sizes[c]) == 0);
+      start = now();
+      if (pass == 0) {
+        for (i = 0; i < n; i++) {
+          tree.key = nodes[i].key;
+          avl_insert(&tree.tree, &nodes[i].node);
+        }
+      } else {
+        for (i = 0; i < n; i++) {
+          slot = base + i % 64;
+          if (i >= 64) {
+            tree.key = nodes[slot].key;
+            avl_delete(&tree.tree);
+            nodes[slot].key = Random();
+          }
+          tree.key = nodes[slot].key;
+          avl_insert(&tree.tree, &nodes[slot].node);
+        }
+      }
+      avl_buffer_disable(&tree.tree);
+      printf("%-8s buffer %4u %9u nodes %8.3f s\n", pass ? "churn," : "inserts,",
+             sizes[c], n, now() - start);
+      avl_bloom_disable(&tree.tree);
+    }
+  }
+}
+
+/****************************************************************
+ InsertBench
+ Times avl_insert() against avl_insert_topdown(), with
+ ascending keys, which keep every insert at the deepest leaf,
+ and with random ones
+ ****************************************************************/
+static void InsertBench(benchnode *nodes, unsigned n) {
+  benchtree tree;
+  unsigned i, pass, top;
+  double start;
+
+  for (pass = 0; pass < 4; pass++) {
+    top = pass & 1;
+    for (i = 0; i < n; i++)
+      nodes[i].key = pass < 2 ? i : Random();
+    InitTree(&tree);
+    start = now();
+    for (i = 0; i < n; i++) {
+      tree.key = nodes[i].key;
+      if (top)
+        avl_insert_topdown(&tree.tree, &nodes[i].node);
+      else
+        avl_insert(&tree.tree, &nodes[i].node);
+    }
+    printf("%-18s %10u nodes %8.3f s  %s keys\n",
+           top ? "avl_insert_topdown" : "avl_insert", n, now() - start,
+           pass < 2 ? "ascending" : "random");
+  }
+}
+
+static size_t encode_node(struct avltree *tree, struct avlbind *node,
+                          unsigned char *buf, size_t max) {
+  memcpy(buf, &((benchnode*)node)->key, sizeof(unsigned long long));
+  return sizeof(unsigned long long);
+}
+
+static size_t encode_key(struct avltree *tree, unsigned char *buf, size_t max) {
+  memcpy(buf, &((benchtree*)tree)->key, sizeof(unsigned long long));
+  return sizeof(unsigned long long);
+}
+
+/****************************************************************
+ DurableBench
+ Times logged inserts under each sync policy and group size,
+ into files in the directory named by TMPDIR, and a checkpoint
+ of the result. A sync per record is slow on real disks, so
+ the synced runs are kept shorter
+ ****************************************************************/
+static void DurableBench(benchnode *nodes, unsigned n) {
+  static const char *names[] = { "none", "batch", "always" };
+  static const unsigned groups[] = { 1, 8, 64, 512 };
+  char dir[256], log_path[300], checkpoint_path[300];
+  const char *tmp = getenv("TMPDIR");
+  struct avldurable d;
+  benchtree tree;
+  unsigned i, count, policy, group;
+  double start;
+
+  sprintf(dir, "%s/avlbenchXXXXXX", tmp ? tmp : "/tmp");
+  if (mkdtemp(dir) == NULL) {
+    printf("durable: cannot make %s\n", dir);
+    return;
+  }
+  sprintf(log_path, "%s/log", dir);
+  sprintf(checkpoint_path, "%s/checkpoint", dir);
+  for (policy = AVL_SYNC_NONE; policy <= AVL_SYNC_ALWAYS; policy++) {
+    for (group = 0; group < 4; group++) {
+      if (policy == AVL_SYNC_ALWAYS ? group > 0 : group == 0)
+        continue;
+      count = policy == AVL_SYNC_NONE ? n : n / (policy == AVL_SYNC_ALWAYS ? 100 : 10);
+      unlink(log_path);
+      unlink(checkpoint_path);
+      InitTree(&tree);
+      memset(&d, 0, sizeof(d));
+      d.encode_node = encode_node;
+      d.encode_key = encode_key;
+      d.sync_policy = policy;
+      d.group_records = groups[group];
+      assert(avl_durable_open(&d, &tree.tree, log_path, checkpoint_path) == 0);
+      start = now();
+      for (i = 0; i < count; i++) {
+        tree.key = nodes[i].key = Random();
+        avl_durable_insert(&d, &nodes[i].node);
+      }
+      assert(avl_durable_commit(&d) == 0);
+      start = now() - start;
+      printf("durable, %-6s %3u %10u nodes %8.3f s  %9.0f inserts/s  %lu syncs\n",
+             names[policy], groups[group], count, start, count / start, d.syncs);
+      if (policy == AVL_SYNC_NONE && group == 3) {
+        start = now();
+        assert(avl_durable_checkpoint(&d) == 0);
+        printf("avl_durable_checkpoint %6u nodes %8.3f s\n", count, now() - start);
+      }
+      assert(avl_durable_close(&d) == 0);
+    }
+  }
+  unlink(log_path);
+  unlink(checkpoint_path);
+  rmdir(dir);
+}
+
+typedef struct pagedtree_ {
+  struct avlpaged tree;
+  unsigned long long key;
+} pagedtree;
+
+static int compare_paged(struct avlpaged *tree, const struct avlpnode *node) {
+  unsigned long long lhs = ((pagedtree*)tree)->key, rhs;
+  memcpy(&rhs, AVL_PAGED_DATA(node), sizeof(rhs));
+  return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+
+/****************************************************************
+ PagedBench
+ Inserts into and looks up in a file backed tree through pools
+ of a few sizes, and reports page reads and writes per
+ operation. Nodes carry 64 bytes of data
+ ****************************************************************/
+static void PagedBench(benchnode *nodes, unsigned n) {
+  static const unsigned pools[] = { 16, 256, 4096 };
+  char dir[256], path[300];
+  const char *tmp = getenv("TMPDIR");
+  unsigned char data[64];
+  unsigned long reads, writes;
+  pagedtree tree;
+  unsigned i, pool;
+  double start;
+
+  sprintf(dir, "%s/avlbenchXXXXXX", tmp ? tmp : "/tmp");
+  if (mkdtemp(dir) == NULL) {
+    printf("paged: cannot make %s\n", dir);
+    return;
+  }
+  sprintf(path, "%s/paged", dir);
+  memset(data, 0, sizeof(data));
+  for (pool = 0; pool < 3; pool++) {
+    unlink(path);
+    memset(&tree, 0, sizeof(tree));
+    tree.tree.compare_key = compare_paged;
+    assert(avl_paged_open(&tree.tree, path,
+                          sizeof(struct avlpnode) + sizeof(data), pools[pool]) == 0);
+    start = now();
+    for (i = 0; i < n; i++) {
+      tree.key = nodes[i].key = Random();
+      memcpy(data, &tree.key, sizeof(tree.key));
+      avl_paged_insert(&tree.tree, data, NULL);
+    }
+    start = now() - start;
+    printf("avl_paged_insert   %10u nodes %8.3f s  %4u frames  %5.2f reads  %5.2f writes"
+           " per op\n", n, start, pools[pool], (double)tree.tree.reads / n,
+           (double)tree.tree.writes / n);
+
+    reads = tree.tree.reads;
+    writes = tree.tree.writes;
+    start = now();
+    for (i = 0; i < n; i++) {
+      tree.key = nodes[Random() % n].key;
+      avl_paged_search(&tree.tree);
+    }
+    start = now() - start;
+    printf("avl_paged_search   %10u nodes %8.3f s  %4u frames  %5.2f reads  %5.2f writes"
+           " per op, %lu pages\n", n, start, pools[pool],
+           (double)(tree.tree.reads - reads) / n,
+           (double)(tree.tree.writes - writes) / n, tree.tree.num_pages);
+    assert(avl_paged_close(&tree.tree) == 0);
+  }
+  unlink(path);
+  rmdir(dir);
+}
+
+/****************************************************************
+ CacheBench
+ Times avl_find() on Zipf distributed keys, with and without a
+ hot key cache of 4096 entries in front of the tree, from no
+ skew to heavy skew. The samples are drawn before timing
+ ****************************************************************/
+static void CacheBench(benchnode *nodes, unsigned n) {
+  static const double skews[] = { 0.0, 0.6, 0.9, 1.1, 1.3 };
+  unsigned *samples;
+  double *cdf, total, u, start, base;
+  benchtree tree;
+  unsigned i, k, lo, hi;
+
+  samples = malloc(n * sizeof(*samples));
+  cdf = malloc(n * sizeof(*cdf));
+  assert(samples && cdf);
+  InitTree(&tree);
+  tree.tree.hash_key = hash_key;
+  tree.tree.hash_node = hash_node;
+  for (i = 0; i < n; i++) {
+    tree.key = nodes[i].key = Random();
+    avl_insert(&tree.tree, &nodes[i].node);
+  }
+
+  for (k = 0; k < sizeof(skews) / sizeof(skews[0]); k++) {
+    total = 0;
+    for (i = 0; i < n; i++)
+      cdf[i] = total += pow(i + 1, -skews[k]);
+    for (i = 0; i < n; i++) {
+      u = (Random() >> 11) * (1.0 / 9007199254740992.0) * total;
+      for (lo = 0, hi = n - 1; lo < hi; )
+        if (cdf[(lo + hi) / 2] < u)
+          lo = (lo + hi) / 2 + 1;
+        else
+          hi = (lo + hi) / 2;
+      samples[i] = lo;
+    }
+
+    start = now();
+    for (i = 0; i < n; i++) {
+      tree.key = nodes[samples[i]].key;
+      avl_find(&tree.tree);
+    }
+    base = now() - start;
+    assert(avl_cache_enable(&tree.tree, 4096) == 0);
+    start = now();
+    for (i = 0; i < n; i++) {
+      tree.key = nodes[samples[i]].key;
+      avl_find(&tree.tree);
+    }
+    start = now() - start;
+    printf("avl_find, zipf %.1f %10u nodes %8.3f s  cached %8.3f s  %5.1f%% hits"
+           "  %6.2fx\n", skews[k], n, base, start,
+           100.0 * tree.tree.cache->hits / n, base / start);
+    avl_cache_disable(&tree.tree);
+  }
+  free(samples);
+  free(cdf);
+}
+
+/****************************************************************
+ MergeBench
+ Folds delta trees of a few sizes into a base tree, popping
+ each node and inserting it, and with avl_merge()
+ ****************************************************************/
+static void MergeBench(benchnode *nodes, unsigned n) {
+  static const unsigned ratios[] = { 10000, 1000, 100, 10, 1 };
+  struct avlbind **array;
+  struct avlsearch search;
+  struct avlbind *cur;
+  benchtree base, delta;
+  unsigned i, k, m, pass;
+  double start, times[2];
+
+  array = malloc(n * sizeof(*array));
+  assert(array);
+  for (i = 0; i < n; i++)
+    nodes[i].key = Random();
+  for (k = 0; k < sizeof(ratios) / sizeof(ratios[0]); k++) {
+    m = n / 2 / ratios[k];
+    if (m == 0)
+      continue;
+    for (pass = 0; pass < 2; pass++) {
+      for (i = 0; i < n / 2 + m; i++)
+        array[i] = &nodes[i].node;
+      InitTree(&base);
+      InitTree(&delta);
+      avl_build_parallel(&base.tree, array, n / 2, 1);
+      avl_build_parallel(&delta.tree, array + n / 2, m, 1);
+      start = now();
+      if (pass)
+        avl_merge(&base.tree, &delta.tree, NULL);
+      else {
+        while ((cur = avl_get_first(&delta.tree, &search)) != NULL) {
+          avl_delete_current(&delta.tree, &search);
+          base.key = ((benchnode*)cur)->key;
+          avl_insert(&base.tree, cur);
+        }
+      }
+      times[pass] = now() - start;
+      assert(base.tree.num_nodes == n / 2 + m);
+    }
+    printf("avl_merge %9u into %9u  %8.4f s  inserts %8.4f s  %6.2fx\n", m,
+           n / 2, times[1], times[0], times[0] / times[1]);
+  }
+  free(array);
+}
+
+/****************************************************************
+ RangeBench
+ Reads ranges of about a thousand nodes by stepping with
+ avl_get_next() and checking the bound, and in batches with
+ avl_get_range()
+ ****************************************************************/
+static void RangeBench(benchnode *nodes, unsigned n) {
+  struct avlsearch search;
+  struct avlbind *cur, *out[256];
+  benchnode hi;
+  benchtree tree;
+  unsigned i, j, got, queries = 20000;
+  unsigned long long span, sum, total, read;
+  double start;
+
+  InitTree(&tree);
+  for (i = 0; i < n; i++) {
+    tree.key = nodes[i].key = Random();
+    avl_insert(&tree.tree, &nodes[i].node);
+  }
+  span = ~0ULL / n * 1000;
+
+  Seed = 88172645463325252ULL;
+  sum = total = 0;
+  start = now();
+  for (i = 0; i < queries; i++) {
+    tree.key = Random();
+    hi.key = tree.key + span < tree.key ? ~0ULL : tree.key + span;
+    for (cur = avl_get_greater_equal(&tree.tree, &search);
+         cur && compare_nodes(&tree.tree, cur, &hi.node) <= 0;
+         cur = avl_get_next(&search)) {
+      sum += ((benchnode*)cur)->key;
+      total++;
+    }
+  }
+  printf("range, get_next    %10llu nodes %8.3f s\n", total, now() - start);
+  read = total;
+
+  Seed = 88172645463325252ULL;
+  start = now();
+  for (i = 0; i < queries; i++) {
+    tree.key = Random();
+    hi.key = tree.key + span < tree.key ? ~0ULL : tree.key + span;
+    avl_get_greater_equal(&tree.tree, &search);
+    do {
+      got = avl_get_range(&search, &hi.node, out, 256);
+      for (j = 0; j < got; j++) {
+        sum -= ((benchnode*)out[j])->key;
+        total--;
+      }
+    } while (got == 256);
+  }
+  printf("range, get_range   %10llu nodes %8.3f s\n", read, now() - start);
+  assert(sum == 0 && total == 0);
+}
+
+/****************************************************************
+ FrozenBench
+ Random lower bound searches and a full scan through the tree,
+ and through its frozen array
+ ****************************************************************/
+static void FrozenBench(benchnode *nodes, unsigned n) {
+  struct avlsearch search;
+  struct avlbind *cur;
+  benchtree tree;
+  unsigned i;
+  size_t k;
+  unsigned long long sum;
+  double start;
+
+  InitTree(&tree);
+  for (i = 0; i < n; i++) {
+    tree.key = nodes[i].key = Random();
+    avl_insert(&tree.tree, &nodes[i].node);
+  }
+  printf("lookups, tree      %10u nodes %8.3f s\n", n,
+         LookupTime(&tree, nodes, n));
+  start = now();
+  assert(avl_freeze(&tree.tree) == 0);
+  printf("avl_freeze         %10u nodes %8.3f s\n", n, now() - start);
+
+  sum = 0;
+  start = now();
+  for (i = 0; i < n; i++) {
+    tree.key = nodes[Random() % n].key;
+    sum += avl_frozen_greater_equal(&tree.tree);
+  }
+  printf("lookups, frozen    %10u nodes %8.3f s\n", n, now() - start);
+
+  start = now();
+  for (cur = avl_get_first(&tree.tree, &search); cur; cur = avl_get_next(&search))
+    sum -= ((benchnode*)cur)->key;
+  printf("scan, tree         %10u nodes %8.3f s\n", n, now() - start);
+  start = now();
+  for (k = avl_frozen_first(&tree.tree); k; k = avl_frozen_next(&tree.tree, k))
+    sum += ((benchnode*)avl_frozen_node(&tree.tree, k))->key;
+  printf("scan, frozen       %10u nodes %8.3f s\n", n, now() - start);
+  avl_thaw(&tree.tree);
+  if (sum == 42)
+    printf("\n");
+}
+
+static int compare_ptrs(const void *lhs, const void *rhs) {
+  unsigned long long l = (*(benchnode *const *)lhs)->key;
+  unsigned long long r = (*(benchnode *const *)rhs)->key;
+  return l < r ? -1 : l > r ? 1 : 0;
+}
+
+/****************************************************************
+ KMergeBench
+ Reads the nodes of many trees in one key order, by gathering
+ and sorting them and by a k-way merge
+ ****************************************************************/
+static void KMergeBench(benchnode *nodes, unsigned n) {
+  static const unsigned ks[] = { 4, 16, 64 };
+  struct avltree *trees[64];
+  struct avlkmerge merge;
+  struct avlsearch search;
+  struct avlbind **array, *cur;
+  benchtree *buckets;
+  unsigned i, j, k, count;
+  unsigned long long sum;
+  double start;
+
+  array = malloc(n * sizeof(*array));
+  buckets = malloc(64 * sizeof(*buckets));
+  assert(array && buckets);
+  for (j = 0; j < sizeof(ks) / sizeof(ks[0]); j++) {
+    k = ks[j];
+    for (i = 0; i < k; i++) {
+      InitTree(&buckets[i]);
+      trees[i] = &buckets[i].tree;
+    }
+    for (i = 0; i < n; i++) {
+      buckets[i % k].key = nodes[i].key = Random();
+      avl_insert(&buckets[i % k].tree, &nodes[i].node);
+    }
+
+    start = now();
+    count = 0;
+    for (i = 0; i < k; i++)
+      for (cur = avl_get_first(trees[i], &search); cur; cur = avl_get_next(&search))
+        array[count++] = cur;
+    qsort(array, count, sizeof(*array), compare_ptrs);
+    sum = 0;
+    for (i = 0; i < count; i++)
+      sum += ((benchnode*)array[i])->key;
+    printf("gather+sort, %2u    %10u nodes %8.3f s\n", k, count, now() - start);
+
+    start = now();
+    assert(avl_kmerge_init(&merge, trees, k, NULL) == 0);
+    for (cur = avl_kmerge_first(&merge); cur; cur = avl_kmerge_next(&merge))
+      sum -= ((benchnode*)cur)->key;
+    avl_kmerge_free(&merge);
+    printf("avl_kmerge, %2u     %10u nodes %8.3f s\n", k, count, now() - start);
+    assert(sum == 0);
+  }
+  free(buckets);
+  free(array);
+}
+
+static unsigned long DiffCount;
+static void count_diff(struct avltree *tree, struct avlbind *node, void *context) {
+  DiffCount++;
+}
+
+/****************************************************************
+ DiffBench
+ Finds the keys in only one of two trees, 1 in 1000 of them
+ changed, stepping a cursor through each against avl_diff(),
+ and then avl_diff() with the left half of the trees shared
+ ****************************************************************/
+static void DiffBench(benchnode *nodes, unsigned n) {
+  struct avlsearch sa, sb;
+  struct avlbind *ca, *cb, *left;
+  benchtree a, b, c;
+  benchnode root;
+  unsigned i, half = n / 2;
+  unsigned long count;
+  double start;
+  int cmp;
+
+  InitTree(&a);
+  InitTree(&b);
+  for (i = 0; i < half; i++) {
+    a.key = nodes[i].key = Random();
+    avl_insert(&a.tree, &nodes[i].node);
+    b.key = nodes[half + i].key = i % 1000 ? nodes[i].key : Random();
+    avl_insert(&b.tree, &nodes[half + i].node);
+  }
+
+  start = now();
+  count = 0;
+  ca = avl_get_first(&a.tree, &sa);
+  cb = avl_get_first(&b.tree, &sb);
+  while (ca || cb) {
+    cmp = !ca ? 1 : !cb ? -1 : compare_nodes(&a.tree, ca, cb);
+    if (cmp != 0)
+      count++;
+    if (cmp <= 0)
+      ca = avl_get_next(&sa);
+    if (cmp >= 0)
+      cb = avl_get_next(&sb);
+  }
+  printf("diff, cursors      %10u nodes %8.3f s  %lu differ\n", half, now() - start, count);
+
+  start = now();
+  DiffCount = 0;
+  avl_diff(&a.tree, &b.tree, count_diff, count_diff, NULL);
+  assert(DiffCount == count);
+  printf("diff, avl_diff     %10u nodes %8.3f s\n", half, now() - start);
+
+  /* c has the left subtree of a, and the right half of b */
+  InitTree(&c);
+  root.key = ((benchnode*)a.tree.root)->key;
+  left = a.tree.root->left;
+  for (i = half; i < n; i++) {
+    if (nodes[i].key > root.key) {
+      c.key = nodes[i].key;
+      avl_insert(&c.tree, &nodes[i].node);
+    }
+  }
+  root.node.left = left;
+  root.node.right = c.tree.root;
+  root.node.balance = avl_height(c.tree.root) - avl_height(left);
+  c.tree.root = &root.node;
+  start = now();
+  DiffCount = 0;
+  avl_diff(&a.tree, &c.tree, count_diff, count_diff, NULL);
+  printf("diff, half shared  %10u nodes %8.3f s  %lu differ\n", half, now() - start, DiffCount);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned n = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 0) : 4000000;
+  unsigned maxthreads = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 0) : 64;
+  benchnode *nodes;
+
+  nodes = malloc(n * sizeof(*nodes));
+  assert(nodes);
+  InsertBench(nodes, n);
+  BuildBench(nodes, n, maxthreads);
+  ReduceBench(nodes, n, maxthreads);
+  RelayoutBench(nodes, n);
+  RangeBench(nodes, n);
+  FrozenBench(nodes, n);
+  HashBench(nodes, n);
+  BloomBench(nodes, n);
+  BufferBench(nodes, n);
+  CacheBench(nodes, n);
+  MergeBench(nodes, n);
+  KMergeBench(nodes, n);
+  DiffBench(nodes, n);
+  StringBench(n);
+  DurableBench(nodes, n);
+  PagedBench(nodes, n);
+  free(nodes);
+  return 0;
+}
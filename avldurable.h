@@ -0,0 +1,504 @@
+/****************************************************************
+
+	AVL tree durability
+
+	keeps a tree recoverable after a crash with a write-ahead log
+	of its inserts and deletes, plus checkpoints of the whole
+	tree. Log records are gathered into groups and written, and
+	synced according to the sync policy, one group at a time.
+	A checkpoint is written to a temporary file that is synced
+	and renamed over the last one, and then the log restarts.
+	The checkpoint and the log carry a generation number, so a
+	log that the checkpoint already covers is never replayed.
+
+	Both files are a magic string and the generation as 8 bytes,
+	then records of a 4 byte length, a type byte, the payload
+	and a CRC-32 of the type and payload. Replay stops at the
+	first short or damaged record, which is where a crash in the
+	middle of a write leaves off, and the log is cut back there.
+
+	POSIX only
+
+	this software is placed in the public domain
+	provided that you use it at your own risk
+
+****************************************************************/
+
+#ifndef AVLDURABLE_H
+#define AVLDURABLE_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "avlsearch.h"
+
+#define AVL_LOG_MAGIC "AVLWAL1\n"
+#define AVL_CHECKPOINT_MAGIC "AVLCKP1\n"
+#define AVL_DURABLE_MAX_RECORD 4096
+
+#define AVL_REC_INSERT	1
+#define AVL_REC_DELETE	2
+#define AVL_REC_END		3		/* closes a checkpoint */
+
+/* when a group of log records is written out */
+#define AVL_SYNC_NONE	0		/* write(), let the system flush it */
+#define AVL_SYNC_BATCH	1		/* write() and fdatasync() per group */
+#define AVL_SYNC_ALWAYS	2		/* write() and fdatasync() per record */
+
+struct avldurable
+{
+	struct avltree *tree;
+	/* copies a node's key and value out, returns the length */
+	size_t (*encode_node)(struct avltree *tree, struct avlbind *node, unsigned char *buf, size_t max);
+	/* makes a node from an encoded one, and sets the search key to it */
+	struct avlbind *(*decode_node)(struct avltree *tree, const unsigned char *buf, size_t len);
+	/* copies the search key out, returns the length */
+	size_t (*encode_key)(struct avltree *tree, unsigned char *buf, size_t max);
+	/* sets the search key from an encoded one */
+	void (*decode_key)(struct avltree *tree, const unsigned char *buf, size_t len);
+	/* releases a node the replay made or removed */
+	void (*free_node)(struct avltree *tree, struct avlbind *node);
+
+	int sync_policy;			/* AVL_SYNC_ */
+	unsigned group_records;		/* records per group commit, 0 for 1 */
+	size_t checkpoint_bytes;	/* log size that starts a checkpoint, 0 never */
+
+	/* set by avl_durable_open() */
+	const char *log_path;
+	const char *checkpoint_path;
+	int fd;
+	unsigned long long generation;
+	size_t log_bytes;
+	unsigned char *buf;			/* records not yet written */
+	size_t used, size;
+	unsigned pending;
+	unsigned long replayed;		/* log records applied on open */
+	unsigned long syncs;
+	int error;
+};
+
+/****************************************************************
+	avl_crc32()
+	the usual reflected CRC-32, as in zlib
+****************************************************************/
+static unsigned long avl_crc32(unsigned long crc, const unsigned char *p, size_t len)
+{
+	static unsigned long table[256];
+	unsigned long c;
+	int i, k;
+
+	if (table[1] == 0)
+	{
+		for (i = 0; i < 256; i++)
+		{
+			c = (unsigned long)i;
+			for (k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+	crc = ~crc & 0xffffffffUL;
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc & 0xffffffffUL;
+}
+
+static void avl_put32(unsigned char *p, unsigned long v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+static unsigned long avl_get32(const unsigned char *p)
+{
+	return p[0] | (unsigned long)p[1] << 8 | (unsigned long)p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+static int avl_write_all(int fd, const unsigned char *p, size_t len)
+{
+	ssize_t n;
+
+	while (len)
+	{
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+/* the header of either file; the generation is little endian */
+static int avl_write_header(int fd, const char *magic, unsigned long long generation)
+{
+	unsigned char head[16];
+
+	memcpy(head, magic, 8);
+	avl_put32(head + 8, (unsigned long)(generation & 0xffffffffUL));
+	avl_put32(head + 12, (unsigned long)(generation >> 32));
+	return avl_write_all(fd, head, 16);
+}
+
+static int avl_read_header(FILE *file, const char *magic, unsigned long long *generation)
+{
+	unsigned char head[16];
+
+	if (fread(head, 1, 16, file) != 16 || memcmp(head, magic, 8) != 0)
+		return -1;
+	*generation = avl_get32(head + 8) | (unsigned long long)avl_get32(head + 12) << 32;
+	return 0;
+}
+
+/* appends one record to a buffer, growing it as needed */
+static int avl_buffer_record(unsigned char **buf, size_t *used, size_t *size, int type,
+	const unsigned char *payload, size_t len)
+{
+	unsigned char *p;
+	size_t need = *used + len + 9;
+
+	if (need > *size)
+	{
+		p = (unsigned char *)realloc(*buf, need * 2);
+		if (p == NULL)
+			return -1;
+		*buf = p;
+		*size = need * 2;
+	}
+	p = *buf + *used;
+	avl_put32(p, (unsigned long)len);
+	p[4] = (unsigned char)type;
+	memcpy(p + 5, payload, len);
+	avl_put32(p + 5 + len, avl_crc32(0, p + 4, len + 1));
+	*used = need;
+	return 0;
+}
+
+/****************************************************************
+	avl_read_record()
+	reads the next record of either file into a buffer of
+	AVL_DURABLE_MAX_RECORD bytes. returns its type, 0 at a clean
+	end, or -1 at a short or damaged record
+****************************************************************/
+static int avl_read_record(FILE *file, unsigned char *payload, size_t *len)
+{
+	unsigned char head[5], tail[4];
+	size_t n;
+
+	n = fread(head, 1, 5, file);
+	if (n == 0)
+		return 0;
+	if (n != 5 || (*len = avl_get32(head)) > AVL_DURABLE_MAX_RECORD)
+		return -1;
+	if (fread(payload, 1, *len, file) != *len || fread(tail, 1, 4, file) != 4)
+		return -1;
+	if (avl_get32(tail) != avl_crc32(avl_crc32(0, head + 4, 1), payload, *len))
+		return -1;
+	return head[4];
+}
+
+/* applies one logged change to the tree */
+static void avl_durable_apply(struct avldurable *d, int type, const unsigned char *payload, size_t len)
+{
+	struct avlbind *node, *tmp;
+
+	if (type == AVL_REC_INSERT)
+	{
+		node = (*d->decode_node)(d->tree, payload, len);
+		tmp = avl_insert(d->tree, node);
+		if (tmp != node)
+			(*d->free_node)(d->tree, node);
+	}
+	else if (type == AVL_REC_DELETE)
+	{
+		(*d->decode_key)(d->tree, payload, len);
+		tmp = avl_delete(d->tree);
+		if (tmp)
+			(*d->free_node)(d->tree, tmp);
+	}
+}
+
+/* writes the pending group of records, and syncs it per the policy */
+static void avl_durable_flush(struct avldurable *d)
+{
+	if (d->used == 0)
+		return;
+	if (avl_write_all(d->fd, d->buf, d->used) != 0)
+		d->error = 1;
+	else if (d->sync_policy != AVL_SYNC_NONE)
+	{
+		if (fdatasync(d->fd) != 0)
+			d->error = 1;
+		d->syncs++;
+	}
+	d->log_bytes += d->used;
+	d->used = 0;
+	d->pending = 0;
+}
+
+int avl_durable_checkpoint(struct avldurable *d);
+
+/****************************************************************
+	avl_durable_commit()
+		writes the pending group of log records, and syncs it
+		unless the policy is AVL_SYNC_NONE. Starts a checkpoint
+		once the log has grown past checkpoint_bytes
+		returns 0, or -1 if anything failed since the open
+****************************************************************/
+int avl_durable_commit(struct avldurable *d)
+{
+	avl_durable_flush(d);
+	if (d->checkpoint_bytes && d->log_bytes > d->checkpoint_bytes)
+		avl_durable_checkpoint(d);
+	return d->error ? -1 : 0;
+}
+
+static void avl_durable_log(struct avldurable *d, int type, const unsigned char *payload, size_t len)
+{
+	if (avl_buffer_record(&d->buf, &d->used, &d->size, type, payload, len) != 0)
+	{
+		d->error = 1;
+		return;
+	}
+	if (d->sync_policy == AVL_SYNC_ALWAYS || ++d->pending >= d->group_records)
+		avl_durable_commit(d);
+}
+
+/* opens the directory holding path, to sync its entries */
+static int avl_open_dir(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char *dir;
+	size_t len;
+	int fd;
+
+	if (slash == NULL)
+		return open(".", O_RDONLY);
+	len = slash == path ? 1 : (size_t)(slash - path);
+	dir = (char *)malloc(len + 1);
+	if (dir == NULL)
+		return -1;
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+	fd = open(dir, O_RDONLY);
+	free(dir);
+	return fd;
+}
+
+/****************************************************************
+	avl_durable_checkpoint()
+		writes the whole tree out as the new checkpoint and
+		restarts the log, which holds only what follows it
+		returns 0, or -1 on an error. Up to the rename the old
+		checkpoint and log still recover the tree then; once the
+		new checkpoint is in place it is the live one, and if
+		the directory cannot be synced the error is latched,
+		since a crash could yet bring back the old checkpoint
+****************************************************************/
+int avl_durable_checkpoint(struct avldurable *d)
+{
+	unsigned char record[AVL_DURABLE_MAX_RECORD];
+	unsigned char *buf = NULL;
+	size_t used = 0, size = 0, len, plen;
+	struct avlsearch search;
+	struct avlbind *cur;
+	char *tmp_path;
+	int fd, dir_fd = -1, ok;
+
+	/* the log must hold everything, should the checkpoint fail */
+	avl_durable_flush(d);
+
+	plen = strlen(d->checkpoint_path);
+	tmp_path = (char *)malloc(plen + 5);
+	if (tmp_path == NULL)
+		return -1;
+	memcpy(tmp_path, d->checkpoint_path, plen);
+	memcpy(tmp_path + plen, ".tmp", 5);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ok = fd >= 0 && avl_write_header(fd, AVL_CHECKPOINT_MAGIC, d->generation + 1) == 0;
+	for (cur = avl_get_first(d->tree, &search); ok && cur; cur = avl_get_next(&search))
+	{
+		len = (*d->encode_node)(d->tree, cur, record, sizeof(record));
+		ok = avl_buffer_record(&buf, &used, &size, AVL_REC_INSERT, record, len) == 0;
+		if (ok && used >= 65536)
+		{
+			ok = avl_write_all(fd, buf, used) == 0;
+			used = 0;
+		}
+	}
+	ok = ok && avl_buffer_record(&buf, &used, &size, AVL_REC_END, record, 0) == 0;
+	ok = ok && avl_write_all(fd, buf, used) == 0;
+	ok = ok && fsync(fd) == 0;
+	if (fd >= 0)
+		ok = close(fd) == 0 && ok;
+	ok = ok && (dir_fd = avl_open_dir(d->checkpoint_path)) >= 0;
+	ok = ok && rename(tmp_path, d->checkpoint_path) == 0;
+	free(buf);
+	if (!ok)
+	{
+		if (dir_fd >= 0)
+			close(dir_fd);
+		unlink(tmp_path);
+		free(tmp_path);
+		return -1;
+	}
+	free(tmp_path);
+
+	/* the new checkpoint is in place, and an open would reject a log
+	 of the old generation, so there is no going back now. The rename
+	 is only durable once the directory is synced */
+	if (fsync(dir_fd) != 0)
+		d->error = 1;
+	close(dir_fd);
+
+	/* the new checkpoint covers the old log, so start another */
+	d->generation++;
+	if (ftruncate(d->fd, 0) != 0 || lseek(d->fd, 0, SEEK_SET) != 0 ||
+		avl_write_header(d->fd, AVL_LOG_MAGIC, d->generation) != 0 ||
+		(d->sync_policy != AVL_SYNC_NONE && fdatasync(d->fd) != 0))
+		d->error = 1;
+	d->log_bytes = 16;
+	return d->error ? -1 : 0;
+}
+
+/****************************************************************
+	avl_durable_open()
+		loads an empty tree from the checkpoint, if there is one,
+		and replays the log after it. The callbacks and tuning
+		fields must be set before the call. The path strings must
+		stay put until avl_durable_close()
+		returns 0, or -1 if the files cannot be used
+****************************************************************/
+int avl_durable_open(struct avldurable *d, struct avltree *tree,
+	const char *log_path, const char *checkpoint_path)
+{
+	unsigned char payload[AVL_DURABLE_MAX_RECORD];
+	unsigned long long log_generation;
+	FILE *file;
+	size_t len;
+	long good;
+	int type;
+
+	d->tree = tree;
+	d->log_path = log_path;
+	d->checkpoint_path = checkpoint_path;
+	d->fd = -1;
+	d->generation = 0;
+	d->log_bytes = 0;
+	d->buf = NULL;
+	d->used = d->size = 0;
+	d->pending = 0;
+	d->replayed = 0;
+	d->syncs = 0;
+	d->error = 0;
+	if (d->group_records == 0)
+		d->group_records = 1;
+
+	/* a checkpoint is only ever renamed into place whole */
+	file = fopen(checkpoint_path, "rb");
+	if (file)
+	{
+		if (avl_read_header(file, AVL_CHECKPOINT_MAGIC, &d->generation) != 0)
+		{
+			fclose(file);
+			return -1;
+		}
+		while ((type = avl_read_record(file, payload, &len)) == AVL_REC_INSERT)
+			avl_durable_apply(d, type, payload, len);
+		fclose(file);
+		if (type != AVL_REC_END)
+			return -1;
+	}
+
+	file = fopen(log_path, "rb");
+	good = 0;
+	if (file)
+	{
+		if (avl_read_header(file, AVL_LOG_MAGIC, &log_generation) == 0 &&
+			log_generation == d->generation)
+		{
+			good = 16;
+			while ((type = avl_read_record(file, payload, &len)) > 0)
+			{
+				avl_durable_apply(d, type, payload, len);
+				d->replayed++;
+				good = ftell(file);
+			}
+		}
+		fclose(file);
+	}
+
+	d->fd = open(log_path, O_WRONLY | O_CREAT, 0644);
+	if (d->fd < 0)
+		return -1;
+	if (good == 0)
+	{
+		/* no log, or one from before the checkpoint */
+		if (ftruncate(d->fd, 0) != 0 || avl_write_header(d->fd, AVL_LOG_MAGIC, d->generation) != 0 ||
+			fdatasync(d->fd) != 0)
+			return -1;
+		good = 16;
+	}
+	else if (ftruncate(d->fd, good) != 0 || lseek(d->fd, good, SEEK_SET) != good)
+		return -1;
+	d->log_bytes = (size_t)good;
+	return 0;
+}
+
+/****************************************************************
+	avl_durable_insert()
+		inserts a node, whose key must be set in the tree as for
+		avl_insert(), and logs it. The insert is durable once the
+		group holding it is committed
+****************************************************************/
+struct avlbind *avl_durable_insert(struct avldurable *d, struct avlbind *node)
+{
+	unsigned char record[AVL_DURABLE_MAX_RECORD];
+	struct avlbind *tmp;
+
+	tmp = avl_insert(d->tree, node);
+	if (tmp == node)
+		avl_durable_log(d, AVL_REC_INSERT, record, (*d->encode_node)(d->tree, node, record, sizeof(record)));
+	return tmp;
+}
+
+/****************************************************************
+	avl_durable_delete()
+		deletes the node matching the search key, as avl_delete()
+		does, and logs it
+****************************************************************/
+struct avlbind *avl_durable_delete(struct avldurable *d)
+{
+	unsigned char record[AVL_DURABLE_MAX_RECORD];
+	struct avlbind *tmp;
+
+	tmp = avl_delete(d->tree);
+	if (tmp)
+		avl_durable_log(d, AVL_REC_DELETE, record, (*d->encode_key)(d->tree, record, sizeof(record)));
+	return tmp;
+}
+
+/****************************************************************
+	avl_durable_close()
+		commits what is pending and closes the log. The tree and
+		its nodes stay with the caller
+		returns 0, or -1 if anything failed since the open
+****************************************************************/
+int avl_durable_close(struct avldurable *d)
+{
+	d->checkpoint_bytes = 0;
+	avl_durable_commit(d);
+	if (d->fd >= 0 && close(d->fd) != 0)
+		d->error = 1;
+	d->fd = -1;
+	free(d->buf);
+	d->buf = NULL;
+	return d->error ? -1 : 0;
+}
+
+#endif /* AVLDURABLE_H */
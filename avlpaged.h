@@ -0,0 +1,813 @@
+/****************************************************************
+
+	AVL trees on disk
+
+	a variant of the tree for indexes larger than memory. Nodes
+	live in fixed size slots of the pages of a file, and link to
+	each other by node IDs, page number times AVL_PAGE_SLOTS plus
+	slot, with 0 for none. Pages come through a buffer pool of a
+	set number of frames, replaced by the CLOCK algorithm; a
+	node is pinned while it is being read or changed, which
+	keeps its frame in the pool. At most three nodes are pinned
+	at once, during a double rotation.
+
+	A new node goes into its parent's page when there is room,
+	so that the top levels of each subtree cluster together and
+	a descent crosses fewer pages than it has levels; failing
+	that, into the page of one of the few ancestors above it.
+	A delete clears its slot's bit, and the slot is used again;
+	pages are never given back, so the file does not shrink.
+	Cursors step both ways, and any change invalidates them.
+
+	Page 0 holds the header: the node size, root, node count
+	and page count. The file is in native byte order, and is
+	only consistent after avl_paged_flush() or avl_paged_close()
+
+	POSIX only
+
+	this software is placed in the public domain
+	provided that you use it at your own risk
+
+****************************************************************/
+
+#ifndef AVLPAGED_H
+#define AVLPAGED_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include "avlsearch.h"
+
+#ifndef AVL_PAGE_SIZE
+#define AVL_PAGE_SIZE 4096
+#endif
+#define AVL_PAGE_SLOTS 64		/* most slots in one page, a bit each */
+#define AVL_PAGED_MAGIC "AVLPGD1\n"
+/* the smallest pool: three pinned nodes, and a frame to bring in more */
+#define AVL_PAGED_MIN_FRAMES 4
+
+/* the links at the front of each node, its data follows */
+struct avlpnode
+{
+	unsigned long left;
+	unsigned long right;
+	int balance;
+};
+
+#define AVL_PAGED_DATA(node) ((void *)((struct avlpnode *)(node) + 1))
+
+struct avlframe
+{
+	unsigned long page;
+	unsigned char *data;
+	unsigned pins;
+	unsigned char used;			/* CLOCK reference bit */
+	unsigned char dirty;
+	unsigned char valid;
+};
+
+struct avlpaged
+{
+	/* compares the search key against a node, as compare_key_tree */
+	int (*compare_key)(struct avlpaged *tree, const struct avlpnode *node);
+	unsigned long root;
+	unsigned long num_nodes;
+
+	/* set by avl_paged_open() */
+	int fd;
+	size_t node_size;			/* slot stride, rounded up for alignment */
+	size_t data_size;
+	unsigned slots;				/* per page */
+	unsigned long num_pages;
+	struct avlframe *frames;
+	unsigned num_frames;
+	unsigned hand;
+	unsigned *table;			/* page to frame + 1, open addressing */
+	size_t mask;
+	unsigned long reads, writes;	/* page I/O so far */
+	int error;
+};
+
+/* the header stored in page 0 */
+struct avlpagedheader
+{
+	char magic[8];
+	unsigned long node_size;
+	unsigned long root;
+	unsigned long num_nodes;
+	unsigned long num_pages;
+};
+
+static size_t avl_paged_slot(struct avlpaged *tree, unsigned long page)
+{
+	size_t i = (page * 2654435761UL) & tree->mask;
+
+	while (tree->table[i] && tree->frames[tree->table[i] - 1].page != page)
+		i = (i + 1) & tree->mask;
+	return i;
+}
+
+/* drops a page from the lookup table, shifting later entries back */
+static void avl_paged_unmap(struct avlpaged *tree, unsigned long page)
+{
+	size_t i = avl_paged_slot(tree, page), j, home;
+
+	for (j = (i + 1) & tree->mask; tree->table[j]; j = (j + 1) & tree->mask)
+	{
+		home = (tree->frames[tree->table[j] - 1].page * 2654435761UL) & tree->mask;
+		if (((j - home) & tree->mask) >= ((j - i) & tree->mask))
+		{
+			tree->table[i] = tree->table[j];
+			i = j;
+		}
+	}
+	tree->table[i] = 0;
+}
+
+static void avl_paged_write(struct avlpaged *tree, struct avlframe *frame)
+{
+	if (pwrite(tree->fd, frame->data, AVL_PAGE_SIZE, (off_t)frame->page * AVL_PAGE_SIZE) != AVL_PAGE_SIZE)
+		tree->error = 1;
+	tree->writes++;
+	frame->dirty = 0;
+}
+
+/****************************************************************
+	avl_paged_page()
+	brings a page into the pool, choosing a victim frame with
+	the CLOCK hand: used frames get a second chance, pinned
+	ones are passed over. fresh pages are not read
+	returns the frame
+****************************************************************/
+static struct avlframe *avl_paged_page(struct avlpaged *tree, unsigned long page, int fresh)
+{
+	struct avlframe *frame;
+	size_t i = avl_paged_slot(tree, page);
+
+	if (tree->table[i])
+	{
+		frame = &tree->frames[tree->table[i] - 1];
+		frame->used = 1;
+		return frame;
+	}
+
+	/* there is always an unpinned frame, see AVL_PAGED_MIN_FRAMES */
+	for (;; tree->hand = (tree->hand + 1) % tree->num_frames)
+	{
+		frame = &tree->frames[tree->hand];
+		if (!frame->valid)
+			break;
+		if (frame->pins)
+			continue;
+		if (!frame->used)
+			break;
+		frame->used = 0;
+	}
+	tree->hand = (tree->hand + 1) % tree->num_frames;
+	if (frame->valid)
+	{
+		if (frame->dirty)
+			avl_paged_write(tree, frame);
+		avl_paged_unmap(tree, frame->page);
+	}
+
+	frame->page = page;
+	frame->valid = 1;
+	frame->used = 1;
+	frame->dirty = 0;
+	if (fresh)
+		memset(frame->data, 0, AVL_PAGE_SIZE);
+	else
+	{
+		if (pread(tree->fd, frame->data, AVL_PAGE_SIZE, (off_t)page * AVL_PAGE_SIZE) != AVL_PAGE_SIZE)
+		{
+			memset(frame->data, 0, AVL_PAGE_SIZE);
+			tree->error = 1;
+		}
+		tree->reads++;
+	}
+	tree->table[avl_paged_slot(tree, page)] = (unsigned)(frame - tree->frames) + 1;
+	return frame;
+}
+
+/****************************************************************
+	avl_paged_pin()
+		returns a node, held in the pool until avl_paged_unpin()
+****************************************************************/
+struct avlpnode *avl_paged_pin(struct avlpaged *tree, unsigned long id)
+{
+	struct avlframe *frame = avl_paged_page(tree, id / AVL_PAGE_SLOTS, 0);
+
+	frame->pins++;
+	return (struct avlpnode *)(frame->data + 8 + (id % AVL_PAGE_SLOTS) * tree->node_size);
+}
+
+/****************************************************************
+	avl_paged_unpin()
+		releases a pinned node, marking its page for writing
+		back if the node was changed
+****************************************************************/
+void avl_paged_unpin(struct avlpaged *tree, unsigned long id, int dirty)
+{
+	struct avlframe *frame = &tree->frames[tree->table[avl_paged_slot(tree, id / AVL_PAGE_SLOTS)] - 1];
+
+	DBG_ASSERT(frame->pins > 0);
+	frame->pins--;
+	if (dirty)
+		frame->dirty = 1;
+}
+
+/****************************************************************
+	avl_paged_open()
+		opens a tree file, creating it if need be, with a pool of
+		num_frames pages. node_size counts the avlpnode links and
+		the data after them; an existing file must agree
+		returns 0, or -1 on an error
+****************************************************************/
+int avl_paged_open(struct avlpaged *tree, const char *path, size_t node_size, unsigned num_frames)
+{
+	struct avlpagedheader head;
+	unsigned i;
+	ssize_t n;
+
+	tree->fd = -1;
+	tree->frames = NULL;
+	tree->table = NULL;
+	tree->reads = tree->writes = 0;
+	tree->error = 0;
+	tree->hand = 0;
+	if (num_frames < AVL_PAGED_MIN_FRAMES)
+		num_frames = AVL_PAGED_MIN_FRAMES;
+	if (node_size < sizeof(struct avlpnode) || node_size > (AVL_PAGE_SIZE - 8) / 2)
+		return -1;
+	tree->data_size = node_size - sizeof(struct avlpnode);
+	tree->node_size = (node_size + sizeof(unsigned long) - 1) & ~(sizeof(unsigned long) - 1);
+	tree->slots = (unsigned)((AVL_PAGE_SIZE - 8) / tree->node_size);
+	if (tree->slots > AVL_PAGE_SLOTS)
+		tree->slots = AVL_PAGE_SLOTS;
+
+	tree->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (tree->fd < 0)
+		return -1;
+	n = pread(tree->fd, &head, sizeof(head), 0);
+	if (n == 0)
+	{
+		tree->root = 0;
+		tree->num_nodes = 0;
+		tree->num_pages = 1;
+	}
+	else if (n != sizeof(head) || memcmp(head.magic, AVL_PAGED_MAGIC, 8) != 0 ||
+		head.node_size != node_size)
+	{
+		close(tree->fd);
+		return -1;
+	}
+	else
+	{
+		tree->root = head.root;
+		tree->num_nodes = head.num_nodes;
+		tree->num_pages = head.num_pages;
+	}
+
+	tree->num_frames = num_frames;
+	for (tree->mask = 1; tree->mask < 2 * (size_t)num_frames; tree->mask *= 2)
+		;
+	tree->table = (unsigned *)calloc(tree->mask, sizeof(unsigned));
+	tree->mask--;
+	tree->frames = (struct avlframe *)calloc(num_frames, sizeof(struct avlframe));
+	if (tree->table == NULL || tree->frames == NULL)
+		goto fail;
+	for (i = 0; i < num_frames; i++)
+	{
+		tree->frames[i].data = (unsigned char *)malloc(AVL_PAGE_SIZE);
+		if (tree->frames[i].data == NULL)
+			goto fail;
+	}
+	return 0;
+
+fail:
+	for (i = 0; tree->frames && i < num_frames; i++)
+		free(tree->frames[i].data);
+	free(tree->frames);
+	free(tree->table);
+	close(tree->fd);
+	return -1;
+}
+
+/****************************************************************
+	avl_paged_flush()
+		writes back the changed pages and the header
+		returns 0, or -1 if any I/O failed since the open
+****************************************************************/
+int avl_paged_flush(struct avlpaged *tree)
+{
+	struct avlpagedheader head;
+	unsigned i;
+
+	for (i = 0; i < tree->num_frames; i++)
+	{
+		if (tree->frames[i].valid && tree->frames[i].dirty)
+			avl_paged_write(tree, &tree->frames[i]);
+	}
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, AVL_PAGED_MAGIC, 8);
+	head.node_size = tree->data_size + sizeof(struct avlpnode);
+	head.root = tree->root;
+	head.num_nodes = tree->num_nodes;
+	head.num_pages = tree->num_pages;
+	if (pwrite(tree->fd, &head, sizeof(head), 0) != sizeof(head))
+		tree->error = 1;
+	return tree->error ? -1 : 0;
+}
+
+/****************************************************************
+	avl_paged_close()
+		flushes the tree and frees the pool
+		returns 0, or -1 if any I/O failed since the open
+****************************************************************/
+int avl_paged_close(struct avlpaged *tree)
+{
+	unsigned i;
+
+	avl_paged_flush(tree);
+	if (close(tree->fd) != 0)
+		tree->error = 1;
+	for (i = 0; i < tree->num_frames; i++)
+		free(tree->frames[i].data);
+	free(tree->frames);
+	free(tree->table);
+	return tree->error ? -1 : 0;
+}
+
+/* the first free slot in a page, or slots if it is full */
+static unsigned avl_paged_free_slot(struct avlpaged *tree, struct avlframe *frame)
+{
+	unsigned long long bits;
+	unsigned slot;
+
+	memcpy(&bits, frame->data, 8);
+	for (slot = 0; slot < tree->slots && bits >> slot & 1; slot++)
+		;
+	return slot;
+}
+
+/* how many ancestors' pages a new node may go into */
+#ifndef AVL_PAGED_CLUSTER
+#define AVL_PAGED_CLUSTER 4
+#endif
+
+/* marks a slot of a page taken, returns the node ID */
+static unsigned long avl_paged_take(struct avlframe *frame, unsigned slot)
+{
+	unsigned long long bits;
+
+	memcpy(&bits, frame->data, 8);
+	bits |= 1ULL << slot;
+	memcpy(frame->data, &bits, 8);
+	frame->dirty = 1;
+	return frame->page * AVL_PAGE_SLOTS + slot;
+}
+
+/* gives a node's slot back to its page */
+static void avl_paged_free(struct avlpaged *tree, unsigned long id)
+{
+	struct avlframe *frame = avl_paged_page(tree, id / AVL_PAGE_SLOTS, 0);
+	unsigned long long bits;
+
+	memcpy(&bits, frame->data, 8);
+	bits &= ~(1ULL << (id % AVL_PAGE_SLOTS));
+	memcpy(frame->data, &bits, 8);
+	frame->dirty = 1;
+}
+
+/* a free slot in the page of the nearest of the last few nodes on
+ the path that has one, else in a new page */
+static unsigned long avl_paged_alloc(struct avlpaged *tree, unsigned long *path, int level)
+{
+	struct avlframe *frame;
+	unsigned slot;
+	int i;
+
+	for (i = level - 1; i >= 0 && i >= level - AVL_PAGED_CLUSTER; i--)
+	{
+		frame = avl_paged_page(tree, path[i] / AVL_PAGE_SLOTS, 0);
+		slot = avl_paged_free_slot(tree, frame);
+		if (slot < tree->slots)
+			return avl_paged_take(frame, slot);
+	}
+	frame = avl_paged_page(tree, tree->num_pages++, 1);
+	return avl_paged_take(frame, 0);
+}
+
+/****************************************************************
+	avl_paged_search()
+		returns the ID of the node matching the search key,
+		or 0 if there is none
+****************************************************************/
+unsigned long avl_paged_search(struct avlpaged *tree)
+{
+	unsigned long id = tree->root, next;
+	struct avlpnode *node;
+	int cmp;
+
+	while (id)
+	{
+		node = avl_paged_pin(tree, id);
+		cmp = (*tree->compare_key)(tree, node);
+		next = cmp < 0 ? node->left : node->right;
+		avl_paged_unpin(tree, id, 0);
+		if (cmp == 0)
+			return id;
+		id = next;
+	}
+	return 0;
+}
+
+static unsigned long *avl_paged_link(struct avlpnode *node, int dir)
+{
+	return dir > 0 ? &node->right : &node->left;
+}
+
+/* points the parent of the node at path[level], or the root, at id */
+static void avl_paged_relink(struct avlpaged *tree, unsigned long *path, int *dirs, int level,
+	unsigned long id)
+{
+	struct avlpnode *node;
+
+	if (level == 0)
+		tree->root = id;
+	else
+	{
+		node = avl_paged_pin(tree, path[level - 1]);
+		*avl_paged_link(node, dirs[level - 1]) = id;
+		avl_paged_unpin(tree, path[level - 1], 1);
+	}
+}
+
+/****************************************************************
+	avl_paged_insert()
+		inserts a node holding a copy of data, which is
+		node_size less the avlpnode links long, at the search key. As with
+		avl_insert(), an equal node already in the tree wins;
+		inserted, if not NULL, tells which happened
+		returns the ID of the node with the key
+****************************************************************/
+unsigned long avl_paged_insert(struct avlpaged *tree, const void *data, int *inserted)
+{
+	unsigned long path[AVL_MAX_HEIGHT], id, top, p3id, p4id;
+	int dirs[AVL_MAX_HEIGHT];
+	struct avlpnode *node, *p3, *p4;
+	int level, cmp, dir;
+
+	if (inserted)
+		*inserted = 0;
+	/* descend, remembering the path by ID */
+	level = 0;
+	for (id = tree->root; id; level++)
+	{
+		DBG_ASSERT(level < AVL_MAX_HEIGHT);
+		node = avl_paged_pin(tree, id);
+		cmp = (*tree->compare_key)(tree, node);
+		path[level] = id;
+		dirs[level] = cmp < 0 ? -1 : 1;
+		top = *avl_paged_link(node, dirs[level]);
+		avl_paged_unpin(tree, id, 0);
+		if (cmp == 0)
+			return id;			/* no repeats allowed */
+		id = top;
+	}
+
+	/* a new leaf, near its parent if there is room */
+	id = avl_paged_alloc(tree, path, level);
+	node = avl_paged_pin(tree, id);
+	node->left = node->right = 0;
+	node->balance = 0;
+	memcpy(AVL_PAGED_DATA(node), data, tree->data_size);
+	avl_paged_unpin(tree, id, 1);
+	avl_paged_relink(tree, path, dirs, level, id);
+	tree->num_nodes++;
+	if (inserted)
+		*inserted = 1;
+
+	/* walk back up as avl_insert() does, rotating at most once */
+	while (level--)
+	{
+		top = path[level];
+		dir = dirs[level];
+		node = avl_paged_pin(tree, top);
+		if (node->balance != dir)
+		{
+			node->balance += dir;
+			avl_paged_unpin(tree, top, 1);
+			if (node->balance == 0)
+				break;
+			continue;
+		}
+
+		p3id = *avl_paged_link(node, dir);
+		p3 = avl_paged_pin(tree, p3id);
+		if (p3->balance == dir)
+		{
+			/* Same direction, single rotate */
+			*avl_paged_link(node, dir) = *avl_paged_link(p3, -dir);
+			*avl_paged_link(p3, -dir) = top;
+			node->balance = 0;
+			p3->balance = 0;
+			p4id = p3id;
+		}
+		else
+		{
+			/* Need to do a double rotation */
+			p4id = *avl_paged_link(p3, -dir);
+			p4 = avl_paged_pin(tree, p4id);
+			node->balance = p4->balance == dir ? -dir : 0;
+			p3->balance = p4->balance == -dir ? dir : 0;
+			p4->balance = 0;
+			*avl_paged_link(node, dir) = *avl_paged_link(p4, -dir);
+			*avl_paged_link(p3, -dir) = *avl_paged_link(p4, dir);
+			*avl_paged_link(p4, -dir) = top;
+			*avl_paged_link(p4, dir) = p3id;
+			avl_paged_unpin(tree, p4id, 1);
+		}
+		avl_paged_unpin(tree, p3id, 1);
+		avl_paged_unpin(tree, top, 1);
+
+		/* p4id is the new top of the subtree */
+		avl_paged_relink(tree, path, dirs, level, p4id);
+		break;
+	}
+	return id;
+}
+
+/****************************************************************
+	avl_paged_delete()
+		removes the node matching the search key, copying its
+		data out first if data is not NULL. A node with two
+		children is replaced by its successor, and the path is
+		rebalanced on the way up as avl_unlink_current() does,
+		rotating wherever a subtree has become two levels short
+		returns 1, or 0 if there is no such node
+****************************************************************/
+int avl_paged_delete(struct avlpaged *tree, void *data)
+{
+	unsigned long path[AVL_MAX_HEIGHT], id, next, target, child, top, p3id, p4id;
+	int dirs[AVL_MAX_HEIGHT];
+	struct avlpnode *node, *p3, *p4;
+	int level, found, cmp, dir, balance;
+
+	/* descend, remembering the path by ID */
+	level = 0;
+	for (id = tree->root; id; level++)
+	{
+		DBG_ASSERT(level < AVL_MAX_HEIGHT);
+		node = avl_paged_pin(tree, id);
+		cmp = (*tree->compare_key)(tree, node);
+		path[level] = id;
+		dirs[level] = cmp < 0 ? -1 : 1;
+		next = *avl_paged_link(node, dirs[level]);
+		avl_paged_unpin(tree, id, 0);
+		if (cmp == 0)
+			break;
+		id = next;
+	}
+	if (id == 0)
+		return 0;
+	target = id;
+	found = level;
+
+	node = avl_paged_pin(tree, target);
+	if (data)
+		memcpy(data, AVL_PAGED_DATA(node), tree->data_size);
+	if (node->left && node->right)
+	{
+		/* the successor, lowest on the right, takes the node's place */
+		dirs[found] = 1;
+		for (level = found + 1, id = node->right; id; level++)
+		{
+			DBG_ASSERT(level < AVL_MAX_HEIGHT);
+			p3 = avl_paged_pin(tree, id);
+			path[level] = id;
+			dirs[level] = -1;
+			next = p3->left;
+			avl_paged_unpin(tree, id, 0);
+			id = next;
+		}
+		id = path[--level];
+		p3 = avl_paged_pin(tree, id);
+		child = p3->right;
+		p3->left = node->left;
+		p3->right = level == found + 1 ? child : node->right;
+		p3->balance = node->balance;
+		avl_paged_unpin(tree, id, 1);
+		avl_paged_unpin(tree, target, 0);
+		if (level > found + 1)
+		{
+			p3 = avl_paged_pin(tree, path[level - 1]);
+			p3->left = child;
+			avl_paged_unpin(tree, path[level - 1], 1);
+		}
+		path[found] = id;
+		avl_paged_relink(tree, path, dirs, found, id);
+	}
+	else
+	{
+		child = node->left ? node->left : node->right;
+		avl_paged_unpin(tree, target, 0);
+		avl_paged_relink(tree, path, dirs, found, child);
+		level = found;
+	}
+	avl_paged_free(tree, target);
+	tree->num_nodes--;
+
+	/* walk back up; the subtree of path[level] on side dirs[level] is
+	 a level shorter */
+	while (level--)
+	{
+		top = path[level];
+		dir = dirs[level];
+		node = avl_paged_pin(tree, top);
+		balance = node->balance;
+		if (balance != -dir)
+		{
+			/* if it leaned that way it shrinks too, else it stays */
+			node->balance = balance == dir ? 0 : -dir;
+			avl_paged_unpin(tree, top, 1);
+			if (balance == 0)
+				break;
+			continue;
+		}
+
+		p3id = *avl_paged_link(node, -dir);
+		p3 = avl_paged_pin(tree, p3id);
+		balance = p3->balance;
+		if (balance != dir)
+		{
+			/* single rotation, which leaves the height as it was
+			 if the other side was even */
+			*avl_paged_link(node, -dir) = *avl_paged_link(p3, dir);
+			*avl_paged_link(p3, dir) = top;
+			node->balance = balance == 0 ? -dir : 0;
+			p3->balance = balance == 0 ? dir : 0;
+			p4id = p3id;
+		}
+		else
+		{
+			/* double rotation */
+			p4id = *avl_paged_link(p3, dir);
+			p4 = avl_paged_pin(tree, p4id);
+			node->balance = p4->balance == -dir ? dir : 0;
+			p3->balance = p4->balance == dir ? -dir : 0;
+			p4->balance = 0;
+			*avl_paged_link(node, -dir) = *avl_paged_link(p4, dir);
+			*avl_paged_link(p3, dir) = *avl_paged_link(p4, -dir);
+			*avl_paged_link(p4, dir) = top;
+			*avl_paged_link(p4, -dir) = p3id;
+			avl_paged_unpin(tree, p4id, 1);
+		}
+		avl_paged_unpin(tree, p3id, 1);
+		avl_paged_unpin(tree, top, 1);
+		avl_paged_relink(tree, path, dirs, level, p4id);
+		if (balance == 0)
+			break;
+	}
+	return 1;
+}
+
+/****************************************************************
+	paged cursors
+	hold the path from the root down to the current node, and
+	the turn taken at each node on it, so that they can step
+	either way. Any change to the tree invalidates them
+****************************************************************/
+struct avlpagedcursor
+{
+	unsigned long stack[AVL_MAX_HEIGHT];
+	int dirs[AVL_MAX_HEIGHT];
+	int depth;
+};
+
+/* descends from id always turning the same way, returns the node
+ the cursor ends on */
+static unsigned long avl_paged_push(struct avlpaged *tree, struct avlpagedcursor *cursor,
+	unsigned long id, int dir)
+{
+	struct avlpnode *node;
+	unsigned long next;
+
+	while (id)
+	{
+		DBG_ASSERT(cursor->depth < AVL_MAX_HEIGHT);
+		cursor->stack[cursor->depth] = id;
+		cursor->dirs[cursor->depth++] = dir;
+		node = avl_paged_pin(tree, id);
+		next = *avl_paged_link(node, dir);
+		avl_paged_unpin(tree, id, 0);
+		id = next;
+	}
+	return cursor->depth ? cursor->stack[cursor->depth - 1] : 0;
+}
+
+/* climbs until coming up from the side opposite dir, returns the
+ node the cursor ends on */
+static unsigned long avl_paged_climb(struct avlpagedcursor *cursor, int dir)
+{
+	do
+		cursor->depth--;
+	while (cursor->depth > 0 && cursor->dirs[cursor->depth - 1] == dir);
+	return cursor->depth ? cursor->stack[cursor->depth - 1] : 0;
+}
+
+/****************************************************************
+	avl_paged_first()
+		puts the cursor on the lowest node
+		returns its ID, or 0 if the tree is empty
+****************************************************************/
+unsigned long avl_paged_first(struct avlpaged *tree, struct avlpagedcursor *cursor)
+{
+	cursor->depth = 0;
+	return avl_paged_push(tree, cursor, tree->root, -1);
+}
+
+/****************************************************************
+	avl_paged_last()
+		puts the cursor on the highest node
+		returns its ID, or 0 if the tree is empty
+****************************************************************/
+unsigned long avl_paged_last(struct avlpaged *tree, struct avlpagedcursor *cursor)
+{
+	cursor->depth = 0;
+	return avl_paged_push(tree, cursor, tree->root, 1);
+}
+
+/****************************************************************
+	avl_paged_greater_equal()
+		puts the cursor on the lowest node not below the search key
+		returns its ID, or 0 if there is none
+****************************************************************/
+unsigned long avl_paged_greater_equal(struct avlpaged *tree, struct avlpagedcursor *cursor)
+{
+	unsigned long id = tree->root, next;
+	struct avlpnode *node;
+	int cmp;
+
+	cursor->depth = 0;
+	while (id)
+	{
+		DBG_ASSERT(cursor->depth < AVL_MAX_HEIGHT);
+		node = avl_paged_pin(tree, id);
+		cmp = (*tree->compare_key)(tree, node);
+		next = cmp < 0 ? node->left : node->right;
+		avl_paged_unpin(tree, id, 0);
+		cursor->stack[cursor->depth] = id;
+		cursor->dirs[cursor->depth++] = cmp < 0 ? -1 : 1;
+		if (cmp == 0)
+			return id;
+		id = next;
+	}
+	/* fell off the tree: back up to where the key went left */
+	if (cursor->depth == 0)
+		return 0;
+	return cursor->dirs[cursor->depth - 1] < 0 ? cursor->stack[cursor->depth - 1] :
+		avl_paged_climb(cursor, 1);
+}
+
+/* steps the cursor to the neighbour on side dir */
+static unsigned long avl_paged_step(struct avlpaged *tree, struct avlpagedcursor *cursor, int dir)
+{
+	struct avlpnode *node;
+	unsigned long id, next;
+
+	if (cursor->depth == 0)
+		return 0;
+	id = cursor->stack[cursor->depth - 1];
+	node = avl_paged_pin(tree, id);
+	next = *avl_paged_link(node, dir);
+	avl_paged_unpin(tree, id, 0);
+	if (next)
+	{
+		cursor->dirs[cursor->depth - 1] = dir;
+		return avl_paged_push(tree, cursor, next, -dir);
+	}
+	return avl_paged_climb(cursor, dir);
+}
+
+/****************************************************************
+	avl_paged_next()
+		moves the cursor to the next node
+		returns its ID, or 0 past the end
+****************************************************************/
+unsigned long avl_paged_next(struct avlpaged *tree, struct avlpagedcursor *cursor)
+{
+	return avl_paged_step(tree, cursor, 1);
+}
+
+/****************************************************************
+	avl_paged_prev()
+		moves the cursor to the previous node
+		returns its ID, or 0 before the start
+****************************************************************/
+unsigned long avl_paged_prev(struct avlpaged *tree, struct avlpagedcursor *cursor)
+{
+	return avl_paged_step(tree, cursor, -1);
+}
+
+#endif /* AVLPAGED_H */
@@ -0,0 +1,379 @@
+/****************************************************************
+
+  AVL tree trace replay
+  by Ron Niles
+
+  this software is placed in the public domain
+  provided that you use it at your own risk
+
+  plays back a trace written through avltrace.h against a tree
+  keyed by byte strings, compared like memcmp() with the shorter
+  key first on a tie, and reports throughput, latency histograms
+  and, where perf_event_open() is allowed, cache misses.
+
+  build with: cc -O2 avlreplay.c -o avlreplay
+  usage: avlreplay trace
+         avlreplay -s count trace    (writes a synthetic trace)
+
+****************************************************************/
+
+#include "avltrace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+typedef struct replaytree_ {
+  struct avltree tree;
+  const unsigned char *key;
+  size_t len;
+} replaytree;
+
+typedef struct replaynode_ {
+  struct avlbind node;
+  const unsigned char *key;
+  size_t len;
+} replaynode;
+
+typedef struct replayop_ {
+  int op;
+  size_t len;
+  const unsigned char *key;
+  replaynode *node;   /* preallocated for inserts */
+} replayop;
+
+static int compare(struct avltree *tree, struct avlbind *node) {
+  replaytree *t = (replaytree*)tree;
+  replaynode *n = (replaynode*)node;
+  size_t len = t->len < n->len ? t->len : n->len;
+  int cmp = memcmp(t->key, n->key, len);
+  if (cmp)
+    return cmp;
+  return t->len < n->len ? -1 : t->len > n->len ? 1 : 0;
+}
+
+static size_t get_key(struct avltree *tree, unsigned char *buf, size_t max) {
+  replaytree *t = (replaytree*)tree;
+  size_t len = t->len < max ? t->len : max;
+  memcpy(buf, t->key, len);
+  return len;
+}
+
+static const char *OpNames[] = { "", "insert", "delete", "less", "less_equal",
+    "greater", "greater_equal", "seek", "seek_ge", "seek_le", "delete_current",
+    "first", "last", "next", "prev", "find" };
+#define NUM_OPS 16
+#define NUM_BUCKETS 40
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/****************************************************************
+ LoadTrace
+ Reads a whole trace into memory, so that the replay measures
+ only the tree
+ ****************************************************************/
+static replayop *LoadTrace(const char *path, size_t *count) {
+  unsigned char key[AVL_TRACE_MAX_KEY];
+  replayop *ops = NULL;
+  size_t num = 0, max = 0, len;
+  unsigned char *copy;
+  int op, rc;
+  FILE *file;
+
+  file = fopen(path, "rb");
+  if (file == NULL || avl_trace_check(file) != 0) {
+    fprintf(stderr, "%s: not a trace file\n", path);
+    exit(1);
+  }
+  while ((rc = avl_trace_read(file, &op, key, &len)) > 0) {
+    if (num == max) {
+      max = max ? max * 2 : 4096;
+      ops = realloc(ops, max * sizeof(*ops));
+      assert(ops);
+    }
+    copy = malloc(len ? len : 1);
+    assert(copy);
+    memcpy(copy, key, len);
+    ops[num].op = op;
+    ops[num].len = len;
+    ops[num].key = copy;
+    ops[num].node = NULL;
+    if (op == AVL_OP_INSERT) {
+      ops[num].node = malloc(sizeof(replaynode));
+      assert(ops[num].node);
+      ops[num].node->key = copy;
+      ops[num].node->len = len;
+    }
+    num++;
+  }
+  if (rc < 0)
+    fprintf(stderr, "%s: damaged after %lu records\n", path, (unsigned long)num);
+  fclose(file);
+  *count = num;
+  return ops;
+}
+
+/****************************************************************
+ ReplayOne
+ Applies one operation. Cursor steps only follow a cursor that
+ is still valid; any change to the tree invalidates it
+ ****************************************************************/
+static void ReplayOne(replaytree *tree, replayop *op, struct avlsearch *cursor,
+                      int *valid) {
+  struct avlbind *found = NULL;
+
+  tree->key = op->key;
+  tree->len = op->len;
+  switch (op->op) {
+  case AVL_OP_INSERT:
+    avl_insert(&tree->tree, &op->node->node);
+    *valid = 0;
+    return;
+  case AVL_OP_DELETE:
+    avl_delete(&tree->tree);
+    *valid = 0;
+    return;
+  case AVL_OP_DELETE_CURRENT:
+    if (*valid && cursor->current_node && *cursor->current_node)
+      avl_delete_current(&tree->tree, cursor);
+    *valid = 0;
+    return;
+  case AVL_OP_LESS:
+    found = avl_get_less(&tree->tree, cursor);
+    break;
+  case AVL_OP_LESS_EQUAL:
+    found = avl_get_less_equal(&tree->tree, cursor);
+    break;
+  case AVL_OP_GREATER:
+    found = avl_get_greater(&tree->tree, cursor);
+    break;
+  case AVL_OP_GREATER_EQUAL:
+    found = avl_get_greater_equal(&tree->tree, cursor);
+    break;
+  case AVL_OP_SEEK:
+  case AVL_OP_SEEK_GREATER_EQUAL:
+  case AVL_OP_SEEK_LESS_EQUAL:
+    if (!*valid)
+      avl_get_first(&tree->tree, cursor);
+    found = avl_seek(&tree->tree, cursor, op->op == AVL_OP_SEEK ? 0 :
+                     op->op == AVL_OP_SEEK_GREATER_EQUAL ? 1 : -1);
+    break;
+  case AVL_OP_FIND:
+    avl_find(&tree->tree);
+    return;
+  case AVL_OP_FIRST:
+    found = avl_get_first(&tree->tree, cursor);
+    break;
+  case AVL_OP_LAST:
+    found = avl_get_last(&tree->tree, cursor);
+    break;
+  case AVL_OP_NEXT:
+    if (*valid)
+      found = avl_get_next(cursor);
+    break;
+  case AVL_OP_PREV:
+    if (*valid)
+      found = avl_get_prev(cursor);
+    break;
+  }
+  *valid = found != NULL;
+}
+
+static void ResetTree(replaytree *tree) {
+  memset(tree, 0, sizeof(*tree));
+  tree->tree.compare_key_tree = compare;
+}
+
+#ifdef __linux__
+static int OpenCounter(unsigned long long config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+/****************************************************************
+ Replay
+ One untimed pass per operation for throughput and counters,
+ then a second with every operation timed for the histograms
+ ****************************************************************/
+static void Replay(replayop *ops, size_t count) {
+  static unsigned long Hist[NUM_OPS][NUM_BUCKETS];
+  unsigned long total[NUM_BUCKETS], seen, num[NUM_OPS];
+  long long misses = -1, instructions = -1;
+  struct avlsearch cursor;
+  replaytree tree;
+  double start, elapsed, t0, t1;
+  size_t i;
+  int valid, fd[2] = { -1, -1 }, b, op;
+  unsigned long long ns;
+
+#ifdef __linux__
+  fd[0] = OpenCounter(PERF_COUNT_HW_CACHE_MISSES);
+  fd[1] = OpenCounter(PERF_COUNT_HW_INSTRUCTIONS);
+  for (b = 0; b < 2; b++)
+    if (fd[b] >= 0) {
+      ioctl(fd[b], PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd[b], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  ResetTree(&tree);
+  valid = 0;
+  start = now();
+  for (i = 0; i < count; i++)
+    ReplayOne(&tree, &ops[i], &cursor, &valid);
+  elapsed = now() - start;
+#ifdef __linux__
+  for (b = 0; b < 2; b++)
+    if (fd[b] >= 0) {
+      long long value;
+      ioctl(fd[b], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd[b], &value, sizeof(value)) == sizeof(value))
+        *(b ? &instructions : &misses) = value;
+      close(fd[b]);
+    }
+#endif
+
+  printf("%lu operations in %.3f s, %.0f ops/s, %u nodes left\n",
+         (unsigned long)count, elapsed, count / elapsed, tree.tree.num_nodes);
+  if (misses >= 0)
+    printf("cache misses %lld (%.2f per op)\n", misses, (double)misses / count);
+  else
+    printf("cache misses not available (perf_event_open refused)\n");
+  if (instructions >= 0)
+    printf("instructions %lld (%.1f per op)\n", instructions,
+           (double)instructions / count);
+
+  ResetTree(&tree);
+  valid = 0;
+  memset(Hist, 0, sizeof(Hist));
+  for (i = 0; i < count; i++) {
+    t0 = now();
+    ReplayOne(&tree, &ops[i], &cursor, &valid);
+    t1 = now();
+    ns = (unsigned long long)((t1 - t0) * 1e9);
+    for (b = 0; b < NUM_BUCKETS - 1 && (1ULL << b) <= ns; b++)
+      ;
+    Hist[ops[i].op][b]++;
+  }
+
+  /* per operation, the upper bound of the bucket holding each percentile */
+  printf("\n%-15s %10s %10s %10s %10s\n", "op", "count", "p50 ns", "p99 ns",
+         "p99.9 ns");
+  memset(total, 0, sizeof(total));
+  for (op = 1; op < NUM_OPS; op++) {
+    unsigned long p[3] = { 0, 0, 0 };
+    num[op] = 0;
+    for (b = 0; b < NUM_BUCKETS; b++) {
+      num[op] += Hist[op][b];
+      total[b] += Hist[op][b];
+    }
+    if (num[op] == 0)
+      continue;
+    seen = 0;
+    for (b = 0; b < NUM_BUCKETS; b++) {
+      seen += Hist[op][b];
+      if (!p[0] && seen * 2 >= num[op])
+        p[0] = 1UL << b;
+      if (!p[1] && seen * 100 >= num[op] * 99)
+        p[1] = 1UL << b;
+      if (!p[2] && seen * 1000 >= num[op] * 999)
+        p[2] = 1UL << b;
+    }
+    printf("%-15s %10lu %10lu %10lu %10lu\n", OpNames[op], num[op], p[0], p[1],
+           p[2]);
+  }
+  printf("\nlatency histogram, all operations\n");
+  for (b = 0; b < NUM_BUCKETS; b++)
+    if (total[b])
+      printf("  < %8lu ns %10lu\n", 1UL << b, total[b]);
+}
+
+/****************************************************************
+ Synthesize
+ Writes a random trace through the recording hook, handy for
+ trying out the tool
+ ****************************************************************/
+static void Synthesize(const char *path, unsigned long count) {
+  unsigned char keys[4096][8];
+  struct avltrace trace;
+  struct avlsearch cursor;
+  replaynode *nodes;
+  replaytree tree;
+  unsigned long i;
+  unsigned k, j;
+  FILE *file;
+
+  file = fopen(path, "wb");
+  assert(file);
+  nodes = malloc(4096 * sizeof(*nodes));
+  assert(nodes);
+  for (k = 0; k < 4096; k++)
+    for (j = 0; j < 8; j++)
+      keys[k][j] = (unsigned char)rand();
+  ResetTree(&tree);
+  avl_trace_begin(&trace, &tree.tree, file, get_key);
+  for (i = 0; i < count; i++) {
+    k = rand() % 4096;
+    tree.key = keys[k];
+    tree.len = 8;
+    switch (rand() % 4) {
+    case 0:
+      nodes[k].key = keys[k];
+      nodes[k].len = 8;
+      avl_insert(&tree.tree, &nodes[k].node);
+      break;
+    case 1:
+      avl_delete(&tree.tree);
+      break;
+    case 2:
+      if (avl_get_greater_equal(&tree.tree, &cursor))
+        avl_get_next(&cursor);
+      break;
+    default:
+      avl_get_less_equal(&tree.tree, &cursor);
+      break;
+    }
+  }
+  if (avl_trace_end(&trace, &tree.tree) != 0 || fclose(file) != 0) {
+    fprintf(stderr, "%s: write failed\n", path);
+    exit(1);
+  }
+  printf("wrote %lu records to %s\n", trace.records, path);
+  free(nodes);
+}
+
+int main(int argc, char *argv[]) {
+  replayop *ops;
+  size_t count;
+
+  if (argc == 4 && strcmp(argv[1], "-s") == 0) {
+    Synthesize(argv[3], strtoul(argv[2], NULL, 0));
+    return 0;
+  }
+  if (argc != 2) {
+    fprintf(stderr, "usage: avlreplay trace\n"
+            "       avlreplay -s count trace\n");
+    return 2;
+  }
+  ops = LoadTrace(argv[1], &count);
+  Replay(ops, count);
+  return 0;
+}
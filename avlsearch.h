@@ -10,12 +10,29 @@
 
 ****************************************************************/
 
+#ifndef AVLSEARCH_H
+#define AVLSEARCH_H
+
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef AVL_PTHREADS
+#include <pthread.h>
+#endif
 
 #ifndef DBG_ASSERT
 #define DBG_ASSERT(a) 
 #endif
 
+/* deep enough for any tree that fits in a 32 bit address space */
+#define AVL_MAX_HEIGHT 40
+
+/* below this many nodes the bulk operations stay on one thread */
+#ifndef AVL_PARALLEL_CUTOFF
+#define AVL_PARALLEL_CUTOFF 4096
+#endif
+
 struct avlbind
 {
 	struct avlbind *left;
@@ -28,16 +45,78 @@ struct avltree
 	int (*compare_key_tree)(struct avltree *tree, struct avlbind *node);
 	struct avlbind *root;
 	unsigned num_nodes;
+	/* optional, orders two nodes; needed by the bulk operations */
+	int (*compare_nodes)(struct avltree *tree, struct avlbind *lhs, struct avlbind *rhs);
+	/* optional, recomputes a node's subtree aggregate from its children */
+	void (*update_node)(struct avltree *tree, struct avlbind *node);
+	/* nonzero to defer rebalancing to avl_rebalance_step() */
+	int relaxed;
+	/* optional, told of each call made on the tree, see AVL_OP_ */
+	void (*trace_op)(struct avltree *tree, int op, void *context);
+	void *trace_context;
+	/* optional, hash the search key and a node's key alike, for the
+	 side index set up by avl_hash_enable() */
+	unsigned long (*hash_key)(struct avltree *tree);
+	unsigned long (*hash_node)(struct avltree *tree, struct avlbind *node);
+	struct avlhash *hash;
+	/* optional, set up by avl_cache_enable(), uses the same hashes */
+	struct avlcache *cache;
+	/* bumped by every change to the shape of the tree */
+	unsigned long stamp;
+	/* set up by avl_freeze() while the tree is read only */
+	struct avlfrozen *frozen;
+	/* optional, set up by avl_bloom_enable(), uses the same hashes */
+	struct avlbloom *bloom;
+	/* optional, set up by avl_buffer_enable() */
+	struct avlbuffer *buffer;
 };
 
 struct avlsearch
 {
-	struct avlbind **path_taken[40];
-	int dir_taken[40];
+	struct avlbind **path_taken[AVL_MAX_HEIGHT];
+	int dir_taken[AVL_MAX_HEIGHT];
 	int current_level;
 	struct avlbind **current_node;
+	struct avltree *tree;
+	/* the element the cursor is on, and the tree's stamp when the
+	 path was taken; once the tree changes, stepping re-seeks from
+	 the element with compare_nodes instead of using the path */
+	struct avlbind *node;
+	unsigned long stamp;
 };
 
+/* operations reported to trace_op; the search key is in the tree
+ for those from AVL_OP_INSERT through AVL_OP_SEEK_LESS_EQUAL, and
+ for AVL_OP_FIND */
+#define AVL_OP_INSERT			1
+#define AVL_OP_DELETE			2
+#define AVL_OP_LESS				3
+#define AVL_OP_LESS_EQUAL		4
+#define AVL_OP_GREATER			5
+#define AVL_OP_GREATER_EQUAL	6
+#define AVL_OP_SEEK				7
+#define AVL_OP_SEEK_GREATER_EQUAL	8
+#define AVL_OP_SEEK_LESS_EQUAL	9
+#define AVL_OP_DELETE_CURRENT	10
+#define AVL_OP_FIRST			11
+#define AVL_OP_LAST				12
+#define AVL_OP_NEXT				13
+#define AVL_OP_PREV				14
+#define AVL_OP_FIND				15
+
+/****************************************************************
+	avl_trace()
+	reports an operation to the tree's trace hook, if it has one
+****************************************************************/
+static void avl_trace(struct avltree *tree, int op)
+{
+	if (tree->trace_op)
+		(*tree->trace_op)(tree, op, tree->trace_context);
+}
+
+/* whatever walks the tree empties the write buffer into it first */
+void avl_buffer_flush(struct avltree *tree);
+
 /****************************************************************
 	scroll_down_left()
 	continues down a tree always taking the left branch
@@ -47,7 +126,7 @@ static struct avlbind *scroll_down_left(struct avlsearch *search)
 	struct avlbind *tmp;
 
 	if (*search->current_node == NULL)
-		return NULL;
+		return search->node = NULL;
 
 	for(;;)
 	{
@@ -59,7 +138,7 @@ static struct avlbind *scroll_down_left(struct avlsearch *search)
 		search->current_level++;
 		search->current_node = &tmp->left;
 	}
-	return tmp;
+	return search->node = tmp;
 }
 
 /****************************************************************
@@ -71,7 +150,7 @@ static struct avlbind *scroll_down_right(struct avlsearch *search)
 	struct avlbind *tmp;
 
 	if (*search->current_node == NULL)
-		return NULL;
+		return search->node = NULL;
 
 	for(;;)
 	{
@@ -83,7 +162,7 @@ static struct avlbind *scroll_down_right(struct avlsearch *search)
 		search->current_level++;
 		search->current_node = &tmp->right;
 	}
-	return tmp;
+	return search->node = tmp;
 }
 
 /****************************************************************
@@ -93,6 +172,11 @@ static struct avlbind *scroll_down_right(struct avlsearch *search)
 ****************************************************************/
 struct avlbind *avl_get_first(struct avltree *tree, struct avlsearch *search)
 {
+	avl_trace(tree, AVL_OP_FIRST);
+	if (tree->buffer)
+		avl_buffer_flush(tree);
+	search->tree = tree;
+	search->stamp = tree->stamp;
 	search->current_level = 0;
 	search->current_node = &tree->root;
 	return scroll_down_left(search);
@@ -105,6 +189,11 @@ struct avlbind *avl_get_first(struct avltree *tree, struct avlsearch *search)
 ****************************************************************/
 struct avlbind *avl_get_last(struct avltree *tree, struct avlsearch *search)
 {
+	avl_trace(tree, AVL_OP_LAST);
+	if (tree->buffer)
+		avl_buffer_flush(tree);
+	search->tree = tree;
+	search->stamp = tree->stamp;
 	search->current_level = 0;
 	search->current_node = &tree->root;
 	return scroll_down_right(search);
@@ -122,25 +211,25 @@ static struct avlbind *walk_upstairs(struct avlsearch *search, int dir)
 		if (search->current_level == 0)
 		{
 			search->current_node = NULL;
-			return NULL;
+			return search->node = NULL;
 		}
 		search->current_level--;
 		if (search->dir_taken[search->current_level] == dir)
 		{
 			search->current_node = search->path_taken[search->current_level];
-			return *search->current_node;
+			return search->node = *search->current_node;
 		}
 	}
 }
 
 /****************************************************************
-	avl_get_next()
+	step_next()
 	single step through a search structure for the next (larger)
 	element in the tree
 ****************************************************************/
-struct avlbind *avl_get_next(struct avlsearch *search)
+static struct avlbind *step_next(struct avlsearch *search)
 {
-	if (*search->current_node == NULL)
+	if (search->current_node == NULL || *search->current_node == NULL)
 		return NULL;
 
 	/* if current position has a right subtree, traverse it */
@@ -158,13 +247,13 @@ struct avlbind *avl_get_next(struct avlsearch *search)
 }
 
 /****************************************************************
-	avl_get_prev()
+	step_prev()
 	single step through a search structure for the previous (smaller)
 	element in the tree
 ****************************************************************/
-struct avlbind *avl_get_prev(struct avlsearch *search)
+static struct avlbind *step_prev(struct avlsearch *search)
 {
-	if (*search->current_node == NULL)
+	if (search->current_node == NULL || *search->current_node == NULL)
 		return NULL;
 
 	/* if current position has a left subtree, traverse it */
@@ -182,17 +271,82 @@ struct avlbind *avl_get_prev(struct avlsearch *search)
 }
 
 /****************************************************************
-	avl_search()
-	search the tree for a matching element. If not found, the
-	insertion point is traced in the search structure.
+	avl_reseek()
+	retakes the path to the element a search structure was on,
+	after the tree has changed under it, comparing the element
+	with compare_nodes, so it must still be readable even if it
+	has been deleted. With dir 1 steps on to the next element,
+	with dir -1 to the previous one; with dir 0 stays on the
+	element, or the next one if it is gone
 ****************************************************************/
-static struct avlbind *avl_search(struct avltree *tree, struct avlsearch *search)
+static struct avlbind *avl_reseek(struct avlsearch *search, int dir)
 {
-	struct avlbind *tmp;
+	struct avltree *tree = search->tree;
+	struct avlbind *tmp, *last = search->node;
 	int cmp;
 
+	search->stamp = tree->stamp;
 	search->current_level = 0;
 	search->current_node = &tree->root;
+	if (last == NULL || tree->compare_nodes == NULL)
+	{
+		search->current_node = NULL;
+		return search->node = NULL;
+	}
+	while ((tmp = *search->current_node) != NULL)
+	{
+		cmp = (*tree->compare_nodes)(tree, last, tmp);
+		if (cmp == 0)
+			break;
+		search->path_taken[search->current_level] = search->current_node;
+		search->dir_taken[search->current_level] = cmp < 0 ? -1 : 1;
+		search->current_level++;
+		search->current_node = cmp < 0 ? &tmp->left : &tmp->right;
+	}
+	if (tmp == NULL)
+		return walk_upstairs(search, dir < 0 ? 1 : -1);
+	search->node = tmp;
+	return dir > 0 ? step_next(search) : dir < 0 ? step_prev(search) : tmp;
+}
+
+/****************************************************************
+	avl_get_next()
+	single step through a search structure for the next (larger)
+	element in the tree
+****************************************************************/
+struct avlbind *avl_get_next(struct avlsearch *search)
+{
+	avl_trace(search->tree, AVL_OP_NEXT);
+	if (search->tree->buffer)
+		avl_buffer_flush(search->tree);
+	if (search->stamp != search->tree->stamp)
+		return avl_reseek(search, 1);
+	return step_next(search);
+}
+
+/****************************************************************
+	avl_get_prev()
+	single step through a search structure for the previous (smaller)
+	element in the tree
+****************************************************************/
+struct avlbind *avl_get_prev(struct avlsearch *search)
+{
+	avl_trace(search->tree, AVL_OP_PREV);
+	if (search->tree->buffer)
+		avl_buffer_flush(search->tree);
+	if (search->stamp != search->tree->stamp)
+		return avl_reseek(search, -1);
+	return step_prev(search);
+}
+
+/****************************************************************
+	avl_search_from()
+	continues a search down the tree from the current position
+****************************************************************/
+static struct avlbind *avl_search_from(struct avltree *tree, struct avlsearch *search)
+{
+	struct avlbind *tmp;
+	int cmp;
 
 	while ((tmp=*search->current_node) != NULL)
 	{
@@ -213,7 +367,54 @@ static struct avlbind *avl_search(struct avltree *tree, struct avlsearch *search
 			break;
 		search->current_level++;
 	}
-	return *search->current_node;
+	return search->node = *search->current_node;
+}
+
+/****************************************************************
+	avl_search()
+	search the tree for a matching element. If not found, the
+	insertion point is traced in the search structure.
+****************************************************************/
+static struct avlbind *avl_search(struct avltree *tree, struct avlsearch *search)
+{
+	search->tree = tree;
+	search->stamp = tree->stamp;
+	search->current_level = 0;
+	search->current_node = &tree->root;
+	return avl_search_from(tree, search);
+}
+
+/****************************************************************
+	avl_search_node()
+	like avl_search(), for the key of a node not in the tree,
+	compared with compare_nodes; avl_search_node_from() goes on
+	down from the position held
+****************************************************************/
+static struct avlbind *avl_search_node_from(struct avltree *tree, struct avlsearch *search, struct avlbind *node)
+{
+	struct avlbind *tmp;
+	int cmp;
+
+	while ((tmp = *search->current_node) != NULL)
+	{
+		cmp = (*tree->compare_nodes)(tree, node, tmp);
+		if (cmp == 0)
+			break;
+		search->path_taken[search->current_level] = search->current_node;
+		search->dir_taken[search->current_level] = cmp < 0 ? -1 : 1;
+		search->current_level++;
+		search->current_node = cmp < 0 ? &tmp->left : &tmp->right;
+	}
+	return search->node = tmp;
+}
+
+static struct avlbind *avl_search_node(struct avltree *tree, struct avlsearch *search, struct avlbind *node)
+{
+	search->tree = tree;
+	search->stamp = tree->stamp;
+	search->current_level = 0;
+	search->current_node = &tree->root;
+	return avl_search_node_from(tree, search, node);
 }
 
 /****************************************************************
@@ -225,9 +426,12 @@ struct avlbind *avl_get_less(struct avltree *tree, struct avlsearch *search)
 {
 	struct avlbind *tmp;
 
+	avl_trace(tree, AVL_OP_LESS);
+	if (tree->buffer)
+		avl_buffer_flush(tree);
 	tmp = avl_search(tree, search);
 	if (tmp)
-		return avl_get_prev(search);
+		return step_prev(search);
 
 	/* back upstairs until coming up from right */
 	return walk_upstairs(search, 1);
@@ -242,6 +446,9 @@ struct avlbind *avl_get_less_equal(struct avltree *tree, struct avlsearch *searc
 {
 	struct avlbind *tmp;
 
+	avl_trace(tree, AVL_OP_LESS_EQUAL);
+	if (tree->buffer)
+		avl_buffer_flush(tree);
 	tmp = avl_search(tree, search);
 	if (tmp)
 		return tmp;
@@ -259,9 +466,12 @@ struct avlbind *avl_get_greater(struct avltree *tree, struct avlsearch *search)
 {
 	struct avlbind *tmp;
 
+	avl_trace(tree, AVL_OP_GREATER);
+	if (tree->buffer)
+		avl_buffer_flush(tree);
 	tmp = avl_search(tree, search);
 	if (tmp)
-		return avl_get_next(search);
+		return step_next(search);
 
 	/* back upstairs until coming up from left */
 	return walk_upstairs(search, -1);
@@ -276,6 +486,9 @@ struct avlbind *avl_get_greater_equal(struct avltree *tree, struct avlsearch *se
 {
 	struct avlbind *tmp;
 
+	avl_trace(tree, AVL_OP_GREATER_EQUAL);
+	if (tree->buffer)
+		avl_buffer_flush(tree);
 	tmp = avl_search(tree, search);
 	if (tmp)
 		return tmp;
@@ -285,369 +498,3552 @@ struct avlbind *avl_get_greater_equal(struct avltree *tree, struct avlsearch *se
 }
 
 /****************************************************************
-	avl_insert()
-		inserts a node into the tree
+	avl_seek()
+	finger search: finds the compare value starting from the
+	position already held in the search structure, climbing only
+	as far as the nearest ancestor that bounds the key, so a key d
+	places away costs O(log d) comparisons. With dir 0 returns
+	the match or NULL at the insertion point, like a plain search;
+	with dir 1 the smallest element greater than or equal, and
+	with dir -1 the largest element less than or equal
 ****************************************************************/
-struct avlbind *avl_insert(struct avltree *tree, struct avlbind *node)
+struct avlbind *avl_seek(struct avltree *tree, struct avlsearch *search, int dir)
 {
-	struct avlbind *tmp, *p3, *p4, **Pivot;
-	struct avlsearch search;
-
-	tmp = avl_search(tree, &search);
-	if (tmp != NULL)
-		return tmp;				/* no repeats allowed */
-
-	node->balance = 0;
-	node->left = node->right = NULL;
-
-	/* Insert it into the tree */
-	*search.current_node = node;
-	tree->num_nodes++;
-
-	/* Walk back up */
-	while(search.current_level--)
+	struct avlbind *tmp;
+	int cmp, c, level, bound;
+
+	avl_trace(tree, dir > 0 ? AVL_OP_SEEK_GREATER_EQUAL : dir < 0 ? AVL_OP_SEEK_LESS_EQUAL : AVL_OP_SEEK);
+	if (tree->buffer)
+		avl_buffer_flush(tree);
+	search->tree = tree;
+	if (search->current_node == NULL || *search->current_node == NULL || search->stamp != tree->stamp)
+		tmp = avl_search(tree, search);
+	else if ((cmp = (*tree->compare_key_tree)(tree, *search->current_node)) == 0)
+		return *search->current_node;
+	else
 	{
-		tmp = *(Pivot = search.path_taken[search.current_level]);
-		if (search.dir_taken[search.current_level] == 1)
-		{
-			/* coming up from right */
-			if (tmp->balance != 1)
-			{	/* if node is -1, set balance to 0 and stop */
-				if (++tmp->balance == 0)
-					return node;
-				/* if node is 0, set balance to 1 and continue */
-				continue;
-			}
-
-			/* Same direction, single rotate */
-			if (search.dir_taken[search.current_level+1] == 1)
-			{
-				p3 = tmp->right;
-				tmp->right = p3->left;
-				p3->left = tmp;
-				tmp->balance = 0;
-				p3->balance = 0;
-				*Pivot = p3;
-				return node;
-			}
-			/* Need to do a double rotation */
-			p3 = tmp->right;
-			p4 = p3->left;
-			if (p4->balance == 1)
-			{
-				p3->balance = 0;
-				tmp->balance = -1;
-			}
-			else if (p4->balance == 0)
-			{
-				p3->balance = 0;
-				tmp->balance = 0;
-			}
-			else
-			{
-				p3->balance = 1;
-				tmp->balance = 0;
-			}
-			p4->balance = 0;
-			tmp->right = p4->left;
-			p3->left = p4->right;
-			p4->left = tmp;
-			p4->right = p3;
-			*Pivot = p4;
-			return node;
-		}
-		else
+		/* ancestors we went left from bound the subtree above, right from below */
+		bound = cmp > 0 ? -1 : 1;
+		level = search->current_level;
+		while (level--)
 		{
-			/* coming up from left */
-			if (tmp->balance != -1)
-			{
-				/* if node is 1, set balance to 0 and stop */
-				if (--tmp->balance == 0)
-					return node;
-				/* if node is 0, set balance to -1 and continue */
+			if (search->dir_taken[level] != bound)
 				continue;
-			}
-			/* Same direction, single rotate */
-			if (search.dir_taken[search.current_level+1] == -1)
-			{
-				p3 = tmp->left;
-				tmp->left = p3->right;
-				p3->right = tmp;
-				tmp->balance = 0;
-				p3->balance = 0;
-				*Pivot = p3;
-				return node;
-			}
-			/* Need to do a double rotation */
-			p3 = tmp->left;
-			p4 = p3->right;
-			if (p4->balance == -1)
-			{
-				p3->balance = 0;
-				tmp->balance = 1;
-			}
-			else if (p4->balance == 0)
-			{
-				p3->balance = 0;
-				tmp->balance = 0;
-			}
-			else
+			c = (*tree->compare_key_tree)(tree, *search->path_taken[level]);
+			if (c == 0)
 			{
-				p3->balance = -1;
-				tmp->balance = 0;
+				search->current_level = level;
+				search->current_node = search->path_taken[level];
+				return search->node = *search->current_node;
 			}
-			p4->balance = 0;
-			tmp->left = p4->right;
-			p3->right = p4->left;
-			p4->right = tmp;
-			p4->left = p3;
-			*Pivot = p4;
-			return node;
+			if ((c > 0) != (cmp > 0))
+				break;		/* the key lies below this bound */
+			/* the key is beyond this ancestor too, descend from it */
+			search->current_level = level;
+			search->current_node = search->path_taken[level];
 		}
+
+		/* the key is on the cmp side of the current node */
+		tmp = *search->current_node;
+		search->path_taken[search->current_level] = search->current_node;
+		search->dir_taken[search->current_level] = cmp > 0 ? 1 : -1;
+		search->current_level++;
+		search->current_node = cmp > 0 ? &tmp->right : &tmp->left;
+		tmp = avl_search_from(tree, search);
 	}
-	return node;
+
+	if (tmp || dir == 0)
+		return tmp;
+	return walk_upstairs(search, dir > 0 ? -1 : 1);
 }
 
 /****************************************************************
-	avl_delete_current()
-		removes the current node from the tree
-		returns the freed binding
+	avl_range_bound()
+	finds the nearest ancestor on the path that the walk went left
+	from, the next element after the current subtree. If it is no
+	greater than hi the whole subtree is in range: returns its
+	level, else -1, remembering a failed level so it is compared
+	only once
 ****************************************************************/
-struct avlbind *avl_delete_current(struct avltree *tree, struct avlsearch *search)
+static int avl_range_bound(struct avlsearch *search, int level, struct avlbind *hi, int *failed)
 {
-	struct avlbind **Nptr;
-	struct avlbind *tmp, *p2, *p3, *p4, *freed_node;
-	struct avlbind *swap, tmpswap;
-	int dir;
-	int found_level;
+	while (level > 0 && search->dir_taken[level - 1] > 0)
+		level--;
+	if (--level < 0 || level == *failed)
+		return -1;
+	if ((*search->tree->compare_nodes)(search->tree, *search->path_taken[level], hi) <= 0)
+		return level;
+	*failed = level;
+	return -1;
+}
 
-	/* bring the found node down to the bottom of the tree */
-	Nptr = search->current_node;
-	tmp = *Nptr;
-	for(;;)
+/****************************************************************
+	avl_get_range()
+	copies up to max consecutive elements, starting with the one
+	the search structure is on, into out[] and returns how many.
+	With hi set the run stops after the last element no greater
+	than it, by the tree's compare_nodes. The search structure is
+	left on the first element not returned, so a further call
+	continues the run; a count short of max means it has ended.
+	One comparison against the element that follows a subtree
+	clears the whole subtree, so most elements need none
+****************************************************************/
+unsigned avl_get_range(struct avlsearch *search, struct avlbind *hi, struct avlbind **out, unsigned max)
+{
+	struct avlbind *tmp, **link;
+	int level, bound, failed;
+	unsigned count;
+
+	if (search->tree->buffer)
+		avl_buffer_flush(search->tree);
+	if (search->stamp != search->tree->stamp)
+		avl_reseek(search, 0);
+	link = search->current_node;
+	if (link == NULL || (tmp = *link) == NULL)
+		return 0;
+	level = search->current_level;
+	bound = failed = -1;
+	if (hi)
+		bound = avl_range_bound(search, level, hi, &failed);
+
+	for (count = 0; count < max; )
 	{
-		DBG_ASSERT(tmp == *Nptr);
-		found_level = search->current_level;
+		/* inside a cleared subtree, or on the element that cleared it */
+		if (hi && bound < 0 && (*search->tree->compare_nodes)(search->tree, tmp, hi) > 0)
+			break;
+		out[count++] = tmp;
+		if (level == bound)
+			bound = -1;
 
-		if (tmp->left) /* Didn't get to the bottom */
+		if (tmp->right)
 		{
-			/* Save the path */
-			search->dir_taken[search->current_level] = -1;
-			search->path_taken[search->current_level++] = Nptr;
-			Nptr = &tmp->left;
-
-			/* if there is no right subtree, swap adjacent levels */
-			if ((swap=*Nptr)->right == NULL)
+			search->path_taken[level] = link;
+			search->dir_taken[level] = 1;
+			level++;
+			if (hi && bound < 0)
+				bound = avl_range_bound(search, level, hi, &failed);
+			link = &tmp->right;
+			tmp = *link;
+			while (tmp->left)
 			{
-				Nptr = &swap->left;
+				search->path_taken[level] = link;
+				search->dir_taken[level] = -1;
+				level++;
+				link = &tmp->left;
+				tmp = *link;
 			}
-			else
+			continue;
+		}
+
+		/* back upstairs until coming up from left */
+		do
+		{
+			if (level == 0)
 			{
-				/* otherwise go all the way down the right and swap */
-				while ((swap=*Nptr)->right)
-				{
-					search->dir_taken[search->current_level] = 1;
-					search->path_taken[search->current_level++] = Nptr;
-					Nptr = &swap->right;
-				}
+				link = NULL;
+				break;
 			}
+			level--;
+		} while (search->dir_taken[level] != -1);
+		if (link == NULL)
+			break;
+		link = search->path_taken[level];
+		tmp = *link;
+	}
 
-			/* swap contents of nodes */
-			tmpswap = *swap;
-			*swap = *tmp;
-			*tmp = tmpswap;
+	search->current_level = level;
+	search->current_node = link;
+	search->node = link ? tmp : NULL;
+	return count;
+}
 
-			/* fix pointer to found node */
-			*Nptr = tmp;
-			*search->path_taken[found_level] = swap;
-			search->path_taken[found_level+1] = &swap->left;
-		}
-		else if (tmp->right)
-		{
-			/* Save the path */
-			search->dir_taken[search->current_level] = 1;
-			search->path_taken[search->current_level++] = Nptr;
-			Nptr = &tmp->right;
+/****************************************************************
+	avl_update()
+	recomputes the aggregate of one node, if the tree keeps them
+****************************************************************/
+static void avl_update(struct avltree *tree, struct avlbind *node)
+{
+	if (tree->update_node)
+		(*tree->update_node)(tree, node);
+}
 
-			/* if there is no left subtree, swap adjacent levels */
-			if ((swap=*Nptr)->left == NULL)
+/****************************************************************
+	avl_update_path()
+	recomputes the aggregates of the nodes on a search path, from
+	just above the given level back up to the root
+****************************************************************/
+static void avl_update_path(struct avltree *tree, struct avlsearch *search, int level)
+{
+	if (tree->update_node == NULL)
+		return;
+	while (level--)
+		(*tree->update_node)(tree, *search->path_taken[level]);
+}
+
+/****************************************************************
+	relaxed balance
+	with tree->relaxed set, avl_insert() and avl_delete_current()
+	only keep each balance equal to the height difference of its
+	subtrees, which may fall outside -1..1, and flag the path to
+	any such node with AVL_DIRTY. avl_rebalance_step() then
+	restores the strict AVL shape a piece at a time. Call it
+	until it returns 0 before clearing tree->relaxed
+****************************************************************/
+#define AVL_DIRTY 0x100000
+
+/* an insert deeper than this first finishes any pending rebalancing */
+#ifndef AVL_RELAXED_DEPTH
+#define AVL_RELAXED_DEPTH (AVL_MAX_HEIGHT - 4)
+#endif
+
+static int avl_is_dirty(struct avlbind *node)
+{
+	return node->balance >= AVL_DIRTY / 2;
+}
+
+static int avl_balance_of(struct avlbind *node)
+{
+	return avl_is_dirty(node) ? node->balance - AVL_DIRTY : node->balance;
+}
+
+/****************************************************************
+	avl_height()
+	height of a subtree with no imbalance flagged inside it
+****************************************************************/
+static int avl_height(struct avlbind *node)
+{
+	int height = 0;
+
+	while (node)
+	{
+		height++;
+		node = node->balance < 0 ? node->left : node->right;
+	}
+	return height;
+}
+
+/****************************************************************
+	avl_height_of_count()
+	height of a tree of n nodes linked by splitting at the middle
+****************************************************************/
+static int avl_height_of_count(size_t n)
+{
+	int height = 0;
+
+	while (n)
+	{
+		height++;
+		n >>= 1;
+	}
+	return height;
+}
+
+/****************************************************************
+	avl_rotate_left(), avl_rotate_right()
+	single rotations that keep balances of any size exact
+****************************************************************/
+static struct avlbind *avl_rotate_left(struct avlbind *p2)
+{
+	struct avlbind *p3 = p2->right;
+
+	p2->right = p3->left;
+	p3->left = p2;
+	p2->balance -= 1 + (p3->balance > 0 ? p3->balance : 0);
+	p3->balance -= 1 - (p2->balance < 0 ? p2->balance : 0);
+	return p3;
+}
+
+static struct avlbind *avl_rotate_right(struct avlbind *p2)
+{
+	struct avlbind *p3 = p2->left;
+
+	p2->left = p3->right;
+	p3->right = p2;
+	p2->balance += 1 - (p3->balance < 0 ? p3->balance : 0);
+	p3->balance += 1 + (p2->balance > 0 ? p2->balance : 0);
+	return p3;
+}
+
+/****************************************************************
+	avl_fix_node()
+	single or double rotation at a node of balance 2 or -2 whose
+	subtrees are AVL trees. returns the new subtree root
+****************************************************************/
+static struct avlbind *avl_fix_node(struct avltree *tree, struct avlbind *node)
+{
+	if (node->balance > 0)
+	{
+		if (node->right->balance < 0)
+			node->right = avl_rotate_right(node->right);
+		node = avl_rotate_left(node);
+	}
+	else
+	{
+		if (node->left->balance > 0)
+			node->left = avl_rotate_left(node->left);
+		node = avl_rotate_right(node);
+	}
+	avl_update(tree, node->left);
+	avl_update(tree, node->right);
+	avl_update(tree, node);
+	return node;
+}
+
+/****************************************************************
+	avl_link_list()
+	links the first n nodes of a list chained through their right
+	pointers into a balanced tree, advancing the list past them
+****************************************************************/
+static struct avlbind *avl_link_list(struct avltree *tree, struct avlbind **list, size_t n)
+{
+	struct avlbind *left, *root;
+	size_t half;
+
+	if (n == 0)
+		return NULL;
+	half = (n - 1) / 2;
+	left = avl_link_list(tree, list, half);
+	root = *list;
+	*list = root->right;
+	root->left = left;
+	root->right = avl_link_list(tree, list, n - 1 - half);
+	root->balance = avl_height_of_count(n - 1 - half) - avl_height_of_count(half);
+	avl_update(tree, root);
+	return root;
+}
+
+/****************************************************************
+	avl_rebuild()
+	flattens a subtree into a list and relinks it balanced
+	returns the new subtree root, and the node count in *count
+****************************************************************/
+static struct avlbind *avl_rebuild(struct avltree *tree, struct avlbind *root, size_t *count)
+{
+	struct avlbind head, *tail, *rest, *tmp;
+	size_t n = 0;
+
+	/* rotate left children up until the subtree is one long right spine */
+	head.right = root;
+	tail = &head;
+	rest = root;
+	while (rest)
+	{
+		if (rest->left == NULL)
+		{
+			tail = rest;
+			rest = rest->right;
+			n++;
+		}
+		else
+		{
+			tmp = rest->left;
+			rest->left = tmp->right;
+			tmp->right = rest;
+			rest = tmp;
+			tail->right = tmp;
+		}
+	}
+	*count = n;
+	rest = head.right;
+	return avl_link_list(tree, &rest, n);
+}
+
+/****************************************************************
+	avl_relaxed_update()
+	after a relaxed insert (delta 1) or delete (delta -1) below
+	the search path, carries the height change up the path and
+	flags the way down to the deepest node left out of balance
+****************************************************************/
+static void avl_relaxed_update(struct avltree *tree, struct avlsearch *search, int delta)
+{
+	struct avlbind *tmp;
+	int level, deepest, side, grow;
+
+	deepest = -1;
+	for (level = search->current_level; level--; )
+	{
+		tmp = *search->path_taken[level];
+		if (delta)
+		{
+			/* height of the changed side over the other, before the change */
+			side = avl_balance_of(tmp) * search->dir_taken[level];
+			grow = (side + delta > 0 ? side + delta : 0) - (side > 0 ? side : 0);
+			tmp->balance += delta * search->dir_taken[level];
+			delta = grow;
+		}
+		if (deepest < 0 && (avl_balance_of(tmp) > 1 || avl_balance_of(tmp) < -1))
+			deepest = level;
+		avl_update(tree, tmp);
+	}
+	for (level = 0; level <= deepest; level++)
+	{
+		tmp = *search->path_taken[level];
+		if (!avl_is_dirty(tmp))
+			tmp->balance += AVL_DIRTY;
+	}
+}
+
+/****************************************************************
+	avl_rebalance_step()
+		repairs flagged imbalance in a relaxed tree, lowest first,
+		until about budget nodes have been touched (0 for no
+		limit). A single repair may overshoot the budget.
+		returns nonzero while there is more to do
+****************************************************************/
+int avl_rebalance_step(struct avltree *tree, unsigned budget)
+{
+	struct avlsearch search;
+	struct avlbind *tmp;
+	size_t work, count;
+	int balance, left, right, old, delta, side, grow, level;
+
+	work = 0;
+	while (tree->root && avl_is_dirty(tree->root))
+	{
+		if (budget && work >= budget)
+			return 1;
+		tree->stamp++;
+
+		/* find a flagged node with nothing flagged below it */
+		search.current_level = 0;
+		search.current_node = &tree->root;
+		for (;;)
+		{
+			tmp = *search.current_node;
+			if (tmp->left && avl_is_dirty(tmp->left))
+				search.dir_taken[search.current_level] = -1;
+			else if (tmp->right && avl_is_dirty(tmp->right))
+				search.dir_taken[search.current_level] = 1;
+			else
+				break;
+			search.path_taken[search.current_level++] = search.current_node;
+			search.current_node = search.dir_taken[search.current_level-1] < 0 ? &tmp->left : &tmp->right;
+		}
+
+		/* both subtrees are AVL trees, so their heights come cheaply */
+		tmp->balance = balance = avl_balance_of(tmp);
+		left = avl_height(tmp->left);
+		right = avl_height(tmp->right);
+		old = 1 + (left > right ? left : right);
+		DBG_ASSERT(balance == right - left);
+		if (balance >= -1 && balance <= 1)
+		{
+			work++;
+			delta = 0;
+		}
+		else if (balance == 2 || balance == -2)
+		{
+			work += 3;
+			*search.current_node = avl_fix_node(tree, tmp);
+			delta = avl_height(*search.current_node) - old;
+		}
+		else
+		{
+			*search.current_node = avl_rebuild(tree, tmp, &count);
+			work += count;
+			delta = avl_height_of_count(count) - old;
+		}
+
+		/* pass the height change up, clearing flags that no longer apply */
+		for (level = search.current_level; level--; )
+		{
+			tmp = *search.path_taken[level];
+			balance = avl_balance_of(tmp);
+			if (delta)
 			{
-				Nptr = &swap->right;
-				/* swap contents of nodes */
+				side = balance * search.dir_taken[level];
+				grow = (side + delta > 0 ? side + delta : 0) - (side > 0 ? side : 0);
+				balance += delta * search.dir_taken[level];
+				delta = grow;
+			}
+			if (balance > 1 || balance < -1 ||
+				(tmp->left && avl_is_dirty(tmp->left)) ||
+				(tmp->right && avl_is_dirty(tmp->right)))
+				balance += AVL_DIRTY;
+			tmp->balance = balance;
+		}
+	}
+	return 0;
+}
+
+/****************************************************************
+	avl_link_at()
+	links a new node in at the insertion point the search
+	structure holds, and rebalances. Leaves current_level on the
+	lowest level of the path still valid, where the walk back up
+	stopped, or -1 if it reached the root; a relaxed tree leaves
+	it as it was
+	returns the node
+****************************************************************/
+static struct avlbind *avl_link_at(struct avltree *tree, struct avlbind *node, struct avlsearch *search,
+	int by_node)
+{
+	struct avlbind *tmp, *p3, *p4, **Pivot;
+
+	/* keep relaxed trees from growing too deep */
+	if (tree->relaxed && search->current_level >= AVL_RELAXED_DEPTH && avl_is_dirty(tree->root))
+	{
+		avl_rebalance_step(tree, 0);
+		if (by_node)
+			avl_search_node(tree, search, node);
+		else
+			avl_search(tree, search);
+	}
+
+	node->balance = 0;
+	node->left = node->right = NULL;
+
+	/* Insert it into the tree */
+	*search->current_node = node;
+	tree->num_nodes++;
+	tree->stamp++;
+	avl_update(tree, node);
+
+	if (tree->relaxed)
+	{
+		avl_relaxed_update(tree, search, 1);
+		return node;
+	}
+
+	/* Walk back up */
+	while(search->current_level--)
+	{
+		tmp = *(Pivot = search->path_taken[search->current_level]);
+		if (search->dir_taken[search->current_level] == 1)
+		{
+			/* coming up from right */
+			if (tmp->balance != 1)
+			{	/* if node is -1, set balance to 0 and stop */
+				if (++tmp->balance == 0)
+				{
+					avl_update_path(tree, search, search->current_level + 1);
+					return node;
+				}
+				/* if node is 0, set balance to 1 and continue */
+				avl_update(tree, tmp);
+				continue;
+			}
+
+			/* Same direction, single rotate */
+			if (search->dir_taken[search->current_level+1] == 1)
+			{
+				p3 = tmp->right;
+				tmp->right = p3->left;
+				p3->left = tmp;
+				tmp->balance = 0;
+				p3->balance = 0;
+				*Pivot = p3;
+				avl_update(tree, tmp);
+				avl_update_path(tree, search, search->current_level + 1);
+				return node;
+			}
+			/* Need to do a double rotation */
+			p3 = tmp->right;
+			p4 = p3->left;
+			if (p4->balance == 1)
+			{
+				p3->balance = 0;
+				tmp->balance = -1;
+			}
+			else if (p4->balance == 0)
+			{
+				p3->balance = 0;
+				tmp->balance = 0;
 			}
 			else
 			{
-				/* otherwise go all the way down the left and swap */
-				while ((swap=*Nptr)->left)
+				p3->balance = 1;
+				tmp->balance = 0;
+			}
+			p4->balance = 0;
+			tmp->right = p4->left;
+			p3->left = p4->right;
+			p4->left = tmp;
+			p4->right = p3;
+			*Pivot = p4;
+			avl_update(tree, tmp);
+			avl_update(tree, p3);
+			avl_update_path(tree, search, search->current_level + 1);
+			return node;
+		}
+		else
+		{
+			/* coming up from left */
+			if (tmp->balance != -1)
+			{
+				/* if node is 1, set balance to 0 and stop */
+				if (--tmp->balance == 0)
 				{
-					search->dir_taken[search->current_level] = -1;
-					search->path_taken[search->current_level++] = Nptr;
-					Nptr = &swap->left;
+					avl_update_path(tree, search, search->current_level + 1);
+					return node;
 				}
+				/* if node is 0, set balance to -1 and continue */
+				avl_update(tree, tmp);
+				continue;
+			}
+			/* Same direction, single rotate */
+			if (search->dir_taken[search->current_level+1] == -1)
+			{
+				p3 = tmp->left;
+				tmp->left = p3->right;
+				p3->right = tmp;
+				tmp->balance = 0;
+				p3->balance = 0;
+				*Pivot = p3;
+				avl_update(tree, tmp);
+				avl_update_path(tree, search, search->current_level + 1);
+				return node;
+			}
+			/* Need to do a double rotation */
+			p3 = tmp->left;
+			p4 = p3->right;
+			if (p4->balance == -1)
+			{
+				p3->balance = 0;
+				tmp->balance = 1;
+			}
+			else if (p4->balance == 0)
+			{
+				p3->balance = 0;
+				tmp->balance = 0;
 			}
+			else
+			{
+				p3->balance = -1;
+				tmp->balance = 0;
+			}
+			p4->balance = 0;
+			tmp->left = p4->right;
+			p3->right = p4->left;
+			p4->right = tmp;
+			p4->left = p3;
+			*Pivot = p4;
+			avl_update(tree, tmp);
+			avl_update(tree, p3);
+			avl_update_path(tree, search, search->current_level + 1);
+			return node;
+		}
+	}
+	return node;
+}
+
+/****************************************************************
+	avl_link_node()
+	links a new node in and rebalances, placing it by the search
+	key, or with by_node set, by its own key
+	returns the node, or the equal one already in the tree
+****************************************************************/
+static struct avlbind *avl_link_node(struct avltree *tree, struct avlbind *node, int by_node)
+{
+	struct avlbind *tmp;
+	struct avlsearch search;
+
+	tmp = by_node ? avl_search_node(tree, &search, node) : avl_search(tree, &search);
+	if (tmp != NULL)
+		return tmp;				/* no repeats allowed */
+	return avl_link_at(tree, node, &search, by_node);
+}
+
+/****************************************************************
+	hash side index
+	an open addressing table, kept beside the tree, from each
+	node's hash to the node, so exact matches are found in O(1)
+	while ordered operations still use the tree. Linear probing,
+	with deletion by shifting later entries back, so there are
+	no tombstones. Kept at most half full
+****************************************************************/
+struct avlhashslot
+{
+	unsigned long hash;
+	struct avlbind *node;		/* NULL if empty */
+};
+
+struct avlhash
+{
+	struct avlhashslot *slots;
+	size_t mask;				/* slots - 1, a power of 2 */
+	size_t count;
+};
+
+static void avl_hash_put(struct avlhash *hash, unsigned long h, struct avlbind *node)
+{
+	size_t i = h & hash->mask;
+
+	while (hash->slots[i].node)
+		i = (i + 1) & hash->mask;
+	hash->slots[i].hash = h;
+	hash->slots[i].node = node;
+	hash->count++;
+}
+
+static void avl_hash_fill(struct avltree *tree, struct avlhash *hash, struct avlbind *node)
+{
+	while (node)
+	{
+		avl_hash_fill(tree, hash, node->left);
+		avl_hash_put(hash, (*tree->hash_node)(tree, node), node);
+		node = node->right;
+	}
+}
+
+/****************************************************************
+	avl_hash_disable()
+		frees the side index; avl_find() then searches the tree
+****************************************************************/
+void avl_hash_disable(struct avltree *tree)
+{
+	if (tree->hash)
+	{
+		free(tree->hash->slots);
+		free(tree->hash);
+		tree->hash = NULL;
+	}
+}
+
+/* refills the table from the tree, at a size for num_nodes plus one;
+ if memory runs out the index is dropped rather than left stale */
+static int avl_hash_rebuild(struct avltree *tree)
+{
+	struct avlhash *hash = tree->hash;
+	size_t size = 16;
+
+	while (size < 2 * ((size_t)tree->num_nodes + 1))
+		size *= 2;
+	if (size != hash->mask + 1)
+	{
+		free(hash->slots);
+		hash->slots = (struct avlhashslot *)malloc(size * sizeof(*hash->slots));
+		if (hash->slots == NULL)
+		{
+			avl_hash_disable(tree);
+			return -1;
+		}
+		hash->mask = size - 1;
+	}
+	memset(hash->slots, 0, size * sizeof(*hash->slots));
+	hash->count = 0;
+	avl_hash_fill(tree, hash, tree->root);
+	return 0;
+}
+
+/****************************************************************
+	avl_hash_enable()
+		sets up the side index over the nodes already in the tree.
+		hash_key and hash_node must be set. avl_insert() and the
+		deletes keep it up to date from then on
+		returns 0, or -1 if out of memory
+****************************************************************/
+int avl_hash_enable(struct avltree *tree)
+{
+	DBG_ASSERT(tree->hash_key && tree->hash_node);
+	if (tree->hash)
+		return 0;
+	tree->hash = (struct avlhash *)malloc(sizeof(struct avlhash));
+	if (tree->hash == NULL)
+		return -1;
+	tree->hash->slots = NULL;
+	tree->hash->mask = (size_t)-1;
+	return avl_hash_rebuild(tree);
+}
+
+static void avl_hash_add(struct avltree *tree, struct avlbind *node)
+{
+	struct avlhash *hash = tree->hash;
+
+	if (2 * (hash->count + 1) > hash->mask + 1)
+	{
+		/* the node is linked already, so the refill picks it up */
+		avl_hash_rebuild(tree);
+		return;
+	}
+	avl_hash_put(hash, (*tree->hash_node)(tree, node), node);
+}
+
+static void avl_hash_remove(struct avltree *tree, struct avlbind *node)
+{
+	struct avlhash *hash = tree->hash;
+	size_t i, j, home;
+
+	i = (*tree->hash_node)(tree, node) & hash->mask;
+	while (hash->slots[i].node != node)
+	{
+		DBG_ASSERT(hash->slots[i].node);
+		i = (i + 1) & hash->mask;
+	}
+	/* pull back any later entry whose home slot is not between the
+	 hole and itself, so every probe run stays unbroken */
+	for (j = (i + 1) & hash->mask; hash->slots[j].node; j = (j + 1) & hash->mask)
+	{
+		home = hash->slots[j].hash & hash->mask;
+		if (((j - home) & hash->mask) >= ((j - i) & hash->mask))
+		{
+			hash->slots[i] = hash->slots[j];
+			i = j;
+		}
+	}
+	hash->slots[i].node = NULL;
+	hash->count--;
+}
+
+/****************************************************************
+	avl_hash_memory()
+		bytes used by the side index, 0 if there is none
+****************************************************************/
+size_t avl_hash_memory(struct avltree *tree)
+{
+	if (tree->hash == NULL)
+		return 0;
+	return sizeof(struct avlhash) + (tree->hash->mask + 1) * sizeof(struct avlhashslot);
+}
+
+/****************************************************************
+	hot key cache
+	a small set associative cache in front of avl_find(), from
+	the hash of a key to the node found for it last time, so the
+	most asked for keys skip the search. Each set keeps its ways
+	in most recently used order. Only hits are cached, so
+	inserts leave it alone; deletes drop the node
+****************************************************************/
+#ifndef AVL_CACHE_WAYS
+#define AVL_CACHE_WAYS 4
+#endif
+
+struct avlcache
+{
+	struct avlhashslot *slots;	/* sets * AVL_CACHE_WAYS */
+	size_t sets;				/* a power of 2 */
+	unsigned long hits, misses;
+};
+
+/****************************************************************
+	avl_cache_enable()
+		puts a cache of at least entries nodes in front of
+		avl_find(). hash_key and hash_node must be set
+		returns 0, or -1 if out of memory
+****************************************************************/
+int avl_cache_enable(struct avltree *tree, size_t entries)
+{
+	struct avlcache *cache;
+	size_t sets = 1;
+
+	DBG_ASSERT(tree->hash_key && tree->hash_node && tree->cache == NULL);
+	while (sets * AVL_CACHE_WAYS < entries)
+		sets *= 2;
+	cache = (struct avlcache *)malloc(sizeof(struct avlcache));
+	if (cache == NULL)
+		return -1;
+	cache->slots = (struct avlhashslot *)calloc(sets * AVL_CACHE_WAYS, sizeof(struct avlhashslot));
+	if (cache->slots == NULL)
+	{
+		free(cache);
+		return -1;
+	}
+	cache->sets = sets;
+	cache->hits = cache->misses = 0;
+	tree->cache = cache;
+	return 0;
+}
+
+/****************************************************************
+	avl_cache_disable()
+		frees the hot key cache
+****************************************************************/
+void avl_cache_disable(struct avltree *tree)
+{
+	if (tree->cache)
+	{
+		free(tree->cache->slots);
+		free(tree->cache);
+		tree->cache = NULL;
+	}
+}
+
+static void avl_cache_clear(struct avltree *tree)
+{
+	memset(tree->cache->slots, 0, tree->cache->sets * AVL_CACHE_WAYS * sizeof(struct avlhashslot));
+}
+
+/* looks a key up, moving a hit to the front of its set */
+static struct avlbind *avl_cache_lookup(struct avltree *tree, unsigned long h)
+{
+	struct avlhashslot *set = tree->cache->slots + (h & (tree->cache->sets - 1)) * AVL_CACHE_WAYS;
+	struct avlhashslot hit;
+	int i;
+
+	for (i = 0; i < AVL_CACHE_WAYS && set[i].node; i++)
+	{
+		if (set[i].hash == h && (*tree->compare_key_tree)(tree, set[i].node) == 0)
+		{
+			hit = set[i];
+			memmove(set + 1, set, i * sizeof(*set));
+			set[0] = hit;
+			tree->cache->hits++;
+			return hit.node;
+		}
+	}
+	tree->cache->misses++;
+	return NULL;
+}
+
+/* puts a node at the front of its set, dropping the least recent */
+static void avl_cache_add(struct avltree *tree, unsigned long h, struct avlbind *node)
+{
+	struct avlhashslot *set = tree->cache->slots + (h & (tree->cache->sets - 1)) * AVL_CACHE_WAYS;
+
+	memmove(set + 1, set, (AVL_CACHE_WAYS - 1) * sizeof(*set));
+	set[0].hash = h;
+	set[0].node = node;
+}
+
+static void avl_cache_remove(struct avltree *tree, struct avlbind *node)
+{
+	unsigned long h = (*tree->hash_node)(tree, node);
+	struct avlhashslot *set = tree->cache->slots + (h & (tree->cache->sets - 1)) * AVL_CACHE_WAYS;
+	int i;
+
+	for (i = 0; i < AVL_CACHE_WAYS; i++)
+	{
+		if (set[i].node == node)
+		{
+			memmove(set + i, set + i + 1, (AVL_CACHE_WAYS - 1 - i) * sizeof(*set));
+			set[AVL_CACHE_WAYS - 1].node = NULL;
+			return;
+		}
+	}
+}
+
+/****************************************************************
+	Bloom filter
+	a blocked Bloom filter in front of avl_find(), over the same
+	hashes as the side index, so most keys that are not in the
+	tree are turned away after reading one 64 byte block. Each
+	key sets its bits in one block. It is sized for up to twice
+	the nodes present when it was filled, and refilled from the
+	tree when inserts pass that, or when deletes, whose keys it
+	cannot forget, come to half of it. With b bits for each key
+	it is sized for, and the filter full, about 1 lookup in 20
+	for an absent key gets through at b = 6, 1 in 100 at b = 10
+	and 1 in 1000 at b = 16; at half full, far fewer
+****************************************************************/
+#define AVL_BLOOM_WORDS 8		/* 64 bit words in a block */
+
+struct avlbloom
+{
+	unsigned long long *blocks;	/* count * AVL_BLOOM_WORDS */
+	size_t count;
+	size_t capacity;			/* keys it is sized for */
+	size_t deleted;				/* since it was last filled */
+	unsigned bits_per_key, probes;
+	unsigned long rejected, passed;
+};
+
+/* spreads a hash over 64 bits; the block comes from the top half,
+ the first bit probe from the bottom and the step between probes
+ from a further multiply, so keys sharing a block probe apart */
+static unsigned long long avl_bloom_mix(unsigned long h)
+{
+	unsigned long long x = h;
+
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static void avl_bloom_put(struct avlbloom *bloom, unsigned long h)
+{
+	unsigned long long x = avl_bloom_mix(h);
+	unsigned long long *block = bloom->blocks + ((x >> 32) * bloom->count >> 32) * AVL_BLOOM_WORDS;
+	unsigned a = (unsigned)x, b = (unsigned)(x * 0x9e3779b97f4a7c15ULL >> 32) | 1, i;
+
+	for (i = 0; i < bloom->probes; i++, a += b)
+		block[a >> 29] |= 1ULL << ((a >> 23) & 63);
+}
+
+static int avl_bloom_test(struct avlbloom *bloom, unsigned long h)
+{
+	unsigned long long x = avl_bloom_mix(h);
+	unsigned long long *block = bloom->blocks + ((x >> 32) * bloom->count >> 32) * AVL_BLOOM_WORDS;
+	unsigned a = (unsigned)x, b = (unsigned)(x * 0x9e3779b97f4a7c15ULL >> 32) | 1, i;
+
+	for (i = 0; i < bloom->probes; i++, a += b)
+		if (!(block[a >> 29] & 1ULL << ((a >> 23) & 63)))
+			return 0;
+	return 1;
+}
+
+static void avl_bloom_fill(struct avltree *tree, struct avlbloom *bloom, struct avlbind *node)
+{
+	while (node)
+	{
+		avl_bloom_fill(tree, bloom, node->left);
+		avl_bloom_put(bloom, (*tree->hash_node)(tree, node));
+		node = node->right;
+	}
+}
+
+/****************************************************************
+	avl_bloom_disable()
+		frees the Bloom filter
+****************************************************************/
+void avl_bloom_disable(struct avltree *tree)
+{
+	if (tree->bloom)
+	{
+		free(tree->bloom->blocks);
+		free(tree->bloom);
+		tree->bloom = NULL;
+	}
+}
+
+/* refills the filter from the tree, sized for twice num_nodes; if
+ memory runs out the filter is dropped rather than left stale */
+static int avl_bloom_rebuild(struct avltree *tree)
+{
+	struct avlbloom *bloom = tree->bloom;
+	size_t count;
+
+	bloom->capacity = 2 * (size_t)tree->num_nodes + 64;
+	count = (bloom->capacity * bloom->bits_per_key + AVL_BLOOM_WORDS * 64 - 1) / (AVL_BLOOM_WORDS * 64);
+	if (count != bloom->count)
+	{
+		free(bloom->blocks);
+		bloom->blocks = (unsigned long long *)malloc(count * AVL_BLOOM_WORDS * sizeof(unsigned long long));
+		if (bloom->blocks == NULL)
+		{
+			avl_bloom_disable(tree);
+			return -1;
+		}
+		bloom->count = count;
+	}
+	memset(bloom->blocks, 0, count * AVL_BLOOM_WORDS * sizeof(unsigned long long));
+	bloom->deleted = 0;
+	avl_bloom_fill(tree, bloom, tree->root);
+	return 0;
+}
+
+/****************************************************************
+	avl_bloom_enable()
+		puts a Bloom filter of bits_per_key bits a key in front
+		of avl_find(), filled from the nodes already in the tree.
+		hash_key and hash_node must be set. avl_insert() and the
+		deletes keep it up to date from then on
+		returns 0, or -1 if out of memory
+****************************************************************/
+int avl_bloom_enable(struct avltree *tree, unsigned bits_per_key)
+{
+	struct avlbloom *bloom;
+
+	DBG_ASSERT(tree->hash_key && tree->hash_node && bits_per_key > 0);
+	avl_bloom_disable(tree);
+	bloom = (struct avlbloom *)malloc(sizeof(struct avlbloom));
+	if (bloom == NULL)
+		return -1;
+	bloom->blocks = NULL;
+	bloom->count = 0;
+	bloom->bits_per_key = bits_per_key;
+	/* ln 2 bits per key probes minimize the false positives */
+	bloom->probes = (bits_per_key * 69 + 50) / 100;
+	if (bloom->probes == 0)
+		bloom->probes = 1;
+	bloom->rejected = bloom->passed = 0;
+	tree->bloom = bloom;
+	return avl_bloom_rebuild(tree);
+}
+
+/****************************************************************
+	avl_bloom_memory()
+		the bytes taken by the Bloom filter
+****************************************************************/
+size_t avl_bloom_memory(struct avltree *tree)
+{
+	if (tree->bloom == NULL)
+		return 0;
+	return sizeof(struct avlbloom) + tree->bloom->count * AVL_BLOOM_WORDS * sizeof(unsigned long long);
+}
+
+static void avl_bloom_add(struct avltree *tree, struct avlbind *node)
+{
+	if (tree->num_nodes > tree->bloom->capacity)
+		avl_bloom_rebuild(tree);
+	else
+		avl_bloom_put(tree->bloom, (*tree->hash_node)(tree, node));
+}
+
+static void avl_bloom_remove(struct avltree *tree)
+{
+	if (2 * ++tree->bloom->deleted > tree->bloom->capacity)
+		avl_bloom_rebuild(tree);
+}
+
+/****************************************************************
+	frozen trees
+	for a tree that is built once and then only read, an array
+	of the nodes in breadth first (Eytzinger) order: the children
+	of slot k are slots 2k and 2k+1, starting from slot 1. A
+	search runs down it with no branch on the comparison and
+	fetches the slots a few levels ahead; a position is just a
+	slot number, 0 being none. The tree keeps its links, and must
+	not be changed until avl_thaw()
+****************************************************************/
+#if defined(__GNUC__)
+#define AVL_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define AVL_PREFETCH(p)
+#endif
+
+struct avlfrozen
+{
+	struct avlbind **nodes;		/* count + 1 slots, 0 unused */
+	size_t count;
+};
+
+/****************************************************************
+	avl_frozen_first()
+	avl_frozen_last()
+		the slots of the smallest and largest elements, 0 if
+		the tree is empty
+****************************************************************/
+size_t avl_frozen_first(struct avltree *tree)
+{
+	size_t k = tree->frozen->count ? 1 : 0;
+
+	while (2 * k <= tree->frozen->count && k)
+		k *= 2;
+	return k;
+}
+
+size_t avl_frozen_last(struct avltree *tree)
+{
+	size_t k = tree->frozen->count ? 1 : 0;
+
+	while (2 * k + 1 <= tree->frozen->count && k)
+		k = 2 * k + 1;
+	return k;
+}
+
+/****************************************************************
+	avl_frozen_next()
+	avl_frozen_prev()
+		step from a slot to the next (larger) or previous
+		(smaller) element, 0 past the end
+****************************************************************/
+size_t avl_frozen_next(struct avltree *tree, size_t k)
+{
+	size_t n = tree->frozen->count;
+
+	if (k == 0)
+		return 0;
+	if (2 * k + 1 <= n)
+	{
+		for (k = 2 * k + 1; 2 * k <= n; k *= 2)
+			;
+		return k;
+	}
+	/* up past the ancestors whose right subtree this was */
+	while (k & 1)
+		k >>= 1;
+	return k >> 1;
+}
+
+size_t avl_frozen_prev(struct avltree *tree, size_t k)
+{
+	size_t n = tree->frozen->count;
+
+	if (k == 0)
+		return 0;
+	if (2 * k <= n)
+	{
+		for (k = 2 * k; 2 * k + 1 <= n; k = 2 * k + 1)
+			;
+		return k;
+	}
+	while (k > 1 && !(k & 1))
+		k >>= 1;
+	return k >> 1;
+}
+
+/****************************************************************
+	avl_frozen_bound()
+		the descent shared by the searches: goes right from
+		each node the search key compares at least past with,
+		1 to pass the nodes below the key and 0 those equal too,
+		then climbs back over the trailing right turns to the
+		last left turn, the first node not passed
+****************************************************************/
+static size_t avl_frozen_bound(struct avltree *tree, int past)
+{
+	struct avlbind **nodes = tree->frozen->nodes;
+	size_t n = tree->frozen->count, k = 1;
+
+	while (k <= n)
+	{
+		AVL_PREFETCH(nodes + 16 * k);
+		if (4 * k + 3 <= n)
+		{
+			AVL_PREFETCH(nodes[4 * k]);
+			AVL_PREFETCH(nodes[4 * k + 1]);
+			AVL_PREFETCH(nodes[4 * k + 2]);
+			AVL_PREFETCH(nodes[4 * k + 3]);
+		}
+		k = 2 * k + ((*tree->compare_key_tree)(tree, nodes[k]) >= past);
+	}
+	/* the left turns are the 0 bits, drop the trailing 1s and one 0 */
+	while (k & 1)
+		k >>= 1;
+	return k >> 1;
+}
+
+/****************************************************************
+	avl_frozen_greater_equal()
+	avl_frozen_greater()
+	avl_frozen_less_equal()
+	avl_frozen_less()
+		the slot of the element nearest the search key in a
+		frozen tree, as avl_get_greater_equal() and the others
+		find it, or 0 if there is none
+****************************************************************/
+size_t avl_frozen_greater_equal(struct avltree *tree)
+{
+	return avl_frozen_bound(tree, 1);
+}
+
+size_t avl_frozen_greater(struct avltree *tree)
+{
+	return avl_frozen_bound(tree, 0);
+}
+
+size_t avl_frozen_less_equal(struct avltree *tree)
+{
+	size_t k = avl_frozen_bound(tree, 0);
+
+	return k ? avl_frozen_prev(tree, k) : avl_frozen_last(tree);
+}
+
+size_t avl_frozen_less(struct avltree *tree)
+{
+	size_t k = avl_frozen_bound(tree, 1);
+
+	return k ? avl_frozen_prev(tree, k) : avl_frozen_last(tree);
+}
+
+/****************************************************************
+	avl_frozen_node()
+		the element in a slot, NULL for slot 0
+****************************************************************/
+struct avlbind *avl_frozen_node(struct avltree *tree, size_t k)
+{
+	return k ? tree->frozen->nodes[k] : NULL;
+}
+
+/****************************************************************
+	avl_freeze()
+		lays the nodes out in a frozen array, walking the tree
+		and the slots in order together. avl_find() then
+		searches the array, unless there is a side index
+		returns 0, or -1 if out of memory
+****************************************************************/
+int avl_freeze(struct avltree *tree)
+{
+	struct avlsearch search;
+	struct avlfrozen *frozen;
+	struct avlbind *tmp;
+	size_t k;
+
+	DBG_ASSERT(tree->frozen == NULL && !tree->relaxed);
+	if (tree->buffer)
+		avl_buffer_flush(tree);
+	frozen = (struct avlfrozen *)malloc(sizeof(struct avlfrozen));
+	if (frozen == NULL)
+		return -1;
+	frozen->nodes = (struct avlbind **)malloc(((size_t)tree->num_nodes + 1) * sizeof(struct avlbind *));
+	if (frozen->nodes == NULL)
+	{
+		free(frozen);
+		return -1;
+	}
+	frozen->nodes[0] = NULL;
+	frozen->count = tree->num_nodes;
+	tree->frozen = frozen;
+
+	search.tree = tree;
+	search.current_level = 0;
+	search.current_node = &tree->root;
+	k = avl_frozen_first(tree);
+	for (tmp = scroll_down_left(&search); tmp; tmp = step_next(&search))
+	{
+		frozen->nodes[k] = tmp;
+		k = avl_frozen_next(tree, k);
+	}
+	DBG_ASSERT(k == 0);
+	return 0;
+}
+
+/****************************************************************
+	avl_thaw()
+		frees the frozen array, after which the tree may change
+****************************************************************/
+void avl_thaw(struct avltree *tree)
+{
+	if (tree->frozen)
+	{
+		free(tree->frozen->nodes);
+		free(tree->frozen);
+		tree->frozen = NULL;
+	}
+}
+
+/****************************************************************
+	avl_find_in_tree()
+	finds the node matching the search key in the tree proper,
+	through the Bloom filter and the side index if there are any,
+	or else the frozen array if the tree is frozen. h is the hash
+	of the key, needed if there is a filter or an index
+****************************************************************/
+static struct avlbind *avl_find_in_tree(struct avltree *tree, unsigned long h)
+{
+	struct avlsearch search;
+	struct avlhash *hash = tree->hash;
+	struct avlbind *found = NULL;
+	size_t i;
+
+	if (tree->bloom)
+	{
+		if (!avl_bloom_test(tree->bloom, h))
+		{
+			tree->bloom->rejected++;
+			return NULL;
+		}
+		tree->bloom->passed++;
+	}
+	if (hash == NULL && tree->frozen)
+	{
+		found = avl_frozen_node(tree, avl_frozen_greater_equal(tree));
+		if (found && (*tree->compare_key_tree)(tree, found) != 0)
+			found = NULL;
+	}
+	else if (hash == NULL)
+		found = avl_search(tree, &search);
+	else
+	{
+		for (i = h & hash->mask; hash->slots[i].node; i = (i + 1) & hash->mask)
+		{
+			if (hash->slots[i].hash == h && (*tree->compare_key_tree)(tree, hash->slots[i].node) == 0)
+			{
+				found = hash->slots[i].node;
+				break;
+			}
+		}
+	}
+	return found;
+}
+
+/****************************************************************
+	write buffer
+	an optional small sorted array in front of the tree that
+	avl_insert() puts new nodes in, to be linked into the tree in
+	key order when it fills. avl_find() and avl_delete() look in
+	it as well as in the tree; the cursors and everything else
+	that walks the tree empty it into the tree first, so results
+	stay exact. A cursor is a path through the tree, which
+	stepping, avl_seek(), avl_get_range(), avl_delete_current()
+	and the re-seek after a change all work from, and a buffered
+	node has no path; as a flush costs about what the inserts
+	would have, a read between writes costs no more than with no
+	buffer, but a key read before it is deleted does reach the
+	tree. A node already in the tree is deleted from it at
+	once, since it is handed back. Keys that are deleted soon
+	after they are inserted never reach the tree. An insert still
+	looks for the key in the tree, which the Bloom filter makes
+	cheap for keys that are new. A flush overlaps the cache
+	misses of its descents, which about pays for the sorting, so
+	keys that stay cost much what they would going straight into
+	the tree; the gain is in the keys that do not stay
+****************************************************************/
+struct avlbuffer
+{
+	struct avlbind **nodes;		/* sorted, size of them */
+	unsigned count, size;
+};
+
+/* how many descents avl_buffer_warm() runs side by side */
+#ifndef AVL_BUFFER_WARM
+#define AVL_BUFFER_WARM 16
+#endif
+
+/****************************************************************
+	avl_buffer_warm()
+		runs the descents for a batch of nodes a group at a
+		time, one level of each in turn, fetching the next node
+		of each ahead, so that the cache misses of the group
+		overlap instead of following one another. Nothing is
+		changed; linking then finds the paths in the cache
+****************************************************************/
+static void avl_buffer_warm(struct avltree *tree, struct avlbind **nodes, unsigned n)
+{
+	struct avlbind *at[AVL_BUFFER_WARM];
+	unsigned i, j, m, live;
+	int c;
+
+	for (i = 0; i < n; i += m)
+	{
+		m = n - i < AVL_BUFFER_WARM ? n - i : AVL_BUFFER_WARM;
+		for (j = 0; j < m; j++)
+			at[j] = tree->root;
+		do
+		{
+			live = 0;
+			for (j = 0; j < m; j++)
+			{
+				if (at[j] == NULL)
+					continue;
+				c = (*tree->compare_nodes)(tree, nodes[i + j], at[j]);
+				at[j] = c < 0 ? at[j]->left : c > 0 ? at[j]->right : NULL;
+				if (at[j])
+				{
+					AVL_PREFETCH(at[j]);
+					live++;
+				}
+			}
+		} while (live);
+	}
+}
+
+/****************************************************************
+	avl_buffer_seek()
+		finds where a node goes, from the part of the last
+		insertion path that avl_link_at() left valid. As in
+		avl_seek(), the search climbs only as far as the nearest
+		ancestor above the key, which for sorted keys close
+		together is a level or two, then goes on down
+****************************************************************/
+static struct avlbind *avl_buffer_seek(struct avltree *tree, struct avlsearch *search, struct avlbind *node)
+{
+	int level, c;
+
+	if (search->current_level < 0)
+		return avl_search_node(tree, search, node);
+	search->current_node = search->path_taken[search->current_level];
+
+	/* the key is above the last one, so only ancestors we went left
+	 from bound it */
+	level = search->current_level;
+	while (level--)
+	{
+		if (search->dir_taken[level] > 0)
+			continue;
+		c = (*tree->compare_nodes)(tree, node, *search->path_taken[level]);
+		if (c < 0)
+			break;
+		search->current_level = level;
+		search->current_node = search->path_taken[level];
+		if (c == 0)
+			return search->node = *search->current_node;
+	}
+	return avl_search_node_from(tree, search, node);
+}
+
+/****************************************************************
+	avl_buffer_flush()
+		empties the write buffer into the tree, linking its
+		nodes in key order, each found from where the last one
+		went in rather than from the root, after warming the
+		paths with avl_buffer_warm()
+****************************************************************/
+void avl_buffer_flush(struct avltree *tree)
+{
+	struct avlbuffer *buffer = tree->buffer;
+	struct avlsearch search;
+	struct avlbind *node;
+	unsigned i, n;
+
+	if (buffer == NULL || buffer->count == 0)
+		return;
+	n = buffer->count;
+	buffer->count = 0;
+	tree->num_nodes -= n;
+	avl_buffer_warm(tree, buffer->nodes, n);
+	search.current_level = -1;
+	for (i = 0; i < n; i++)
+	{
+		node = buffer->nodes[i];
+		/* a relaxed tree may rebalance anywhere while linking */
+		if (tree->relaxed)
+			search.current_level = -1;
+		if (avl_buffer_seek(tree, &search, node) != NULL)
+			continue;
+		avl_link_at(tree, node, &search, 1);
+		if (tree->hash)
+			avl_hash_add(tree, node);
+		if (tree->bloom)
+			avl_bloom_add(tree, node);
+	}
+}
+
+/****************************************************************
+	avl_buffer_disable()
+		empties the write buffer into the tree and frees it
+****************************************************************/
+void avl_buffer_disable(struct avltree *tree)
+{
+	if (tree->buffer)
+	{
+		avl_buffer_flush(tree);
+		free(tree->buffer->nodes);
+		free(tree->buffer);
+		tree->buffer = NULL;
+	}
+}
+
+/****************************************************************
+	avl_buffer_enable()
+		puts a write buffer of size nodes in front of the tree.
+		compare_nodes must be set. A few hundred nodes keep the
+		buffer within the cache
+		returns 0, or -1 if out of memory
+****************************************************************/
+int avl_buffer_enable(struct avltree *tree, unsigned size)
+{
+	struct avlbuffer *buffer;
+
+	DBG_ASSERT(tree->compare_nodes && size > 0);
+	avl_buffer_disable(tree);
+	buffer = (struct avlbuffer *)malloc(sizeof(struct avlbuffer));
+	if (buffer == NULL)
+		return -1;
+	buffer->nodes = (struct avlbind **)malloc(size * sizeof(struct avlbind *));
+	if (buffer->nodes == NULL)
+	{
+		free(buffer);
+		return -1;
+	}
+	buffer->count = 0;
+	buffer->size = size;
+	tree->buffer = buffer;
+	return 0;
+}
+
+/* binary search of the buffer for the search key; returns where it
+ is, with *found set, or else where it would go */
+static unsigned avl_buffer_position(struct avltree *tree, int *found)
+{
+	struct avlbuffer *buffer = tree->buffer;
+	unsigned lo = 0, hi = buffer->count, mid;
+	int cmp;
+
+	*found = 0;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		cmp = (*tree->compare_key_tree)(tree, buffer->nodes[mid]);
+		if (cmp == 0)
+		{
+			*found = 1;
+			return mid;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+static struct avlbind *avl_buffer_find(struct avltree *tree)
+{
+	unsigned i;
+	int found;
+
+	i = avl_buffer_position(tree, &found);
+	return found ? tree->buffer->nodes[i] : NULL;
+}
+
+static struct avlbind *avl_buffer_insert(struct avltree *tree, struct avlbind *node)
+{
+	struct avlbuffer *buffer = tree->buffer;
+	struct avlbind *tmp;
+	unsigned long h = 0;
+	unsigned i;
+	int found;
+
+	i = avl_buffer_position(tree, &found);
+	if (found)
+		return buffer->nodes[i];
+	if (tree->hash || tree->bloom)
+		h = (*tree->hash_key)(tree);
+	if ((tmp = avl_find_in_tree(tree, h)) != NULL)
+		return tmp;
+	memmove(&buffer->nodes[i + 1], &buffer->nodes[i], (buffer->count - i) * sizeof(struct avlbind *));
+	buffer->nodes[i] = node;
+	buffer->count++;
+	tree->num_nodes++;
+	if (buffer->count == buffer->size)
+		avl_buffer_flush(tree);
+	return node;
+}
+
+static struct avlbind *avl_buffer_remove(struct avltree *tree)
+{
+	struct avlbuffer *buffer = tree->buffer;
+	struct avlbind *tmp;
+	unsigned i;
+	int found;
+
+	i = avl_buffer_position(tree, &found);
+	if (!found)
+		return NULL;
+	tmp = buffer->nodes[i];
+	buffer->count--;
+	memmove(&buffer->nodes[i], &buffer->nodes[i + 1], (buffer->count - i) * sizeof(struct avlbind *));
+	tree->num_nodes--;
+	return tmp;
+}
+
+/****************************************************************
+	avl_insert()
+		inserts a node into the tree
+****************************************************************/
+struct avlbind *avl_insert(struct avltree *tree, struct avlbind *node)
+{
+	struct avlbind *tmp;
+
+	avl_trace(tree, AVL_OP_INSERT);
+	DBG_ASSERT(tree->frozen == NULL);
+	if (tree->buffer)
+		return avl_buffer_insert(tree, node);
+	tmp = avl_link_node(tree, node, 0);
+	if (tmp == node && tree->hash)
+		avl_hash_add(tree, node);
+	if (tmp == node && tree->bloom)
+		avl_bloom_add(tree, node);
+	return tmp;
+}
+
+/****************************************************************
+	avl_insert_topdown()
+		inserts a node like avl_insert(), in one pass down the
+		tree. Only the deepest node with a nonzero balance on the
+		way down can need a rotation, so it remembers that node
+		and the turns taken since as bits, then fixes balances
+		from there down and rotates at most once. Trees with
+		update_node or in relaxed mode need the full path, and
+		trees with a write buffer the buffer, so these go
+		through avl_insert() instead
+****************************************************************/
+struct avlbind *avl_insert_topdown(struct avltree *tree, struct avlbind *node)
+{
+	struct avlbind **link, **top_link, *tmp, *p3, *p4;
+	unsigned long long turns;
+	int cmp, depth, dir;
+
+	if (tree->update_node || tree->relaxed || tree->buffer)
+		return avl_insert(tree, node);
+	avl_trace(tree, AVL_OP_INSERT);
+	DBG_ASSERT(tree->frozen == NULL);
+
+	top_link = link = &tree->root;
+	turns = 0;
+	depth = 0;
+	while ((tmp = *link) != NULL)
+	{
+		if (tmp->balance != 0)
+		{
+			top_link = link;
+			turns = 0;
+			depth = 0;
+		}
+		cmp = (*tree->compare_key_tree)(tree, tmp);
+		if (cmp == 0)
+			return tmp;			/* no repeats allowed */
+		if (cmp > 0)
+		{
+			turns |= 1ULL << depth;
+			link = &tmp->right;
+		}
+		else
+			link = &tmp->left;
+		depth++;
+	}
+
+	node->balance = 0;
+	node->left = node->right = NULL;
+	*link = node;
+	tree->num_nodes++;
+	tree->stamp++;
+
+	/* everything below the top node was balanced, and now leans
+	 toward the new node */
+	for (tmp = *top_link, depth = 0; tmp != node; depth++)
+	{
+		dir = (turns >> depth) & 1 ? 1 : -1;
+		tmp->balance += dir;
+		tmp = dir > 0 ? tmp->right : tmp->left;
+	}
+
+	tmp = *top_link;
+	if (tmp->balance == 2)
+	{
+		p3 = tmp->right;
+		if (p3->balance == 1)
+		{
+			/* Same direction, single rotate */
+			tmp->right = p3->left;
+			p3->left = tmp;
+			tmp->balance = 0;
+			p3->balance = 0;
+			*top_link = p3;
+		}
+		else
+		{
+			/* Need to do a double rotation */
+			p4 = p3->left;
+			tmp->balance = p4->balance == 1 ? -1 : 0;
+			p3->balance = p4->balance == -1 ? 1 : 0;
+			p4->balance = 0;
+			tmp->right = p4->left;
+			p3->left = p4->right;
+			p4->left = tmp;
+			p4->right = p3;
+			*top_link = p4;
+		}
+	}
+	else if (tmp->balance == -2)
+	{
+		p3 = tmp->left;
+		if (p3->balance == -1)
+		{
+			tmp->left = p3->right;
+			p3->right = tmp;
+			tmp->balance = 0;
+			p3->balance = 0;
+			*top_link = p3;
+		}
+		else
+		{
+			p4 = p3->right;
+			tmp->balance = p4->balance == -1 ? 1 : 0;
+			p3->balance = p4->balance == 1 ? -1 : 0;
+			p4->balance = 0;
+			tmp->left = p4->right;
+			p3->right = p4->left;
+			p4->right = tmp;
+			p4->left = p3;
+			*top_link = p4;
+		}
+	}
+
+	if (tree->hash)
+		avl_hash_add(tree, node);
+	if (tree->bloom)
+		avl_bloom_add(tree, node);
+	return node;
+}
+
+/****************************************************************
+	avl_unlink_current()
+	removes the current node from the tree
+	returns the freed binding
+****************************************************************/
+static struct avlbind *avl_unlink_current(struct avltree *tree, struct avlsearch *search)
+{
+	struct avlbind **Nptr;
+	struct avlbind *tmp, *p2, *p3, *p4, *freed_node;
+	struct avlbind *swap, tmpswap;
+	int dir;
+	int found_level;
+
+	/* bring the found node down to the bottom of the tree */
+	Nptr = search->current_node;
+	tmp = *Nptr;
+	for(;;)
+	{
+		DBG_ASSERT(tmp == *Nptr);
+		found_level = search->current_level;
+
+		if (tmp->left) /* Didn't get to the bottom */
+		{
+			/* Save the path */
+			search->dir_taken[search->current_level] = -1;
+			search->path_taken[search->current_level++] = Nptr;
+			Nptr = &tmp->left;
+
+			/* if there is no right subtree, swap adjacent levels */
+			if ((swap=*Nptr)->right == NULL)
+			{
+				Nptr = &swap->left;
+			}
+			else
+			{
+				/* otherwise go all the way down the right and swap */
+				while ((swap=*Nptr)->right)
+				{
+					search->dir_taken[search->current_level] = 1;
+					search->path_taken[search->current_level++] = Nptr;
+					Nptr = &swap->right;
+				}
+			}
+
+			/* swap contents of nodes */
+			tmpswap = *swap;
+			*swap = *tmp;
+			*tmp = tmpswap;
+
+			/* fix pointer to found node */
+			*Nptr = tmp;
+			*search->path_taken[found_level] = swap;
+			search->path_taken[found_level+1] = &swap->left;
+		}
+		else if (tmp->right)
+		{
+			/* Save the path */
+			search->dir_taken[search->current_level] = 1;
+			search->path_taken[search->current_level++] = Nptr;
+			Nptr = &tmp->right;
+
+			/* if there is no left subtree, swap adjacent levels */
+			if ((swap=*Nptr)->left == NULL)
+			{
+				Nptr = &swap->right;
+				/* swap contents of nodes */
+			}
+			else
+			{
+				/* otherwise go all the way down the left and swap */
+				while ((swap=*Nptr)->left)
+				{
+					search->dir_taken[search->current_level] = -1;
+					search->path_taken[search->current_level++] = Nptr;
+					Nptr = &swap->left;
+				}
+			}
+
+			/* swap contents of nodes */
+			tmpswap = *swap;
+			*swap = *tmp;
+			*tmp = tmpswap;
+
+			/* fix pointer to found node */
+			*Nptr = tmp;
+			*search->path_taken[found_level] = swap;
+			search->path_taken[found_level+1] = &swap->right;
+		}
+		else
+			break;
+		DBG_ASSERT(tmp);
+		DBG_ASSERT(*Nptr);
+	}
+	DBG_ASSERT(tmp);
+	DBG_ASSERT(tree->relaxed || tmp->balance == 0);
+	DBG_ASSERT(tmp->left == NULL);
+	DBG_ASSERT(tmp->right == NULL);
+
+	/* Delete the node, this is where the elegance of the double pointer comes
+	 in, no special case for root or left or right */
+	freed_node = *Nptr;
+	*Nptr = NULL;
+	tree->num_nodes--;
+	tree->stamp++;
+
+	if (tree->relaxed)
+	{
+		avl_relaxed_update(tree, search, -1);
+		return freed_node;
+	}
+
+	for(;;)
+	{
+		if (search->current_level-- == 0)
+		{
+			/* Reached the top */
+			return freed_node;
+		}
+
+		tmp = *(Nptr = search->path_taken[search->current_level]);
+		dir = search->dir_taken[search->current_level];
+		if (tmp->balance == 0)
+		{
+			tmp->balance -= dir;
+			avl_update_path(tree, search, search->current_level + 1);
+			return freed_node;
+		}
+		if (tmp->balance == dir)
+		{
+			tmp->balance = 0;
+			avl_update(tree, tmp);
+		}
+		else
+		{
+			if (dir == 1)
+			{
+				/* Coming up from right, do clockwise rotations */
+				DBG_ASSERT(tmp->left);
+				p2 = tmp;
+				p3 = tmp->left;
+				if (p3->balance != 1)
+				{
+					/* Do single rotation */
+					p2->left = p3->right;
+					p3->right = p2;
+					p2->balance -= p3->balance;
+					p3->balance++;
+					*Nptr = p3;		/* This points the parent of p2 to p3 */
+					avl_update(tree, p2);
+					avl_update(tree, p3);
+					if (p3->balance != 0)
+					{
+						/* If the tree has not been shortened */
+						avl_update_path(tree, search, search->current_level);
+						return freed_node;
+					}
+				}
+				else
+				{
+					/* Do double rotation */
+					p4 = p3->right;
+					p2->left = p4->right;
+					p3->right = p4->left;
+					p4->left = p3;
+					p4->right = p2;
+					if (p4->balance == 0)
+					{
+						p3->balance = 0;
+						p2->balance = 0;
+					}
+					else if (p4->balance == 1)
+					{
+						p3->balance = -1;
+						p2->balance = 0;
+					}
+					else
+					{
+						p3->balance = 0;
+						p2->balance = 1;
+					}
+					p4->balance = 0;
+					*Nptr = p4;		/* This points the parent of p2 to p4 */
+					avl_update(tree, p2);
+					avl_update(tree, p3);
+					avl_update(tree, p4);
+				}
+			}
+			else
+			{
+				/* Coming up from left, do counter-clockwise rotations */
+				DBG_ASSERT(tmp->right);
+				p2 = tmp;
+				p3 = tmp->right;
+				if (p3->balance != -1)
+				{
+					/* Do single rotation */
+					p2->right = p3->left;
+					p3->left = p2;
+					if (p3->balance == 0)
+						p2->balance = 1;
+					else
+					p2->balance -= p3->balance;
+					p3->balance--;
+					*Nptr = p3;		/* This points the parent of p2 to p3 */
+					avl_update(tree, p2);
+					avl_update(tree, p3);
+					if (p3->balance != 0)
+					{
+						/* If the tree has not been shortened */
+						avl_update_path(tree, search, search->current_level);
+						return freed_node;
+					}
+				}
+				else
+				{
+					/* Do double rotation */
+					p4 = p3->left;
+		
+					p2->right = p4->left;
+					p3->left = p4->right;
+					p4->right = p3;
+					p4->left = p2;
+					if (p4->balance == 0)
+					{
+						p3->balance = 0;
+						p2->balance = 0;
+					}
+					else if (p4->balance == 1)
+					{
+						p3->balance = 0;
+						p2->balance = -1;
+					}
+					else
+					{
+						p2->balance = 0;
+						p3->balance = 1;
+					}
+					p4->balance = 0;
+					*Nptr = p4;		/* This points the parent of p2 to p4 */
+					avl_update(tree, p2);
+					avl_update(tree, p3);
+					avl_update(tree, p4);
+				}
+			}
+		}
+	}
+}
+
+/****************************************************************
+	avl_delete_current()
+		removes the current node from the tree. The search
+		structure can still step to the neighbours of the node,
+		with compare_nodes set, until the node is freed. If the
+		tree has changed since the cursor was placed, the path
+		is retaken first, which needs compare_nodes
+		returns the freed binding, or NULL if the node is no
+		longer in the tree
+****************************************************************/
+struct avlbind *avl_delete_current(struct avltree *tree, struct avlsearch *search)
+{
+	struct avlbind *freed_node;
+
+	avl_trace(tree, AVL_OP_DELETE_CURRENT);
+	DBG_ASSERT(tree->frozen == NULL);
+	if (search->stamp != tree->stamp)
+	{
+		freed_node = search->node;
+		if (avl_reseek(search, 0) != freed_node || freed_node == NULL)
+			return NULL;
+	}
+	freed_node = avl_unlink_current(tree, search);
+	if (tree->hash)
+		avl_hash_remove(tree, freed_node);
+	if (tree->bloom)
+		avl_bloom_remove(tree);
+	if (tree->cache)
+		avl_cache_remove(tree, freed_node);
+	return freed_node;
+}
+
+/****************************************************************
+	avl_delete()
+		searches and removes node from the tree
+		returns the freed binding
+****************************************************************/
+struct avlbind *avl_delete(struct avltree *tree)
+{
+	struct avlsearch search;
+	struct avlbind *tmp;
+
+	avl_trace(tree, AVL_OP_DELETE);
+	DBG_ASSERT(tree->frozen == NULL);
+	if (tree->buffer && (tmp = avl_buffer_remove(tree)) != NULL)
+	{
+		if (tree->cache)
+			avl_cache_remove(tree, tmp);
+		return tmp;
+	}
+	/* Find the node in the tree */
+	tmp = avl_search(tree, &search);
+	if (tmp == NULL)	/* Not found */
+		return NULL;
+	tmp = avl_unlink_current(tree, &search);
+	if (tree->hash)
+		avl_hash_remove(tree, tmp);
+	if (tree->bloom)
+		avl_bloom_remove(tree);
+	if (tree->cache)
+		avl_cache_remove(tree, tmp);
+	return tmp;
+}
+
+/****************************************************************
+	avl_find()
+		finds the node matching the search key, through the hot
+		key cache, the write buffer, the Bloom filter and the
+		side index if there are any, or else the frozen array if
+		the tree is frozen. The key is still set afterwards, so
+		avl_get_greater_equal() puts a cursor on the node
+		returns the node, or NULL if not found
+****************************************************************/
+struct avlbind *avl_find(struct avltree *tree)
+{
+	struct avlbind *found = NULL;
+	unsigned long h = 0;
+
+	avl_trace(tree, AVL_OP_FIND);
+	if (tree->hash || tree->cache || tree->bloom)
+		h = (*tree->hash_key)(tree);
+	if (tree->cache && (found = avl_cache_lookup(tree, h)) != NULL)
+		return found;
+	if (tree->buffer)
+		found = avl_buffer_find(tree);
+	if (found == NULL)
+		found = avl_find_in_tree(tree, h);
+	if (tree->cache && found)
+		avl_cache_add(tree, h, found);
+	return found;
+}
+
+/****************************************************************
+	avl_join_fix()
+	sets the balance of a node one of whose subtrees, on side
+	dir, was replaced by one of height grown, the other being of
+	height other, rotating if that leaves it off by 2
+	returns the new subtree root, and its height in *height
+****************************************************************/
+static struct avlbind *avl_join_fix(struct avltree *tree, struct avlbind *node, int other, int grown,
+	int dir, int *height)
+{
+	struct avlbind *child;
+
+	node->balance = (grown - other) * dir;
+	if (grown <= other + 1)
+	{
+		avl_update(tree, node);
+		*height = 1 + (grown > other ? grown : other);
+		return node;
+	}
+	/* a single rotation raises the inner grandchild one level, a
+	 double rotation ends up as high as the grown side was */
+	child = dir > 0 ? node->right : node->left;
+	if (child->balance * dir >= 0)
+		*height = grown + 1 - child->balance * dir;
+	else
+		*height = grown;
+	return avl_fix_node(tree, node);
+}
+
+/****************************************************************
+	avl_join()
+	links node between two AVL trees of the given heights, all
+	of whose keys are below and above it, in O(|hl - hr|)
+	returns the new root, and its height in *height
+****************************************************************/
+static struct avlbind *avl_join(struct avltree *tree, struct avlbind *l, int hl, struct avlbind *node,
+	struct avlbind *r, int hr, int *height)
+{
+	int grown;
+
+	if (hl > hr + 1)
+	{
+		/* go down the right side of the taller tree to a match */
+		l->right = avl_join(tree, l->right, hl - (l->balance < 0 ? 2 : 1), node, r, hr, &grown);
+		return avl_join_fix(tree, l, hl - (l->balance > 0 ? 2 : 1), grown, 1, height);
+	}
+	if (hr > hl + 1)
+	{
+		r->left = avl_join(tree, l, hl, node, r->left, hr - (r->balance > 0 ? 2 : 1), &grown);
+		return avl_join_fix(tree, r, hr - (r->balance < 0 ? 2 : 1), grown, -1, height);
+	}
+	node->left = l;
+	node->right = r;
+	node->balance = hr - hl;
+	avl_update(tree, node);
+	*height = 1 + (hl > hr ? hl : hr);
+	return node;
+}
+
+/****************************************************************
+	avl_split()
+	cuts an AVL tree of height h into the nodes below and above
+	key, with their heights; a node equal to key goes to *equal
+****************************************************************/
+static void avl_split(struct avltree *tree, struct avlbind *node, int h, struct avlbind *key,
+	struct avlbind **l, int *hl, struct avlbind **equal, struct avlbind **r, int *hr)
+{
+	struct avlbind *part;
+	int cmp, hpart;
+
+	if (node == NULL)
+	{
+		*l = *r = NULL;
+		*hl = *hr = 0;
+		return;
+	}
+	cmp = (*tree->compare_nodes)(tree, key, node);
+	if (cmp == 0)
+	{
+		*equal = node;
+		*l = node->left;
+		*hl = h - (node->balance > 0 ? 2 : 1);
+		*r = node->right;
+		*hr = h - (node->balance < 0 ? 2 : 1);
+	}
+	else if (cmp < 0)
+	{
+		avl_split(tree, node->left, h - (node->balance > 0 ? 2 : 1), key, l, hl, equal, &part, &hpart);
+		*r = avl_join(tree, part, hpart, node, node->right, h - (node->balance < 0 ? 2 : 1), hr);
+	}
+	else
+	{
+		avl_split(tree, node->right, h - (node->balance < 0 ? 2 : 1), key, &part, &hpart, equal, r, hr);
+		*l = avl_join(tree, node->left, h - (node->balance > 0 ? 2 : 1), node, part, hpart, hl);
+	}
+}
+
+/****************************************************************
+	avl_union()
+	merges the AVL tree b into a, splitting b at each root of a,
+	so that the work goes where b has nodes. returns the root,
+	its height in *height, and the duplicates dropped in *dups
+****************************************************************/
+static struct avlbind *avl_union(struct avltree *tree, struct avlbind *a, int ha, struct avlbind *b, int hb,
+	struct avlbind *(*on_duplicate)(struct avltree *tree, struct avlbind *dst, struct avlbind *src),
+	unsigned *dups, int *height)
+{
+	struct avlbind *bl, *br, *equal, *left, *right, *root, *dropped;
+	int hbl, hbr, hleft, hright;
+
+	if (b == NULL)
+	{
+		*height = ha;
+		return a;
+	}
+	if (a == NULL)
+	{
+		*height = hb;
+		return b;
+	}
+	equal = NULL;
+	avl_split(tree, b, hb, a, &bl, &hbl, &equal, &br, &hbr);
+	left = avl_union(tree, a->left, ha - (a->balance > 0 ? 2 : 1), bl, hbl, on_duplicate, dups, &hleft);
+	right = avl_union(tree, a->right, ha - (a->balance < 0 ? 2 : 1), br, hbr, on_duplicate, dups, &hright);
+	root = a;
+	if (equal)
+	{
+		(*dups)++;
+		if (on_duplicate)
+			root = (*on_duplicate)(tree, a, equal);
+		dropped = root == a ? equal : a;
+		if (tree->hash)
+			avl_hash_remove(tree, dropped);
+		if (tree->cache)
+			avl_cache_remove(tree, dropped);
+	}
+	return avl_join(tree, left, hleft, root, right, hright, height);
+}
+
+static void avl_hash_add_all(struct avltree *tree, struct avlbind *node)
+{
+	while (node)
+	{
+		avl_hash_add_all(tree, node->left);
+		avl_hash_add(tree, node);
+		node = node->right;
+	}
+}
+
+/****************************************************************
+	avl_merge()
+		moves every node of src into dst, in O(m log(n/m + 1))
+		for m nodes into n, relinking them where they are. Where
+		both trees have a key, on_duplicate is passed the node of
+		each, returns the one to keep, and takes over the other;
+		with no on_duplicate, the node in dst stays and the one
+		from src is just dropped. Both trees need compare_nodes,
+		and must order alike. src is left empty.
+		returns the number of duplicates
+****************************************************************/
+unsigned avl_merge(struct avltree *dst, struct avltree *src,
+	struct avlbind *(*on_duplicate)(struct avltree *tree, struct avlbind *dst, struct avlbind *src))
+{
+	unsigned dups = 0, count;
+	int height, filled;
+
+	DBG_ASSERT(dst->compare_nodes && dst->frozen == NULL && src->frozen == NULL);
+	if (dst->buffer)
+		avl_buffer_flush(dst);
+	if (src->buffer)
+		avl_buffer_flush(src);
+	if (dst->relaxed)
+		avl_rebalance_step(dst, 0);
+	if (src->relaxed)
+		avl_rebalance_step(src, 0);
+	count = src->num_nodes;
+
+	/* index every incoming node now, in a table sized so as not to be
+	 refilled from dst meanwhile; the duplicates come out again */
+	if (dst->hash && 2 * (dst->hash->count + count + 1) > dst->hash->mask + 1)
+	{
+		dst->num_nodes += count;
+		avl_hash_rebuild(dst);
+		dst->num_nodes -= count;
+	}
+	if (dst->hash)
+		avl_hash_add_all(dst, src->root);
+	/* the incoming keys go into the filter now if they are sure to
+	 fit, else it is rebuilt after; duplicates may make them fit */
+	filled = dst->bloom && dst->num_nodes + count <= dst->bloom->capacity;
+	if (filled)
+		avl_bloom_fill(dst, dst->bloom, src->root);
+	dst->root = avl_union(dst, dst->root, avl_height(dst->root), src->root, avl_height(src->root),
+		on_duplicate, &dups, &height);
+	dst->num_nodes += count - dups;
+	dst->stamp++;
+	if (dst->bloom && (!filled || dst->num_nodes > dst->bloom->capacity))
+		avl_bloom_rebuild(dst);
+
+	src->root = NULL;
+	src->num_nodes = 0;
+	src->stamp++;
+	if (src->hash)
+		avl_hash_rebuild(src);
+	if (src->bloom)
+		avl_bloom_rebuild(src);
+	if (src->cache)
+		avl_cache_clear(src);
+	return dups;
+}
+
+/****************************************************************
+	k-way merge
+	one ordered stream over the elements of several trees,
+	without moving them: a cursor in each tree, and a loser tree
+	over the elements the cursors are on, so each step costs
+	about log k comparisons. Elements are ordered by the first
+	tree's compare_nodes, and equal ones by tree. The trees must
+	not change while the stream is in use
+****************************************************************/
+struct avlkmerge
+{
+	struct avltree **trees;
+	unsigned k;
+	struct avlsearch *cursors;
+	struct avlbind **heads;		/* each cursor's element, NULL at its end */
+	unsigned *losers;			/* [0] the winning tree, [1..k-1] the losers */
+	/* optional, given the element kept so far and an equal one from
+	 tree, returns the one to keep; without it both come out */
+	struct avlbind *(*on_duplicate)(struct avltree *tree, struct avlbind *kept, struct avlbind *dup);
+};
+
+/****************************************************************
+	avl_kmerge_init()
+		sets up a merge over k trees
+		returns 0, or -1 if out of memory
+****************************************************************/
+int avl_kmerge_init(struct avlkmerge *merge, struct avltree **trees, unsigned k,
+	struct avlbind *(*on_duplicate)(struct avltree *tree, struct avlbind *kept, struct avlbind *dup))
+{
+	unsigned i;
+
+	DBG_ASSERT(k > 0 && trees[0]->compare_nodes);
+	for (i = 0; i < k; i++)
+	{
+		if (trees[i]->buffer)
+			avl_buffer_flush(trees[i]);
+	}
+	merge->trees = trees;
+	merge->k = k;
+	merge->on_duplicate = on_duplicate;
+	merge->cursors = (struct avlsearch *)malloc(k * sizeof(struct avlsearch));
+	merge->heads = (struct avlbind **)calloc(k, sizeof(struct avlbind *));
+	merge->losers = (unsigned *)calloc(k, sizeof(unsigned));
+	if (merge->cursors == NULL || merge->heads == NULL || merge->losers == NULL)
+	{
+		free(merge->cursors);
+		free(merge->heads);
+		free(merge->losers);
+		return -1;
+	}
+	return 0;
+}
+
+/****************************************************************
+	avl_kmerge_free()
+		frees what avl_kmerge_init() allocated
+****************************************************************/
+void avl_kmerge_free(struct avlkmerge *merge)
+{
+	free(merge->cursors);
+	free(merge->heads);
+	free(merge->losers);
+}
+
+/* whether tree a's element comes out before tree b's */
+static int avl_kmerge_beats(struct avlkmerge *merge, unsigned a, unsigned b)
+{
+	int cmp;
+
+	if (merge->heads[b] == NULL)
+		return 1;
+	if (merge->heads[a] == NULL)
+		return 0;
+	cmp = (*merge->trees[0]->compare_nodes)(merge->trees[0], merge->heads[a], merge->heads[b]);
+	return cmp < 0 || (cmp == 0 && a < b);
+}
+
+/* plays the matches below a node of the loser tree, whose leaves
+ k to 2k - 1 are the trees; returns the winner */
+static unsigned avl_kmerge_build(struct avlkmerge *merge, unsigned node)
+{
+	unsigned left, right;
+
+	if (node >= merge->k)
+		return node - merge->k;
+	left = avl_kmerge_build(merge, 2 * node);
+	right = avl_kmerge_build(merge, 2 * node + 1);
+	if (avl_kmerge_beats(merge, left, right))
+	{
+		merge->losers[node] = right;
+		return left;
+	}
+	merge->losers[node] = left;
+	return right;
+}
+
+/* replays the matches on the way up from a tree whose element changed */
+static void avl_kmerge_replay(struct avlkmerge *merge, unsigned tree)
+{
+	unsigned node, tmp;
+
+	for (node = (tree + merge->k) / 2; node > 0; node /= 2)
+	{
+		if (avl_kmerge_beats(merge, merge->losers[node], tree))
+		{
+			tmp = merge->losers[node];
+			merge->losers[node] = tree;
+			tree = tmp;
+		}
+	}
+	merge->losers[0] = tree;
+}
+
+/****************************************************************
+	avl_kmerge_next()
+		the next element of the stream, moving on the cursors
+		it came from, or NULL at the end
+****************************************************************/
+struct avlbind *avl_kmerge_next(struct avlkmerge *merge)
+{
+	struct avlbind *result;
+	unsigned tree = merge->losers[0];
+
+	if ((result = merge->heads[tree]) == NULL)
+		return NULL;
+	merge->heads[tree] = avl_get_next(&merge->cursors[tree]);
+	avl_kmerge_replay(merge, tree);
+	if (merge->on_duplicate == NULL)
+		return result;
+
+	/* the equal elements of later trees come up next, in order */
+	while ((tree = merge->losers[0], merge->heads[tree]) != NULL &&
+		(*merge->trees[0]->compare_nodes)(merge->trees[0], result, merge->heads[tree]) == 0)
+	{
+		result = (*merge->on_duplicate)(merge->trees[tree], result, merge->heads[tree]);
+		merge->heads[tree] = avl_get_next(&merge->cursors[tree]);
+		avl_kmerge_replay(merge, tree);
+	}
+	return result;
+}
+
+/****************************************************************
+	avl_kmerge_first()
+		starts the stream at the smallest element of all the
+		trees, and returns it, or NULL if they are all empty
+****************************************************************/
+struct avlbind *avl_kmerge_first(struct avlkmerge *merge)
+{
+	unsigned i;
+
+	for (i = 0; i < merge->k; i++)
+		merge->heads[i] = avl_get_first(merge->trees[i], &merge->cursors[i]);
+	merge->losers[0] = avl_kmerge_build(merge, 1);
+	return avl_kmerge_next(merge);
+}
+
+/****************************************************************
+	avl_kmerge_seek()
+		starts the stream at the smallest element greater than
+		or equal to probe, a node holding the key, as
+		avl_get_greater_equal() would find it in each tree.
+		Every tree needs compare_nodes
+		returns the element, or NULL if there is none
+****************************************************************/
+struct avlbind *avl_kmerge_seek(struct avlkmerge *merge, struct avlbind *probe)
+{
+	struct avlsearch *cursor;
+	unsigned i;
+
+	for (i = 0; i < merge->k; i++)
+	{
+		cursor = &merge->cursors[i];
+		cursor->tree = merge->trees[i];
+		cursor->node = probe;
+		merge->heads[i] = avl_reseek(cursor, 0);
+	}
+	merge->losers[0] = avl_kmerge_build(merge, 1);
+	return avl_kmerge_next(merge);
+}
+
+/****************************************************************
+	tree diff
+	an in-order walk of two trees side by side, reporting the
+	keys found in only one of them. Each side keeps a stack of
+	the subtrees and lone nodes still to be visited, with the
+	first node of each, and a subtree is only opened up once its
+	first node is behind the other side's, or level with it, and
+	then the taller side first. So a subtree linked into both
+	trees comes to the top of both stacks as the same pointer,
+	and is skipped whole. Nodes are linked through themselves,
+	so two trees share a subtree only if they were built that
+	way; otherwise each key is visited once, for about one
+	compare_nodes call
+****************************************************************/
+struct avldiffside
+{
+	struct avlbind *items[2 * AVL_MAX_HEIGHT + 2];
+	struct avlbind *firsts[2 * AVL_MAX_HEIGHT + 2];
+	int heights[2 * AVL_MAX_HEIGHT + 2];		/* 0 for a lone node */
+	int top;
+};
+
+/* pushes a subtree, finding its first node if not given */
+static void avl_diff_push(struct avldiffside *side, struct avlbind *node, int height, struct avlbind *first)
+{
+	if (node == NULL)
+		return;
+	if (first == NULL)
+	{
+		for (first = node; first->left; first = first->left)
+			;
+	}
+	side->items[side->top] = node;
+	side->firsts[side->top] = first;
+	side->heights[side->top++] = height > 0 ? height : 1;
+}
+
+/* replaces the subtree on top with its right subtree, its root
+ alone and its left subtree, the left one on top */
+static void avl_diff_open(struct avldiffside *side)
+{
+	struct avlbind *node = side->items[--side->top];
+	struct avlbind *first = side->firsts[side->top];
+	int height = side->heights[side->top], balance = avl_balance_of(node);
+
+	avl_diff_push(side, node->right, height - (balance < 0 ? 2 : 1), NULL);
+	side->items[side->top] = node;
+	side->firsts[side->top] = node;
+	side->heights[side->top++] = 0;
+	avl_diff_push(side, node->left, height - (balance > 0 ? 2 : 1), first);
+}
+
+/* reports everything left on one side */
+static unsigned avl_diff_rest(struct avltree *tree, struct avldiffside *side,
+	void (*report)(struct avltree *tree, struct avlbind *node, void *context), void *context)
+{
+	unsigned count = 0;
+
+	while (side->top)
+	{
+		if (side->heights[side->top - 1])
+			avl_diff_open(side);
+		else
+		{
+			(*report)(tree, side->items[--side->top], context);
+			count++;
+		}
+	}
+	return count;
+}
+
+/****************************************************************
+	avl_diff()
+		reports, in key order, the nodes of b whose keys are not
+		in a to on_add, and the nodes of a whose keys are not in
+		b to on_remove, each with the tree holding the node.
+		Applying them to a copy of a makes it hold the keys of
+		b. Both trees need compare_nodes and must order alike;
+		neither may change until it returns
+		returns the number of nodes reported
+****************************************************************/
+unsigned avl_diff(struct avltree *a, struct avltree *b,
+	void (*on_add)(struct avltree *tree, struct avlbind *node, void *context),
+	void (*on_remove)(struct avltree *tree, struct avlbind *node, void *context),
+	void *context)
+{
+	struct avldiffside sa, sb;
+	struct avlbind *na, *nb, *fa, *fb, *last_a = NULL, *last_b = NULL;
+	unsigned count = 0;
+	int ha, hb, cmp = 0;
+
+	DBG_ASSERT(a->compare_nodes);
+	if (a->buffer)
+		avl_buffer_flush(a);
+	if (b->buffer)
+		avl_buffer_flush(b);
+	sa.top = sb.top = 0;
+	avl_diff_push(&sa, a->root, avl_height(a->root), NULL);
+	avl_diff_push(&sb, b->root, avl_height(b->root), NULL);
+
+	while (sa.top && sb.top)
+	{
+		na = sa.items[sa.top - 1];
+		nb = sb.items[sb.top - 1];
+		ha = sa.heights[sa.top - 1];
+		hb = sb.heights[sb.top - 1];
+		if (ha && hb && na == nb)
+		{
+			/* the same subtree comes next in both */
+			sa.top--;
+			sb.top--;
+			continue;
+		}
+
+		/* opening a subtree keeps its first node, and the answer */
+		fa = sa.firsts[sa.top - 1];
+		fb = sb.firsts[sb.top - 1];
+		if (fa != last_a || fb != last_b)
+		{
+			cmp = fa == fb ? 0 : (*a->compare_nodes)(a, fa, fb);
+			last_a = fa;
+			last_b = fb;
+		}
+
+		if (cmp < 0)
+		{
+			if (ha)
+				avl_diff_open(&sa);
+			else
+			{
+				sa.top--;
+				(*on_remove)(a, na, context);
+				count++;
+			}
+		}
+		else if (cmp > 0)
+		{
+			if (hb)
+				avl_diff_open(&sb);
+			else
+			{
+				sb.top--;
+				(*on_add)(b, nb, context);
+				count++;
+			}
+		}
+		else if (ha || hb)
+		{
+			/* a shared subtree would be below the taller one */
+			if (ha >= hb)
+				avl_diff_open(&sa);
+			if (hb >= ha)
+				avl_diff_open(&sb);
+		}
+		else
+		{
+			sa.top--;
+			sb.top--;
+		}
+	}
+	count += avl_diff_rest(a, &sa, on_remove, context);
+	count += avl_diff_rest(b, &sb, on_add, context);
+	return count;
+}
+
+/****************************************************************
+	avl_range_aggregate()
+		folds the nodes from lo to hi inclusive into acc, using the
+		aggregates kept by update_node. lo and hi are nodes holding
+		the bounds, compared with compare_nodes; NULL leaves that
+		end open. fold_fn is called in key order, either for one
+		node alone or, when subtree is set, for the aggregate of
+		the whole subtree under it, so only O(log n) calls are made
+****************************************************************/
+void avl_range_aggregate(struct avltree *tree, struct avlbind *lo, struct avlbind *hi,
+	void (*fold_fn)(struct avltree *tree, void *acc, struct avlbind *node, int subtree),
+	void *acc)
+{
+	struct avlbind *stack[AVL_MAX_HEIGHT];
+	struct avlbind *top, *tmp;
+	int depth;
+
+	if (tree->buffer)
+		avl_buffer_flush(tree);
+
+	/* find the highest node inside the range */
+	top = tree->root;
+	while (top)
+	{
+		if (lo && (*tree->compare_nodes)(tree, top, lo) < 0)
+			top = top->right;
+		else if (hi && (*tree->compare_nodes)(tree, top, hi) > 0)
+			top = top->left;
+		else
+			break;
+	}
+	if (top == NULL)
+		return;
+
+	/* down the left side, the nodes at or above lo come out in reverse */
+	depth = 0;
+	for (tmp = top->left; tmp; )
+	{
+		if (lo && (*tree->compare_nodes)(tree, tmp, lo) < 0)
+			tmp = tmp->right;
+		else
+		{
+			stack[depth++] = tmp;
+			tmp = tmp->left;
+		}
+	}
+	while (depth--)
+	{
+		(*fold_fn)(tree, acc, stack[depth], 0);
+		if (stack[depth]->right)
+			(*fold_fn)(tree, acc, stack[depth]->right, 1);
+	}
+
+	(*fold_fn)(tree, acc, top, 0);
+
+	/* down the right side, the nodes at or below hi come out in order */
+	for (tmp = top->right; tmp; )
+	{
+		if (hi && (*tree->compare_nodes)(tree, tmp, hi) > 0)
+			tmp = tmp->left;
+		else
+		{
+			if (tmp->left)
+				(*fold_fn)(tree, acc, tmp->left, 1);
+			(*fold_fn)(tree, acc, tmp, 0);
+			tmp = tmp->right;
+		}
+	}
+}
+
+/****************************************************************
+	interval trees
+	an AVL tree of closed intervals ordered by low then high end,
+	each node keeping the largest high end in its subtree so that
+	overlap queries can skip subtrees that end too early
+****************************************************************/
+#ifndef AVL_INTERVAL_TYPE
+#define AVL_INTERVAL_TYPE long
+#endif
+
+struct avlinterval
+{
+	struct avlbind bind;
+	AVL_INTERVAL_TYPE low;
+	AVL_INTERVAL_TYPE high;
+	AVL_INTERVAL_TYPE max_high;
+};
+
+struct avlintervaltree
+{
+	struct avltree tree;
+	AVL_INTERVAL_TYPE low;		/* search key for the avl_ calls */
+	AVL_INTERVAL_TYPE high;
+};
+
+static int avl_interval_compare(struct avltree *tree, struct avlbind *node)
+{
+	struct avlintervaltree *itree = (struct avlintervaltree *)tree;
+	struct avlinterval *iv = (struct avlinterval *)node;
+
+	if (itree->low != iv->low)
+		return itree->low < iv->low ? -1 : 1;
+	if (itree->high != iv->high)
+		return itree->high < iv->high ? -1 : 1;
+	return 0;
+}
+
+static int avl_interval_compare_nodes(struct avltree *tree, struct avlbind *lhs, struct avlbind *rhs)
+{
+	struct avlinterval *l = (struct avlinterval *)lhs;
+	struct avlinterval *r = (struct avlinterval *)rhs;
+
+	(void)tree;
+	if (l->low != r->low)
+		return l->low < r->low ? -1 : 1;
+	if (l->high != r->high)
+		return l->high < r->high ? -1 : 1;
+	return 0;
+}
+
+static void avl_interval_update(struct avltree *tree, struct avlbind *node)
+{
+	struct avlinterval *iv = (struct avlinterval *)node;
+
+	(void)tree;
+	iv->max_high = iv->high;
+	if (node->left && ((struct avlinterval *)node->left)->max_high > iv->max_high)
+		iv->max_high = ((struct avlinterval *)node->left)->max_high;
+	if (node->right && ((struct avlinterval *)node->right)->max_high > iv->max_high)
+		iv->max_high = ((struct avlinterval *)node->right)->max_high;
+}
+
+/****************************************************************
+	avl_interval_init()
+		sets up an empty interval tree
+****************************************************************/
+void avl_interval_init(struct avlintervaltree *tree)
+{
+	memset(tree, 0, sizeof(*tree));
+	tree->tree.compare_key_tree = avl_interval_compare;
+	tree->tree.compare_nodes = avl_interval_compare_nodes;
+	tree->tree.update_node = avl_interval_update;
+}
+
+/****************************************************************
+	avl_interval_insert()
+		inserts an interval, whose low and high must be set.
+		As with avl_insert(), an equal interval already in the
+		tree is returned instead
+****************************************************************/
+struct avlinterval *avl_interval_insert(struct avlintervaltree *tree, struct avlinterval *iv)
+{
+	tree->low = iv->low;
+	tree->high = iv->high;
+	return (struct avlinterval *)avl_insert(&tree->tree, &iv->bind);
+}
+
+/****************************************************************
+	avl_interval_delete()
+		removes the interval [low, high] from the tree
+		returns the freed interval, or NULL if not found
+****************************************************************/
+struct avlinterval *avl_interval_delete(struct avlintervaltree *tree,
+	AVL_INTERVAL_TYPE low, AVL_INTERVAL_TYPE high)
+{
+	tree->low = low;
+	tree->high = high;
+	return (struct avlinterval *)avl_delete(&tree->tree);
+}
+
+/****************************************************************
+	avl_interval_visit()
+	reports the overlapping intervals of a subtree in order
+****************************************************************/
+static int avl_interval_visit(struct avlbind *node, AVL_INTERVAL_TYPE low, AVL_INTERVAL_TYPE high,
+	int (*report)(struct avlinterval *iv, void *context), void *context)
+{
+	struct avlinterval *iv;
+	int stop;
+
+	while (node && ((struct avlinterval *)node)->max_high >= low)
+	{
+		stop = avl_interval_visit(node->left, low, high, report, context);
+		if (stop)
+			return stop;
+		iv = (struct avlinterval *)node;
+		/* everything from here on starts after the query */
+		if (iv->low > high)
+			return 0;
+		if (iv->high >= low && (stop = (*report)(iv, context)) != 0)
+			return stop;
+		node = node->right;
+	}
+	return 0;
+}
+
+/****************************************************************
+	avl_interval_overlap()
+		calls report, in order, for every interval overlapping
+		[low, high], in O(log n + k). Stops early if report
+		returns nonzero, and passes that value back
+****************************************************************/
+int avl_interval_overlap(struct avlintervaltree *tree, AVL_INTERVAL_TYPE low, AVL_INTERVAL_TYPE high,
+	int (*report)(struct avlinterval *iv, void *context), void *context)
+{
+	if (tree->tree.buffer)
+		avl_buffer_flush(&tree->tree);
+	return avl_interval_visit(tree->tree.root, low, high, report, context);
+}
+
+/****************************************************************
+	avl_interval_stab()
+		calls report for every interval containing point
+****************************************************************/
+int avl_interval_stab(struct avlintervaltree *tree, AVL_INTERVAL_TYPE point,
+	int (*report)(struct avlinterval *iv, void *context), void *context)
+{
+	if (tree->tree.buffer)
+		avl_buffer_flush(&tree->tree);
+	return avl_interval_visit(tree->tree.root, point, point, report, context);
+}
+
+/****************************************************************
+	string keyed trees
+	each node keeps the first 8 bytes of its key as a big-endian
+	integer, zero padded, beside the links, so most compares are
+	settled by one integer compare without touching the string.
+	Keys are compared like memcmp(), the shorter first on a tie,
+	and need not be NUL terminated
+****************************************************************/
+struct avlstrnode
+{
+	struct avlbind bind;
+	unsigned long long prefix;
+	size_t len;
+	const char *key;
+};
+
+struct avlstrtree
+{
+	struct avltree tree;
+	unsigned long long prefix;	/* search key for the avl_ calls */
+	size_t len;
+	const char *key;
+};
+
+static unsigned long long avl_str_prefix(const char *key, size_t len)
+{
+	unsigned long long prefix = 0;
+	size_t i;
+
+	for (i = 0; i < 8; i++)
+		prefix = prefix << 8 | (i < len ? (unsigned char)key[i] : 0);
+	return prefix;
+}
+
+/* the prefixes matched, so the first min(len) bytes up to 8 did */
+static int avl_str_tail(const char *lkey, size_t llen, const char *rkey, size_t rlen)
+{
+	size_t n = llen < rlen ? llen : rlen;
+	int cmp;
+
+	if (n > 8 && (cmp = memcmp(lkey + 8, rkey + 8, n - 8)) != 0)
+		return cmp;
+	return llen < rlen ? -1 : llen > rlen ? 1 : 0;
+}
+
+static int avl_str_compare(struct avltree *tree, struct avlbind *node)
+{
+	struct avlstrtree *stree = (struct avlstrtree *)tree;
+	struct avlstrnode *sn = (struct avlstrnode *)node;
+
+	if (stree->prefix != sn->prefix)
+		return stree->prefix < sn->prefix ? -1 : 1;
+	return avl_str_tail(stree->key, stree->len, sn->key, sn->len);
+}
+
+static int avl_str_compare_nodes(struct avltree *tree, struct avlbind *lhs, struct avlbind *rhs)
+{
+	struct avlstrnode *l = (struct avlstrnode *)lhs;
+	struct avlstrnode *r = (struct avlstrnode *)rhs;
+
+	(void)tree;
+	if (l->prefix != r->prefix)
+		return l->prefix < r->prefix ? -1 : 1;
+	return avl_str_tail(l->key, l->len, r->key, r->len);
+}
+
+/****************************************************************
+	avl_str_init()
+		sets up an empty string keyed tree
+****************************************************************/
+void avl_str_init(struct avlstrtree *tree)
+{
+	memset(tree, 0, sizeof(*tree));
+	tree->tree.compare_key_tree = avl_str_compare;
+	tree->tree.compare_nodes = avl_str_compare_nodes;
+}
+
+/****************************************************************
+	avl_str_key()
+		sets the search key for the avl_ calls that follow.
+		The string must stay put until they are done
+****************************************************************/
+void avl_str_key(struct avlstrtree *tree, const char *key, size_t len)
+{
+	tree->prefix = avl_str_prefix(key, len);
+	tree->len = len;
+	tree->key = key;
+}
+
+/****************************************************************
+	avl_str_insert()
+		sets the key of a node, which keeps pointing at the
+		string, and inserts it. As with avl_insert(), a node
+		with an equal key already in the tree is returned instead
+****************************************************************/
+struct avlstrnode *avl_str_insert(struct avlstrtree *tree, struct avlstrnode *node,
+	const char *key, size_t len)
+{
+	node->prefix = avl_str_prefix(key, len);
+	node->len = len;
+	node->key = key;
+	avl_str_key(tree, key, len);
+	return (struct avlstrnode *)avl_insert(&tree->tree, &node->bind);
+}
+
+/****************************************************************
+	avl_str_delete()
+		removes the node with the given key
+		returns the freed node, or NULL if not found
+****************************************************************/
+struct avlstrnode *avl_str_delete(struct avlstrtree *tree, const char *key, size_t len)
+{
+	avl_str_key(tree, key, len);
+	return (struct avlstrnode *)avl_delete(&tree->tree);
+}
+
+/****************************************************************
+	avl_subtree_height()
+	height of any subtree, whatever its balances say
+****************************************************************/
+static int avl_subtree_height(struct avlbind *node)
+{
+	int left, right;
+
+	if (node == NULL)
+		return 0;
+	left = avl_subtree_height(node->left);
+	right = avl_subtree_height(node->right);
+	return 1 + (left > right ? left : right);
+}
+
+static void avl_veb_order(struct avlbind *node, int height, struct avlbind **order, size_t *count);
+
+/****************************************************************
+	avl_veb_bottoms()
+	lays out, left to right, the subtrees hanging at the given
+	depth below node
+****************************************************************/
+static void avl_veb_bottoms(struct avlbind *node, int depth, int height, struct avlbind **order, size_t *count)
+{
+	if (node == NULL)
+		return;
+	if (depth == 0)
+	{
+		avl_veb_order(node, height, order, count);
+		return;
+	}
+	avl_veb_bottoms(node->left, depth - 1, height, order, count);
+	avl_veb_bottoms(node->right, depth - 1, height, order, count);
+}
 
-			/* swap contents of nodes */
-			tmpswap = *swap;
-			*swap = *tmp;
-			*tmp = tmpswap;
+/****************************************************************
+	avl_veb_order()
+	van Emde Boas order of the top height levels under node: the
+	upper half of the levels first, then each subtree hanging off
+	it, each laid out the same way
+****************************************************************/
+static void avl_veb_order(struct avlbind *node, int height, struct avlbind **order, size_t *count)
+{
+	int top;
 
-			/* fix pointer to found node */
-			*Nptr = tmp;
-			*search->path_taken[found_level] = swap;
-			search->path_taken[found_level+1] = &swap->right;
-		}
-		else
-			break;
-		DBG_ASSERT(tmp);
-		DBG_ASSERT(*Nptr);
+	if (node == NULL)
+		return;
+	if (height == 1)
+	{
+		order[(*count)++] = node;
+		return;
 	}
-	DBG_ASSERT(tmp);
-	DBG_ASSERT(tmp->balance == 0);
-	DBG_ASSERT(tmp->left == NULL);
-	DBG_ASSERT(tmp->right == NULL);
+	top = height / 2;
+	avl_veb_order(node, top, order, count);
+	avl_veb_bottoms(node, top, height - top, order, count);
+}
 
-	/* Delete the node, this is where the elegance of the double pointer comes
-	 in, no special case for root or left or right */
-	freed_node = *Nptr;
-	*Nptr = NULL;
-	tree->num_nodes--;
+/****************************************************************
+	avl_relayout()
+		copies every node, node_size bytes starting at its avlbind,
+		into the arena in van Emde Boas order, so that each step
+		down the tree tends to stay in the same cache lines, and
+		relinks the tree through the copies. The arena must hold
+		num_nodes nodes and not overlap them. moved, if set, is
+		called for each node as it is relinked, so the caller can
+		fix outside references and free the old node; the tree is
+		not usable until avl_relayout() returns
+****************************************************************/
+void avl_relayout(struct avltree *tree, void *arena, size_t node_size,
+	void (*moved)(struct avltree *tree, struct avlbind *from, struct avlbind *to, void *context),
+	void *context)
+{
+	struct avlbind **order = (struct avlbind **)arena;
+	struct avlbind *from, *to;
+	size_t count, i;
+
+	DBG_ASSERT(tree->frozen == NULL);
+	DBG_ASSERT(node_size >= sizeof(struct avlbind));
+	if (tree->buffer)
+		avl_buffer_flush(tree);
+	if (tree->root == NULL)
+		return;
+
+	/* the arena holds the new order until the nodes are copied over it */
+	count = 0;
+	avl_veb_order(tree->root, avl_subtree_height(tree->root), order, &count);
+	DBG_ASSERT(count == tree->num_nodes);
+
+	/* copy from the back, so slot i never covers an entry still needed;
+	 then leave the new address behind in the old node's left link */
+	for (i = count; i--; )
+	{
+		from = order[i];
+		to = (struct avlbind *)((char *)arena + i * node_size);
+		memcpy(to, from, node_size);
+		from->left = to;
+	}
 
-	for(;;)
+	/* each old node is the child of one copy, or the root; follow its
+	 forwarding link once, and it is then free to go */
+	from = tree->root;
+	tree->root = from->left;
+	tree->stamp++;
+	if (moved)
+		(*moved)(tree, from, tree->root, context);
+	for (i = 0; i < count; i++)
 	{
-		if (search->current_level-- == 0)
+		to = (struct avlbind *)((char *)arena + i * node_size);
+		if ((from = to->left) != NULL)
 		{
-			/* Reached the top */
-			return freed_node;
+			to->left = from->left;
+			if (moved)
+				(*moved)(tree, from, to->left, context);
 		}
-
-		tmp = *(Nptr = search->path_taken[search->current_level]);
-		dir = search->dir_taken[search->current_level];
-		if (tmp->balance == 0)
+		if ((from = to->right) != NULL)
 		{
-			tmp->balance -= dir;
-			return freed_node;
+			to->right = from->left;
+			if (moved)
+				(*moved)(tree, from, to->right, context);
 		}
-		if (tmp->balance == dir)
-			tmp->balance = 0;
-		else
+	}
+	if (tree->hash)
+		avl_hash_rebuild(tree);
+	if (tree->cache)
+		avl_cache_clear(tree);
+}
+
+/****************************************************************
+	avl_spawn2()
+	runs a task on two argument blocks, on a second thread when
+	more than one thread is allowed and one can be started
+****************************************************************/
+static void avl_spawn2(void *(*task)(void *), void *first, void *second, unsigned threads)
+{
+#ifdef AVL_PTHREADS
+	pthread_t thread;
+
+	if (threads > 1 && pthread_create(&thread, NULL, task, first) == 0)
+	{
+		(*task)(second);
+		pthread_join(thread, NULL);
+		return;
+	}
+#else
+	(void)threads;
+#endif
+	(*task)(first);
+	(*task)(second);
+}
+
+struct avlmergejob
+{
+	struct avltree *tree;
+	struct avlbind **a, **b, **out;
+	size_t na, nb;
+	unsigned threads;
+};
+
+/****************************************************************
+	avl_merge_runs()
+	stable merge of two sorted runs of nodes, splitting the work
+	between threads. On equal keys, nodes from run a come first
+****************************************************************/
+static void *avl_merge_runs(void *arg)
+{
+	struct avlmergejob *job = (struct avlmergejob *)arg;
+	struct avlmergejob half[2];
+	size_t i, j, lo, hi, mid;
+
+	if (job->threads > 1 && job->na + job->nb >= AVL_PARALLEL_CUTOFF && job->na + job->nb >= 4)
+	{
+		half[0] = half[1] = *job;
+		half[0].threads = job->threads / 2;
+		half[1].threads = job->threads - half[0].threads;
+		if (job->na >= job->nb)
 		{
-			if (dir == 1)
+			/* split a at its middle, b at the first element not less */
+			i = job->na / 2;
+			lo = 0;
+			hi = job->nb;
+			while (lo < hi)
 			{
-				/* Coming up from right, do clockwise rotations */
-				DBG_ASSERT(tmp->left);
-				p2 = tmp;
-				p3 = tmp->left;
-				if (p3->balance != 1)
-				{
-					/* Do single rotation */
-					p2->left = p3->right;
-					p3->right = p2;
-					p2->balance -= p3->balance;
-					p3->balance++;
-					*Nptr = p3;		/* This points the parent of p2 to p3 */
-					if (p3->balance != 0)
-					{
-						/* If the tree has not been shortened */
-						return freed_node;
-					}
-				}
+				mid = lo + (hi - lo) / 2;
+				if ((*job->tree->compare_nodes)(job->tree, job->b[mid], job->a[i]) < 0)
+					lo = mid + 1;
 				else
-				{
-					/* Do double rotation */
-					p4 = p3->right;
-					p2->left = p4->right;
-					p3->right = p4->left;
-					p4->left = p3;
-					p4->right = p2;
-					if (p4->balance == 0)
-					{
-						p3->balance = 0;
-						p2->balance = 0;
-					}
-					else if (p4->balance == 1)
-					{
-						p3->balance = -1;
-						p2->balance = 0;
-					}
-					else
-					{
-						p3->balance = 0;
-						p2->balance = 1;
-					}
-					p4->balance = 0;
-					*Nptr = p4;		/* This points the parent of p2 to p4 */
-				}
+					hi = mid;
 			}
-			else
+			j = lo;
+		}
+		else
+		{
+			/* split b at its middle, a at the first element greater */
+			j = job->nb / 2;
+			lo = 0;
+			hi = job->na;
+			while (lo < hi)
 			{
-				/* Coming up from left, do counter-clockwise rotations */
-				DBG_ASSERT(tmp->right);
-				p2 = tmp;
-				p3 = tmp->right;
-				if (p3->balance != -1)
-				{
-					/* Do single rotation */
-					p2->right = p3->left;
-					p3->left = p2;
-					if (p3->balance == 0)
-						p2->balance = 1;
-					else
-					p2->balance -= p3->balance;
-					p3->balance--;
-					*Nptr = p3;		/* This points the parent of p2 to p3 */
-					if (p3->balance != 0)
-					{
-						/* If the tree has not been shortened */
-						return freed_node;
-					}
-				}
+				mid = lo + (hi - lo) / 2;
+				if ((*job->tree->compare_nodes)(job->tree, job->a[mid], job->b[j]) <= 0)
+					lo = mid + 1;
 				else
-				{
-					/* Do double rotation */
-					p4 = p3->left;
-		
-					p2->right = p4->left;
-					p3->left = p4->right;
-					p4->right = p3;
-					p4->left = p2;
-					if (p4->balance == 0)
-					{
-						p3->balance = 0;
-						p2->balance = 0;
-					}
-					else if (p4->balance == 1)
-					{
-						p3->balance = 0;
-						p2->balance = -1;
-					}
-					else
-					{
-						p2->balance = 0;
-						p3->balance = 1;
-					}
-					p4->balance = 0;
-					*Nptr = p4;		/* This points the parent of p2 to p4 */
-				}
+					hi = mid;
 			}
+			i = lo;
 		}
+		half[0].na = i;
+		half[0].nb = j;
+		half[1].a += i;
+		half[1].na -= i;
+		half[1].b += j;
+		half[1].nb -= j;
+		half[1].out += i + j;
+		avl_spawn2(avl_merge_runs, &half[0], &half[1], job->threads);
+		return NULL;
+	}
+
+	i = j = 0;
+	while (i < job->na && j < job->nb)
+	{
+		if ((*job->tree->compare_nodes)(job->tree, job->b[j], job->a[i]) < 0)
+			*job->out++ = job->b[j++];
+		else
+			*job->out++ = job->a[i++];
 	}
+	while (i < job->na)
+		*job->out++ = job->a[i++];
+	while (j < job->nb)
+		*job->out++ = job->b[j++];
+	return NULL;
 }
 
+struct avlsortjob
+{
+	struct avltree *tree;
+	struct avlbind **nodes, **tmp;
+	size_t n;
+	int into_tmp;
+	unsigned threads;
+};
+
 /****************************************************************
-	avl_delete()
-		searches and removes node from the tree
-		returns the freed binding
+	avl_sort_nodes()
+	stable merge sort of an array of nodes with the tree's
+	compare_nodes. The sorted result ends up in nodes, or in tmp
+	when into_tmp is set; the halves are sorted in parallel
 ****************************************************************/
-struct avlbind *avl_delete(struct avltree *tree)
+static void *avl_sort_nodes(void *arg)
 {
-	struct avlsearch search;
+	struct avlsortjob *job = (struct avlsortjob *)arg;
+	struct avlsortjob half[2];
+	struct avlmergejob merge;
 	struct avlbind *tmp;
+	size_t i, j;
+	unsigned threads;
 
-	/* Find the node in the tree */
-	tmp = avl_search(tree, &search);
-	if (tmp == NULL)	/* Not found */
+	if (job->n <= 16)
+	{
+		/* insertion sort short runs */
+		for (i = 1; i < job->n; i++)
+		{
+			tmp = job->nodes[i];
+			for (j = i; j > 0 && (*job->tree->compare_nodes)(job->tree, tmp, job->nodes[j-1]) < 0; j--)
+				job->nodes[j] = job->nodes[j-1];
+			job->nodes[j] = tmp;
+		}
+		if (job->into_tmp)
+			for (i = 0; i < job->n; i++)
+				job->tmp[i] = job->nodes[i];
+		return NULL;
+	}
+
+	/* sort each half into the other buffer, then merge back */
+	half[0] = half[1] = *job;
+	half[0].n = job->n / 2;
+	half[1].n = job->n - half[0].n;
+	half[1].nodes += half[0].n;
+	half[1].tmp += half[0].n;
+	half[0].into_tmp = half[1].into_tmp = !job->into_tmp;
+	threads = job->n < AVL_PARALLEL_CUTOFF ? 1 : job->threads;
+	half[0].threads = threads / 2;
+	half[1].threads = threads - half[0].threads;
+	avl_spawn2(avl_sort_nodes, &half[0], &half[1], threads);
+
+	merge.tree = job->tree;
+	merge.a = job->into_tmp ? job->nodes : job->tmp;
+	merge.b = merge.a + half[0].n;
+	merge.out = job->into_tmp ? job->tmp : job->nodes;
+	merge.na = half[0].n;
+	merge.nb = half[1].n;
+	merge.threads = threads;
+	avl_merge_runs(&merge);
+	return NULL;
+}
+
+struct avllinkjob
+{
+	struct avltree *tree;
+	struct avlbind **nodes;
+	size_t n;
+	struct avlbind *root;
+	unsigned threads;
+};
+
+/****************************************************************
+	avl_link_sorted()
+	links a sorted array of nodes into a balanced tree, taking the
+	middle node as the root and building both sides in parallel
+****************************************************************/
+static void *avl_link_sorted(void *arg)
+{
+	struct avllinkjob *job = (struct avllinkjob *)arg;
+	struct avllinkjob half[2];
+	struct avlbind *tmp;
+	size_t left;
+	unsigned threads;
+
+	if (job->n == 0)
+	{
+		job->root = NULL;
 		return NULL;
-	return avl_delete_current(tree, &search);
+	}
+	left = (job->n - 1) / 2;
+	half[0] = half[1] = *job;
+	half[0].nodes = job->nodes;
+	half[0].n = left;
+	half[1].nodes = job->nodes + left + 1;
+	half[1].n = job->n - left - 1;
+	threads = job->n < AVL_PARALLEL_CUTOFF ? 1 : job->threads;
+	half[0].threads = threads / 2;
+	half[1].threads = threads - half[0].threads;
+	avl_spawn2(avl_link_sorted, &half[0], &half[1], threads);
+
+	tmp = job->nodes[left];
+	tmp->left = half[0].root;
+	tmp->right = half[1].root;
+	tmp->balance = avl_height_of_count(half[1].n) - avl_height_of_count(half[0].n);
+	avl_update(job->tree, tmp);
+	job->root = tmp;
+	return NULL;
+}
+
+/****************************************************************
+	avl_build_parallel()
+		builds an empty tree from an unsorted array of nodes,
+		sorting with compare_nodes on up to nthreads threads.
+		As with avl_insert(), the first of several equal nodes
+		wins; on return the linked nodes are at the front of the
+		array in order and the rejected ones follow them.
+		returns the number of nodes linked, -1 if out of memory
+****************************************************************/
+int avl_build_parallel(struct avltree *tree, struct avlbind **nodes, unsigned n, unsigned nthreads)
+{
+	struct avlsortjob sort;
+	struct avllinkjob link;
+	struct avlbind **tmp;
+	unsigned i, kept, dups;
+
+	DBG_ASSERT(tree->frozen == NULL);
+	DBG_ASSERT(tree->root == NULL && (tree->buffer == NULL || tree->buffer->count == 0));
+	DBG_ASSERT(tree->compare_nodes);
+
+	if (nthreads == 0)
+		nthreads = 1;
+	tmp = (struct avlbind **)malloc((n ? n : 1) * sizeof(*tmp));
+	if (tmp == NULL)
+		return -1;
+
+	sort.tree = tree;
+	sort.nodes = nodes;
+	sort.tmp = tmp;
+	sort.n = n;
+	sort.into_tmp = 0;
+	sort.threads = nthreads;
+	avl_sort_nodes(&sort);
+
+	/* keep the first of each run of equal nodes, move the rest aside */
+	kept = dups = 0;
+	for (i = 0; i < n; i++)
+	{
+		if (kept && (*tree->compare_nodes)(tree, nodes[kept-1], nodes[i]) == 0)
+			tmp[dups++] = nodes[i];
+		else
+			nodes[kept++] = nodes[i];
+	}
+	for (i = 0; i < dups; i++)
+		nodes[kept + i] = tmp[i];
+	free(tmp);
+
+	link.tree = tree;
+	link.nodes = nodes;
+	link.n = kept;
+	link.threads = nthreads;
+	avl_link_sorted(&link);
+	tree->root = link.root;
+	tree->num_nodes = kept;
+	tree->stamp++;
+	if (tree->hash)
+		avl_hash_rebuild(tree);
+	if (tree->bloom)
+		avl_bloom_rebuild(tree);
+	if (tree->cache)
+		avl_cache_clear(tree);
+	return (int)kept;
+}
+
+/****************************************************************
+	avl_map_subtree()
+	folds every node of a subtree into an accumulator, in order
+****************************************************************/
+static void avl_map_subtree(struct avltree *tree, struct avlbind *node,
+	void (*map_fn)(struct avltree *tree, void *acc, struct avlbind *node), void *acc)
+{
+	while (node)
+	{
+		avl_map_subtree(tree, node->left, map_fn, acc);
+		(*map_fn)(tree, acc, node);
+		node = node->right;
+	}
+}
+
+struct avlreducetask
+{
+	struct avlbind *node;
+	int whole;		/* the whole subtree, or just the node */
+};
+
+struct avlreducejob
+{
+	struct avltree *tree;
+	void (*map_fn)(struct avltree *tree, void *acc, struct avlbind *node);
+	struct avlreducetask *tasks;
+	char *accs;
+	size_t acc_size;
+	unsigned num_tasks;
+	unsigned next_task;
+#ifdef AVL_PTHREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+/****************************************************************
+	avl_split_tasks()
+	cuts the top of a tree into in-order tasks: single nodes down
+	to the given depth and whole subtrees below it
+****************************************************************/
+static void avl_split_tasks(struct avlreducejob *job, struct avlbind *node, int depth)
+{
+	if (node == NULL)
+		return;
+	if (depth == 0)
+	{
+		job->tasks[job->num_tasks].node = node;
+		job->tasks[job->num_tasks++].whole = 1;
+		return;
+	}
+	avl_split_tasks(job, node->left, depth - 1);
+	job->tasks[job->num_tasks].node = node;
+	job->tasks[job->num_tasks++].whole = 0;
+	avl_split_tasks(job, node->right, depth - 1);
+}
+
+/****************************************************************
+	avl_reduce_worker()
+	takes tasks off the shared queue until it is empty, folding
+	each into its own accumulator
+****************************************************************/
+static void *avl_reduce_worker(void *arg)
+{
+	struct avlreducejob *job = (struct avlreducejob *)arg;
+	struct avlreducetask *task;
+	void *acc;
+	unsigned i;
+
+	for (;;)
+	{
+#ifdef AVL_PTHREADS
+		pthread_mutex_lock(&job->lock);
+#endif
+		i = job->next_task++;
+#ifdef AVL_PTHREADS
+		pthread_mutex_unlock(&job->lock);
+#endif
+		if (i >= job->num_tasks)
+			return NULL;
+		task = &job->tasks[i];
+		acc = job->accs + (size_t)i * job->acc_size;
+		if (task->whole)
+			avl_map_subtree(job->tree, task->node, job->map_fn, acc);
+		else
+			(*job->map_fn)(job->tree, acc, task->node);
+	}
+}
+
+/****************************************************************
+	avl_parallel_reduce()
+		folds every node of the tree into result. On entry result
+		holds the identity value, acc_size bytes long. The tree is
+		cut into subtrees that up to nthreads threads fold into
+		their own accumulators with map_fn; these are then folded
+		into result with combine_fn, left to right in key order,
+		so the operation need only be associative
+****************************************************************/
+void avl_parallel_reduce(struct avltree *tree,
+	void (*map_fn)(struct avltree *tree, void *acc, struct avlbind *node),
+	void (*combine_fn)(struct avltree *tree, void *acc, const void *right),
+	void *result, size_t acc_size, unsigned nthreads)
+{
+	struct avlreducejob job;
+	unsigned i, depth;
+#ifdef AVL_PTHREADS
+	pthread_t *threads;
+	unsigned started;
+#endif
+
+	if (tree->buffer)
+		avl_buffer_flush(tree);
+
+	/* several tasks per thread, so uneven subtrees even out */
+	depth = 0;
+	while (depth < 20 && (1u << depth) < nthreads * 8)
+		depth++;
+
+	job.tasks = NULL;
+	job.accs = NULL;
+	if (nthreads > 1 && tree->num_nodes >= AVL_PARALLEL_CUTOFF)
+	{
+		job.tasks = (struct avlreducetask *)malloc(((size_t)2 << depth) * sizeof(*job.tasks));
+		job.accs = (char *)malloc(((size_t)2 << depth) * acc_size);
+	}
+	if (job.tasks == NULL || job.accs == NULL)
+	{
+		/* too small to split, or no memory for partial results */
+		free(job.tasks);
+		free(job.accs);
+		avl_map_subtree(tree, tree->root, map_fn, result);
+		return;
+	}
+
+	job.tree = tree;
+	job.map_fn = map_fn;
+	job.acc_size = acc_size;
+	job.num_tasks = 0;
+	job.next_task = 0;
+	avl_split_tasks(&job, tree->root, depth);
+	for (i = 0; i < job.num_tasks; i++)
+		memcpy(job.accs + (size_t)i * acc_size, result, acc_size);
+
+#ifdef AVL_PTHREADS
+	pthread_mutex_init(&job.lock, NULL);
+	threads = (pthread_t *)malloc(nthreads * sizeof(*threads));
+	started = 0;
+	if (threads)
+		while (started < nthreads - 1 &&
+			pthread_create(&threads[started], NULL, avl_reduce_worker, &job) == 0)
+			started++;
+	avl_reduce_worker(&job);
+	while (started)
+		pthread_join(threads[--started], NULL);
+	free(threads);
+	pthread_mutex_destroy(&job.lock);
+#else
+	avl_reduce_worker(&job);
+#endif
+
+	for (i = 0; i < job.num_tasks; i++)
+		(*combine_fn)(tree, result, job.accs + (size_t)i * acc_size);
+	free(job.tasks);
+	free(job.accs);
 }
 
 #if 0
@@ -691,3 +4087,5 @@ void avl_sample(void)
 	}
 }
 #endif
+
+#endif /* AVLSEARCH_H */
@@ -8,13 +8,27 @@
   this software is placed in the public domain
   provided that you use it at your own risk
 
+  build with: cc -pthread avltest.c -o avltest
+
 ****************************************************************/
 
+/* the bulk operations run on threads, and split trees as small as
+ the tests build, so that the threaded paths are the ones tested */
+#define AVL_PTHREADS
+#define AVL_PARALLEL_CUTOFF 32
 #include "avlsearch.h"
+#include "avltrace.h"
+#include "avldurable.h"
+#include "avlpaged.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 void permgen(unsigned base, unsigned index, unsigned * output) {
   unsigned i, j;
@@ -50,16 +64,26 @@ typedef struct mynode_ {
   unsigned count;
   int leftheight;
   int rightheight;
+  unsigned long sum;
+  unsigned size;
 } mynode;
 
 static int inline max(int a, int b) {
   return a > b ? a : b;
 }
+unsigned long Compares = 0;
 static int compare(struct avltree *tree, struct avlbind *node) {
   unsigned lhs = ((mytree*)tree)->key;
+  Compares++;
   unsigned rhs = ((mynode*)node)->key;
   return lhs - rhs;
 }
+static int compare_nodes(struct avltree *tree, struct avlbind *lhs,
+                         struct avlbind *rhs) {
+  unsigned l = ((mynode*)lhs)->key;
+  unsigned r = ((mynode*)rhs)->key;
+  return l < r ? -1 : l > r ? 1 : 0;
+}
 
 /****************************************************************
  IsAVL
@@ -204,10 +228,323 @@ void MakeTestTree(mytree *tree) {
   }
 }
 
+/****************************************************************
+ Exhaustive verification
+ Every insertion order of n keys, and every tree shape of a
+ height with each of its keys deleted, checked across all the
+ cores: one forked worker per core takes every workers'th share
+ of the work, and reports its progress through shared memory.
+ A worker has its own nodes, which cache the height, size and
+ key range of their subtrees. After a step only the search path
+ and the nodes whose links changed, which a correct step keeps
+ next to the path, are checked again; any other change brings
+ on a check of the whole tree. Height 6 has about 1.2 * 10^10
+ shapes, a day of one core, so the shapes can be split into
+ parts as well, each run on another machine
+ ****************************************************************/
+#define VERIFY_MAX_KEYS 12
+#define VERIFY_MAX_HEIGHT 6
+#define VERIFY_NODES 64
+#define VERIFY_CHANGED 99   /* a balance no node has */
+
+typedef struct vnode_ {
+  struct avlbind node;
+  unsigned key;
+  int height;
+  unsigned size, lo, hi;
+} vnode;
+
+typedef struct verifier_ {
+  struct avltree tree;
+  unsigned key;
+  vnode nodes[VERIFY_NODES];
+  struct avlbind saved[VERIFY_NODES];   /* the links before the step */
+  unsigned count;                       /* nodes in use */
+  unsigned worker, workers;
+  unsigned long long shares;
+  volatile unsigned long long *progress;
+} verifier;
+
+unsigned VerifyKeys = 8, VerifyHeight = 5;
+unsigned VerifyPart = 0, VerifyParts = 1;
+unsigned long NumTrees[VERIFY_MAX_HEIGHT + 1];
+
+static int vcompare(struct avltree *tree, struct avlbind *node) {
+  unsigned lhs = ((verifier*)tree)->key;
+  unsigned rhs = ((vnode*)node)->key;
+  return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+
+static int VerifyChanged(verifier *v, vnode *node) {
+  struct avlbind *saved = &v->saved[node - v->nodes];
+  return saved->balance == VERIFY_CHANGED || saved->left != node->node.left ||
+         saved->right != node->node.right || saved->balance != node->node.balance;
+}
+
+static void VerifySave(verifier *v) {
+  unsigned i;
+  for (i = 0; i < v->count; i++)
+    v->saved[i] = v->nodes[i].node;
+}
+
+/****************************************************************
+ VerifyNode
+ Rechecks a node on the search path for key or its neighbours,
+ which a delete may move up in its place, or changed, after its
+ children, and recomputes what it caches; other nodes keep
+ theirs. Counts the changed nodes it reaches
+ ****************************************************************/
+static void VerifyNode(verifier *v, vnode *node, int onpath, unsigned key,
+                       unsigned *reached) {
+  vnode *left = (vnode*)node->node.left, *right = (vnode*)node->node.right;
+  int lh, rh, changed = VerifyChanged(v, node);
+
+  if (!onpath && !changed)
+    return;
+  *reached += changed;
+  if (left)
+    VerifyNode(v, left, onpath && key <= node->key + 1, key, reached);
+  if (right)
+    VerifyNode(v, right, onpath && key + 1 >= node->key, key, reached);
+  lh = left ? left->height : 0;
+  rh = right ? right->height : 0;
+  assert(node->node.balance == rh - lh);
+  assert((unsigned)(node->node.balance + 1) <= 2);
+  assert(left == NULL || left->hi < node->key);
+  assert(right == NULL || right->lo > node->key);
+  node->height = max(lh, rh) + 1;
+  node->size = 1 + (left ? left->size : 0) + (right ? right->size : 0);
+  node->lo = left ? left->lo : node->key;
+  node->hi = right ? right->hi : node->key;
+}
+
+/****************************************************************
+ VerifyStep
+ Checks the tree after a step on key, given the links saved
+ before it; gone is a node the step took out, or NULL
+ ****************************************************************/
+static void VerifyStep(verifier *v, unsigned key, struct avlbind *gone,
+                       unsigned expect) {
+  unsigned i, changed = 0, reached = 0;
+
+  for (i = 0; i < v->count; i++)
+    if (&v->nodes[i].node != gone && VerifyChanged(v, &v->nodes[i]))
+      changed++;
+  if (v->tree.root)
+    VerifyNode(v, (vnode*)v->tree.root, 1, key, &reached);
+  if (reached != changed) {
+    /* a change away from the path; check everything */
+    for (i = 0; i < v->count; i++)
+      v->saved[i].balance = VERIFY_CHANGED;
+    VerifyNode(v, (vnode*)v->tree.root, 1, key, &reached);
+  }
+  assert(v->tree.num_nodes == expect);
+  assert(expect == 0 ? v->tree.root == NULL : ((vnode*)v->tree.root)->size == expect);
+}
+
+/****************************************************************
+ VerifyInsertions
+ Inserts every remaining key in turn, depth first, checking
+ each step and then undoing it from a copy of the nodes, so
+ orders sharing a prefix share its work. The shares are the
+ orders of the first two keys
+ ****************************************************************/
+static void VerifyInsertions(verifier *v, unsigned n, unsigned depth, unsigned used) {
+  vnode undo[VERIFY_MAX_KEYS];
+  struct avlbind *root = v->tree.root, *added;
+  unsigned key;
+
+  if (depth == (n < 2 ? n : 2) && v->shares++ % v->workers != v->worker)
+    return;
+  if (depth == n) {
+    (*v->progress)++;
+    return;
+  }
+  memcpy(undo, v->nodes, depth * sizeof(vnode));
+  for (key = 0; key < n; key++) {
+    if (used & 1u << key)
+      continue;
+    v->count = depth + 1;
+    VerifySave(v);
+    v->saved[depth].balance = VERIFY_CHANGED;
+    v->key = v->nodes[depth].key = key;
+    added = avl_insert(&v->tree, &v->nodes[depth].node);
+    assert(added == &v->nodes[depth].node);
+    VerifyStep(v, key, NULL, depth + 1);
+    VerifyInsertions(v, n, depth + 1, used | 1u << key);
+    memcpy(v->nodes, undo, depth * sizeof(vnode));
+    v->tree.root = root;
+    v->tree.num_nodes = depth;
+  }
+}
+
+/****************************************************************
+ MakeShape()
+ Builds the tree shape of a given height with an index less than
+ NumTrees[height], from the worker's nodes
+ ****************************************************************/
+static struct avlbind *MakeShape(verifier *v, unsigned long index, unsigned height) {
+  struct avlbind *tmp;
+  unsigned long t1, t1sqr, t2;
+
+  if (height == 0)
+    return NULL;
+  assert(v->count < VERIFY_NODES);
+  tmp = &v->nodes[v->count++].node;
+  if (height == 1) {
+    tmp->left = tmp->right = NULL;
+    tmp->balance = 0;
+    return tmp;
+  }
+  t2 = NumTrees[height - 2];
+  t1 = NumTrees[height - 1];
+  t1sqr = t1 * t1;
+  if (index < t1sqr) {
+    tmp->left = MakeShape(v, index % t1, height - 1);
+    tmp->right = MakeShape(v, index / t1, height - 1);
+    tmp->balance = 0;
+    return tmp;
+  }
+  index -= t1sqr;
+  if (index < t1 * t2) {
+    tmp->left = MakeShape(v, index % t1, height - 1);
+    tmp->right = MakeShape(v, index / t1, height - 2);
+    tmp->balance = -1;
+    return tmp;
+  }
+  index -= t1 * t2;
+  tmp->right = MakeShape(v, index % t1, height - 1);
+  tmp->left = MakeShape(v, index / t1, height - 2);
+  tmp->balance = 1;
+  return tmp;
+}
+
+static void NumberShape(struct avlbind *node, unsigned *next) {
+  if (node == NULL)
+    return;
+  NumberShape(node->left, next);
+  ((vnode*)node)->key = (*next)++;
+  NumberShape(node->right, next);
+}
+
+/* the shapes of a height in this run's part */
+static void ShapeRange(unsigned height, unsigned long *first, unsigned long *last) {
+  *first = NumTrees[height] * VerifyPart / VerifyParts;
+  *last = NumTrees[height] * (VerifyPart + 1) / VerifyParts;
+}
+
+/****************************************************************
+ VerifyDeletions
+ Deletes each key in turn from every shape of a height in this
+ run's part, undoing each delete from a copy. The shares are
+ runs of 64 shapes
+ ****************************************************************/
+static void VerifyDeletions(verifier *v, unsigned height) {
+  static vnode undo[VERIFY_NODES];
+  struct avlbind *root, *gone;
+  unsigned long t, first, last;
+  unsigned key, n;
+
+  ShapeRange(height, &first, &last);
+  for (t = first; t < last; t++) {
+    if (t / 64 % v->workers != v->worker)
+      continue;
+    v->count = 0;
+    root = MakeShape(v, t, height);
+    n = 0;
+    NumberShape(root, &n);
+    v->tree.root = root;
+    v->tree.num_nodes = n;
+    for (key = 0; key < n; key++)
+      v->saved[key].balance = VERIFY_CHANGED;
+    VerifyStep(v, 0, NULL, n);
+
+    memcpy(undo, v->nodes, n * sizeof(vnode));
+    for (key = 0; key < n; key++) {
+      VerifySave(v);
+      v->key = key;
+      gone = avl_delete(&v->tree);
+      assert(gone && ((vnode*)gone)->key == key);
+      VerifyStep(v, key, gone, n - 1);
+      memcpy(v->nodes, undo, n * sizeof(vnode));
+      v->tree.root = root;
+      v->tree.num_nodes = n;
+    }
+    (*v->progress)++;
+  }
+}
+
+/****************************************************************
+ Verify
+ Runs the insertions of size keys, or with height set the
+ deletions from shapes of that height, on a worker per core,
+ printing the progress and rate until all of them are done
+ ****************************************************************/
+static void Verify(unsigned size, unsigned height) {
+  volatile unsigned long long *progress;
+  unsigned long long total, done;
+  unsigned w, workers, running, pause = 1000;
+  struct timespec start, now;
+  double elapsed;
+  pid_t pid;
+  int status;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  workers = cores < 1 ? 1 : cores > 64 ? 64 : (unsigned)cores;
+  total = 1;
+  if (height) {
+    unsigned long first, last;
+    ShapeRange(height, &first, &last);
+    total = last - first;
+  } else
+    for (w = 2; w <= size; w++)
+      total *= w;
+  /* a cache line each */
+  progress = (volatile unsigned long long *)mmap(NULL, workers * 64, PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  assert(progress != MAP_FAILED);
+  fflush(stdout);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (w = 0; w < workers; w++) {
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+      static verifier v;
+      memset(&v, 0, sizeof(v));
+      v.tree.compare_key_tree = vcompare;
+      v.worker = w;
+      v.workers = workers;
+      v.progress = progress + w * 8;
+      if (height)
+        VerifyDeletions(&v, height);
+      else
+        VerifyInsertions(&v, size, 0, 0);
+      _exit(0);
+    }
+  }
+
+  for (running = workers; running; ) {
+    while (running && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+      running--;
+    }
+    for (done = 0, w = 0; w < workers; w++)
+      done += progress[w * 8];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("\r%llu/%llu %s, %.0f/s on %u workers", done, total,
+           height ? "shapes" : "orders", elapsed > 0 ? done / elapsed : 0.0, workers);
+    fflush(stdout);
+    if (running)
+      usleep(pause < 500000 ? pause *= 2 : pause);
+  }
+  printf("\n");
+  assert(done == total);
+  munmap((void *)progress, workers * 64);
+}
+
 void TreeTest(void) {
-  int i, j, k, NumEntries;
-  unsigned fact[16];
-  unsigned buf[16];
+  int i, NumEntries;
 
   mytree tree;
   printf("Inserting into test tree at strategic positions\n");
@@ -267,30 +604,8 @@ void TreeTest(void) {
   printf("Test passed\n");
 
   printf("Inserting values in all possible permutations\n");
-  j = 1;
-  for (i = 1; i <= 15; i++) {
-    j *= i;
-    fact[i] = j;
-  }
-
-  /* table was initialized to 15, but values beyond 8 can take a long time */
-  for (i = 2; i <= 8; i++) {
-    for (j = 0; j < fact[i]; j++) {
-      permgen(i, j, buf);
-      memset(&tree, 0, sizeof(tree));
-      tree.tree.compare_key_tree = compare;
-      for (k = 0; k < i; k++) {
-        insert_value(&tree, buf[k]);
-        NumEntries = IsAVL((mynode*)tree.tree.root);
-        assert(NumEntries >= 0);
-        assert(NumEntries == k + 1);
-      }
-      printf("\r%07u/%07u Size: %u", j + 1, fact[i], NumEntries);
-      FreeTree(tree.tree.root);
-    }
-    printf("\n");
-  }
-  assert(FreeNodeCount() == MAX_NODES);
+  for (i = 2; i <= (int)VerifyKeys; i++)
+    Verify(i, 0);
   printf("Test passed\n");
 }
 
@@ -308,50 +623,6 @@ void MakeSevenTree(mytree *tree, unsigned *buf) {
   }
 }
 
-unsigned long NumTrees[6];
-/****************************************************************
- MakeSeqTree()
- For enumerating all possible trees of a given height
- in order by index. index must be less than NumTrees[height]
- ****************************************************************/
-struct avlbind *MakeSeqTree(unsigned long index, unsigned height) {
-  struct avlbind *tmp;
-  unsigned long t1, t1sqr, t2;
-
-  assert(index < NumTrees[height]);
-
-  if (height == 0)
-    return NULL;
-
-  tmp = &GetNode()->node;
-  if (height == 1) {
-    tmp->left = tmp->right = NULL;
-    tmp->balance = 0;
-    return tmp;
-  }
-  t2 = NumTrees[height - 2];
-  t1 = NumTrees[height - 1];
-  t1sqr = t1 * t1;
-  if (index < t1sqr) {
-    tmp->left = MakeSeqTree(index % t1, height - 1);
-    tmp->right = MakeSeqTree(index / t1, height - 1);
-    tmp->balance = 0;
-    return tmp;
-  }
-  index -= t1sqr;
-  if (index < t1 * t2) {
-    tmp->left = MakeSeqTree(index % t1, height - 1);
-    tmp->right = MakeSeqTree(index / t1, height - 2);
-    tmp->balance = -1;
-    return tmp;
-  }
-  index -= t1 * t2;
-  tmp->right = MakeSeqTree(index % t1, height - 1);
-  tmp->left = MakeSeqTree(index / t1, height - 2);
-  tmp->balance = 1;
-  return tmp;
-}
-
 unsigned SeqVal = 0;
 
 /****************************************************************
@@ -368,7 +639,6 @@ void FillSeqTree(struct avlbind *node) {
 
 void DeleteTest(void) {
   int NumEntries;
-  unsigned long t;
   unsigned i, j, k;
   unsigned fact[16];
   unsigned buf[16];
@@ -396,36 +666,15 @@ void DeleteTest(void) {
   }
   printf("Test passed\n");
 
-  // Test deleting one node from all trees of height up to 5
+  // Test deleting one node from all trees of height up to VerifyHeight
   NumTrees[0] = NumTrees[1] = 1;
-  for (i = 2; i < 6; i++)
+  for (i = 2; i <= VERIFY_MAX_HEIGHT; i++)
     NumTrees[i] = NumTrees[i - 1] * (2 * NumTrees[i - 2] + NumTrees[i - 1]);
 
-  printf("Testing deletion from all possible tree shapes to height 5\n");
-  for (j = 1; j < 6; j++) {
-    for (t = 0; t < NumTrees[j]; t++) {
-      for (i = 0;;) {
-        mytree tree;
-        memset(&tree, 0, sizeof(tree));
-        tree.tree.compare_key_tree = compare;
-        tree.tree.root = MakeSeqTree(t, j);
-        SeqVal = 0;
-        FillSeqTree(tree.tree.root);
-        delete_value(&tree, i);
-        NumEntries = IsAVL((mynode*)tree.tree.root);
-        assert(NumEntries >= 0);
-        assert(NumEntries == SeqVal - 1);
-        FreeTree(tree.tree.root);
-        assert(FreeNodeCount() == MAX_NODES);
-        if (++i == SeqVal)
-          break;
-      }
-      if ((t & 0xf) == 0) {
-        printf("%lu\r", t);
-      }
-    }
-    printf("%lu\n", t);
-  }
+  printf("Testing deletion from all possible tree shapes to height %u, part %u of %u\n",
+         VerifyHeight, VerifyPart + 1, VerifyParts);
+  for (j = 1; j <= VerifyHeight; j++)
+    Verify(0, j);
   printf("Test passed\n");
 }
 
@@ -517,7 +766,1937 @@ void RandomTreeTest(void) {
   printf("\r%lu\nTest Passed\n", i);
 }
 
+void BuildTest(void) {
+  static struct avlbind *Array[MAX_NODES];
+  struct avlsearch search;
+  struct avlbind *prev, *cur;
+  unsigned threads, i, j, n;
+  int kept, NumEntries;
+  mytree tree;
+
+  printf("Building trees from unsorted values with duplicates\n");
+  for (threads = 1; threads <= 8; threads *= 2) {
+    for (n = 1; n <= MAX_NODES; n += n < 20 ? 1 : 101) {
+      for (i = 0; i < n; i++) {
+        mynode *node = GetNode();
+        node->key = rand() % (n / 2 + 1);
+        node->count = i;
+        Array[i] = &node->node;
+      }
+      memset(&tree, 0, sizeof(tree));
+      tree.tree.compare_key_tree = compare;
+      tree.tree.compare_nodes = compare_nodes;
+      kept = avl_build_parallel(&tree.tree, Array, n, threads);
+      assert(kept >= 0 && kept <= n);
+      assert(tree.tree.num_nodes == kept);
+      NumEntries = IsAVL((mynode*)tree.tree.root);
+      assert(NumEntries == kept);
+
+      /* in order, and the first of equal values was kept */
+      prev = NULL;
+      for (cur = avl_get_first(&tree.tree, &search), i = 0; cur;
+           cur = avl_get_next(&search), i++) {
+        assert(cur == Array[i]);
+        assert(prev == NULL || ((mynode*)prev)->key < ((mynode*)cur)->key);
+        prev = cur;
+      }
+      assert(i == kept);
+      for (i = kept; i < n; i++) {
+        tree.key = ((mynode*)Array[i])->key;
+        cur = avl_get_greater_equal(&tree.tree, &search);
+        assert(cur && ((mynode*)cur)->key == tree.key);
+        assert(((mynode*)cur)->count < ((mynode*)Array[i])->count);
+      }
+      for (j = kept; j < n; j++)
+        FreeNode((mynode*)Array[j]);
+      FreeTree(tree.tree.root);
+      assert(FreeNodeCount() == MAX_NODES);
+    }
+  }
+  printf("Test passed\n");
+}
+
+typedef struct reduceacc_ {
+  unsigned count;
+  unsigned long sum;
+  unsigned first, last;
+  unsigned combines;
+  int ordered;
+} reduceacc;
+
+static void reduce_map(struct avltree *tree, void *acc, struct avlbind *node) {
+  reduceacc *r = (reduceacc*)acc;
+  unsigned key = ((mynode*)node)->key;
+  if (r->count == 0)
+    r->first = key;
+  else if (r->last >= key)
+    r->ordered = 0;
+  r->last = key;
+  r->count++;
+  r->sum += key;
+}
+
+static void reduce_combine(struct avltree *tree, void *acc, const void *right) {
+  reduceacc *r = (reduceacc*)acc;
+  const reduceacc *rhs = (const reduceacc*)right;
+  r->combines++;
+  if (rhs->count == 0)
+    return;
+  if (r->count == 0)
+    r->first = rhs->first;
+  else if (r->last >= rhs->first)
+    r->ordered = 0;
+  r->ordered &= rhs->ordered;
+  r->last = rhs->last;
+  r->count += rhs->count;
+  r->sum += rhs->sum;
+}
+
+void ReduceTest(void) {
+  unsigned threads, i;
+  unsigned long sum = 0;
+  reduceacc acc;
+  mytree tree;
+
+  printf("Reducing over a tree in key order\n");
+  memset(&tree, 0, sizeof(tree));
+  tree.tree.compare_key_tree = compare;
+  for (i = 0; i < MAX_NODES; i++) {
+    insert_value(&tree, rand());
+    if (tree.tree.num_nodes == i + 1)
+      sum += tree.key;
+  }
+  for (threads = 1; threads <= 16; threads++) {
+    memset(&acc, 0, sizeof(acc));
+    acc.ordered = 1;
+    avl_parallel_reduce(&tree.tree, reduce_map, reduce_combine, &acc,
+                        sizeof(acc), threads);
+    assert(acc.count == tree.tree.num_nodes);
+    assert(acc.sum == sum);
+    assert(acc.ordered);
+    /* more than one thread splits the tree into tasks */
+    assert((acc.combines > 0) == (threads > 1));
+  }
+  FreeTree(tree.tree.root);
+  assert(FreeNodeCount() == MAX_NODES);
+  printf("Test passed\n");
+}
+
+static void update_sum(struct avltree *tree, struct avlbind *node) {
+  mynode *n = (mynode*)node;
+  n->sum = n->key;
+  n->size = 1;
+  if (node->left) {
+    n->sum += ((mynode*)node->left)->sum;
+    n->size += ((mynode*)node->left)->size;
+  }
+  if (node->right) {
+    n->sum += ((mynode*)node->right)->sum;
+    n->size += ((mynode*)node->right)->size;
+  }
+}
+
+/****************************************************************
+ CheckSums
+ Checks the aggregates kept by update_sum, returns the node count
+ ****************************************************************/
+static unsigned CheckSums(struct avlbind *node, unsigned long *sum) {
+  unsigned long lsum = 0, rsum = 0;
+  unsigned size;
+  if (node == NULL) {
+    *sum = 0;
+    return 0;
+  }
+  size = CheckSums(node->left, &lsum) + CheckSums(node->right, &rsum) + 1;
+  *sum = lsum + rsum + ((mynode*)node)->key;
+  assert(((mynode*)node)->sum == *sum);
+  assert(((mynode*)node)->size == size);
+  return size;
+}
+
+typedef struct rangeacc_ {
+  unsigned long sum;
+  unsigned count;
+  unsigned calls;
+  int last;
+} rangeacc;
+
+static void range_fold(struct avltree *tree, void *acc, struct avlbind *node,
+                       int subtree) {
+  rangeacc *r = (rangeacc*)acc;
+  mynode *n = (mynode*)node;
+  struct avlbind *first = node;
+  r->calls++;
+  if (!subtree) {
+    assert((int)n->key > r->last);
+    r->last = n->key;
+    r->sum += n->key;
+    r->count++;
+    return;
+  }
+  while (first->left)
+    first = first->left;
+  assert((int)((mynode*)first)->key > r->last);
+  while (node->right)
+    node = node->right;
+  r->last = ((mynode*)node)->key;
+  r->sum += n->sum;
+  r->count += n->size;
+}
+
+void AggregateTest(void) {
+  static struct avlbind *Array[MAX_NODES];
+  struct avlsearch search;
+  struct avlbind *cur;
+  mynode lo, hi, *node;
+  unsigned long sum;
+  unsigned i, j, a, b, count;
+  rangeacc acc;
+  mytree tree;
+
+  printf("Keeping subtree sums through inserts and deletes\n");
+  memset(&tree, 0, sizeof(tree));
+  tree.tree.compare_key_tree = compare;
+  tree.tree.compare_nodes = compare_nodes;
+  tree.tree.update_node = update_sum;
+  for (i = 0; i < 20000; i++) {
+    tree.key = rand() % 2048;
+    if (tree.tree.num_nodes < 600 && (rand() & 1)) {
+      node = GetNode();
+      node->key = tree.key;
+      if (avl_insert(&tree.tree, &node->node) != &node->node)
+        FreeNode(node);
+    } else if ((node = (mynode*)avl_delete(&tree.tree)) != NULL) {
+      FreeNode(node);
+    }
+    assert(CheckSums(tree.tree.root, &sum) == tree.tree.num_nodes);
+    assert(IsAVL((mynode*)tree.tree.root) == tree.tree.num_nodes);
+
+    if (i % 16)
+      continue;
+    a = rand() % 2100;
+    b = rand() % 2100;
+    lo.key = a < b ? a : b;
+    hi.key = a < b ? b : a;
+    for (j = 0; j < 4; j++) {
+      memset(&acc, 0, sizeof(acc));
+      acc.last = -1;
+      avl_range_aggregate(&tree.tree, j & 1 ? NULL : &lo.node,
+                          j & 2 ? NULL : &hi.node, range_fold, &acc);
+      sum = count = 0;
+      for (cur = avl_get_first(&tree.tree, &search); cur;
+           cur = avl_get_next(&search)) {
+        if (!(j & 1) && ((mynode*)cur)->key < lo.key)
+          continue;
+        if (!(j & 2) && ((mynode*)cur)->key > hi.key)
+          continue;
+        sum += ((mynode*)cur)->key;
+        count++;
+      }
+      assert(acc.sum == sum);
+      assert(acc.count == count);
+      assert(acc.calls <= 4 * 40);
+    }
+  }
+
+  /* bulk builds fill in the sums as well */
+  for (cur = avl_get_first(&tree.tree, &search), i = 0; cur;
+       cur = avl_get_next(&search))
+    Array[i++] = cur;
+  tree.tree.root = NULL;
+  assert(avl_build_parallel(&tree.tree, Array, i, 4) == i);
+  assert(CheckSums(tree.tree.root, &sum) == i);
+  FreeTree(tree.tree.root);
+  assert(FreeNodeCount() == MAX_NODES);
+  printf("Test passed\n");
+}
+
+typedef struct myinterval_ {
+  struct avlinterval iv;
+  int found;
+} myinterval;
+
+typedef struct overlapcheck_ {
+  long low, high;
+  unsigned count;
+  struct avlinterval *last;
+} overlapcheck;
+
+static int report_overlap(struct avlinterval *iv, void *context) {
+  overlapcheck *check = (overlapcheck*)context;
+  assert(iv->low <= check->high && iv->high >= check->low);
+  assert(check->last == NULL ||
+         avl_interval_compare_nodes(NULL, &check->last->bind, &iv->bind) < 0);
+  check->last = iv;
+  check->count++;
+  return 0;
+}
+
+static int stop_after_three(struct avlinterval *iv, void *context) {
+  return ++*(unsigned*)context == 3 ? 42 : 0;
+}
+
+void IntervalTest(void) {
+  static myinterval Intervals[512];
+  struct avlintervaltree tree;
+  struct avlsearch search;
+  struct avlbind *cur;
+  struct avlinterval *iv;
+  overlapcheck check;
+  unsigned i, j, count, in_tree;
+  long a, b;
+
+  printf("Querying an interval tree for overlaps\n");
+  avl_interval_init(&tree);
+  in_tree = 0;
+  for (i = 0; i < 20000; i++) {
+    myinterval *slot = &Intervals[rand() % 512];
+    if (slot->found) {
+      iv = avl_interval_delete(&tree, slot->iv.low, slot->iv.high);
+      assert(iv == &slot->iv);
+      slot->found = 0;
+      in_tree--;
+    } else {
+      slot->iv.low = rand() % 1000;
+      slot->iv.high = slot->iv.low + rand() % (rand() & 1 ? 10 : 300);
+      if (avl_interval_insert(&tree, &slot->iv) == &slot->iv) {
+        slot->found = 1;
+        in_tree++;
+      }
+    }
+    assert(tree.tree.num_nodes == in_tree);
+
+    if (i % 8)
+      continue;
+    a = rand() % 1400 - 100;
+    b = rand() % 4 ? a : a + rand() % 100;
+    for (j = 0; j < 2; j++) {
+      memset(&check, 0, sizeof(check));
+      check.low = a;
+      check.high = b;
+      if (j == 0)
+        avl_interval_overlap(&tree, a, b, report_overlap, &check);
+      else if (a == b)
+        avl_interval_stab(&tree, a, report_overlap, &check);
+      else
+        break;
+      count = 0;
+      for (cur = avl_get_first(&tree.tree, &search); cur;
+           cur = avl_get_next(&search)) {
+        iv = (struct avlinterval*)cur;
+        if (iv->low <= b && iv->high >= a)
+          count++;
+      }
+      assert(check.count == count);
+    }
+  }
+
+  count = 0;
+  assert(avl_interval_overlap(&tree, 0, 2000, stop_after_three, &count) == 42);
+  assert(count == 3);
+  printf("Test passed\n");
+}
+
+static int reference_compare(const char *l, size_t llen, const char *r,
+                             size_t rlen) {
+  int cmp = memcmp(l, r, llen < rlen ? llen : rlen);
+  if (cmp)
+    return cmp;
+  return llen < rlen ? -1 : llen > rlen ? 1 : 0;
+}
+
+void StringTest(void) {
+  static struct avlstrnode Strings[512];
+  static char Keys[512][24];
+  static size_t Lengths[512];
+  static int InTree[512];
+  static const char *stems[] = { "", "a", "http://", "http://example.com/",
+      "http://example.com/a\0b" };
+  struct avlstrtree tree;
+  struct avlsearch search;
+  struct avlbind *cur, *prev;
+  struct avlstrnode *node;
+  unsigned i, k, in_tree, count;
+  size_t stem, j;
+
+  printf("Ordering a string keyed tree by cached prefixes\n");
+  avl_str_init(&tree);
+  in_tree = 0;
+  for (i = 0; i < 20000; i++) {
+    k = rand() % 512;
+    if (InTree[k]) {
+      node = avl_str_delete(&tree, Keys[k], Lengths[k]);
+      assert(node == &Strings[k]);
+      InTree[k] = 0;
+      in_tree--;
+    } else {
+      /* shared stems, bytes above 0x7f and embedded NULs all tie the prefix */
+      stem = rand() % 5;
+      Lengths[k] = strlen(stems[stem]) + (stem == 4 ? 2 : 0);
+      memcpy(Keys[k], stems[stem], Lengths[k]);
+      for (j = rand() % 3; j > 0; j--)
+        Keys[k][Lengths[k]++] = "\0a\xff"[rand() % 3];
+      node = avl_str_insert(&tree, &Strings[k], Keys[k], Lengths[k]);
+      if (node == &Strings[k]) {
+        InTree[k] = 1;
+        in_tree++;
+      } else
+        assert(reference_compare(node->key, node->len, Keys[k], Lengths[k]) == 0);
+    }
+    assert(tree.tree.num_nodes == in_tree);
+    if (i % 64)
+      continue;
+    count = 0;
+    prev = NULL;
+    for (cur = avl_get_first(&tree.tree, &search); cur;
+         cur = avl_get_next(&search), count++) {
+      node = (struct avlstrnode*)cur;
+      if (prev)
+        assert(reference_compare(((struct avlstrnode*)prev)->key,
+                                 ((struct avlstrnode*)prev)->len,
+                                 node->key, node->len) < 0);
+      prev = cur;
+    }
+    assert(count == in_tree);
+  }
+
+  for (k = 0; k < 512; k++) {
+    avl_str_key(&tree, Keys[k], Lengths[k]);
+    cur = avl_get_greater_equal(&tree.tree, &search);
+    if (InTree[k])
+      assert(cur == &Strings[k].bind);
+  }
+  printf("Test passed\n");
+}
+
+void SeekTest(void) {
+  struct avlsearch search, check;
+  struct avlbind *found, *expect;
+  unsigned i, key;
+  int dir;
+  mytree tree;
+
+  printf("Finger searching from the previous position\n");
+  memset(&tree, 0, sizeof(tree));
+  tree.tree.compare_key_tree = compare;
+  for (i = 0; i < MAX_NODES; i++)
+    insert_value(&tree, i * 2);
+
+  /* random jumps agree with the searches from the root */
+  avl_get_first(&tree.tree, &search);
+  for (i = 0; i < 100000; i++) {
+    tree.key = rand() % (MAX_NODES * 2 + 2);
+    dir = rand() % 3 - 1;
+    if (dir > 0)
+      expect = avl_get_greater_equal(&tree.tree, &check);
+    else if (dir < 0)
+      expect = avl_get_less_equal(&tree.tree, &check);
+    else
+      expect = tree.key & 1 || tree.key >= MAX_NODES * 2 ? NULL :
+          avl_get_greater_equal(&tree.tree, &check);
+    found = avl_seek(&tree.tree, &search, dir);
+    assert(found == expect);
+    if (found == NULL)
+      avl_get_first(&tree.tree, &search);
+    else if (rand() & 1) {
+      /* the cursor is still good for stepping */
+      expect = avl_get_next(&check);
+      assert(avl_get_next(&search) == expect);
+      if (expect == NULL)
+        avl_get_last(&tree.tree, &search);
+    }
+  }
+
+  /* walking forward in small steps stays cheap */
+  tree.key = 0;
+  avl_get_first(&tree.tree, &search);
+  Compares = 0;
+  for (key = 0; key < MAX_NODES * 2; key += 3) {
+    tree.key = key;
+    found = avl_seek(&tree.tree, &search, 1);
+    assert(found && ((mynode*)found)->key == key + (key & 1));
+  }
+  assert(Compares < 4 * (MAX_NODES * 2 / 3));
+
+  FreeTree(tree.tree.root);
+  assert(FreeNodeCount() == MAX_NODES);
+  printf("Test passed\n");
+}
+
+static int counted_compare_nodes(struct avltree *tree, struct avlbind *lhs,
+                                 struct avlbind *rhs) {
+  Compares++;
+  return compare_nodes(tree, lhs, rhs);
+}
+
+void RangeTest(void) {
+  struct avlsearch search, check;
+  struct avlbind *out[64], *expect;
+  mynode hi;
+  unsigned i, j, n, max, total;
+  mytree tree;
+
+  printf("Draining ranges into an array\n");
+  memset(&tree, 0, sizeof(tree));
+  tree.tree.compare_key_tree = compare;
+  tree.tree.compare_nodes = counted_compare_nodes;
+  for (i = 0; i < MAX_NODES; i++)
+    insert_value(&tree, i * 2);
+
+  /* batches of any size give the same run as stepping, and resume */
+  for (i = 0; i < 2000; i++) {
+    tree.key = rand() % (MAX_NODES * 2 + 1);
+    hi.key = tree.key + rand() % (MAX_NODES / 2);
+    max = 1 + rand() % 64;
+    avl_get_greater_equal(&tree.tree, &search);
+    expect = avl_get_greater_equal(&tree.tree, &check);
+    total = 0;
+    do {
+      n = avl_get_range(&search, i & 1 ? &hi.node : NULL, out, max);
+      for (j = 0; j < n; j++) {
+        assert(out[j] == expect);
+        expect = avl_get_next(&check);
+      }
+      total += n;
+    } while (n == max);
+    if (i & 1) {
+      assert(total == (hi.key < MAX_NODES * 2 ? hi.key / 2 + 1 : MAX_NODES) -
+             (tree.key + 1) / 2);
+      assert(expect == NULL || ((mynode*)expect)->key > hi.key);
+    } else
+      assert(expect == NULL && total == MAX_NODES - (tree.key + 1) / 2);
+    /* a bounded run leaves the cursor on the first element past hi */
+    n = avl_get_range(&search, NULL, out, 1);
+    assert(n == (expect != NULL) && (n == 0 || out[0] == expect));
+  }
+
+  /* a long run needs far fewer comparisons than elements */
+  avl_get_first(&tree.tree, &search);
+  hi.key = MAX_NODES * 2 - 1;
+  Compares = 0;
+  total = 0;
+  while ((n = avl_get_range(&search, &hi.node, out, 64)) > 0)
+    total += n;
+  assert(total == MAX_NODES);
+  assert(Compares < MAX_NODES / 4);
+
+  FreeTree(tree.tree.root);
+  assert(FreeNodeCount() == MAX_NODES);
+  printf("Test passed\n");
+}
+
+void CursorTest(void) {
+  static char present[MAX_NODES];
+  struct avlsearch search, other;
+  struct avlbind *cur, *deleted;
+  unsigned i, key, last, writes;
+  int dir;
+  mytree tree;
+
+  printf("Stepping a cursor while the tree changes\n");
+  memset(&tree, 0, sizeof(tree));
+  memset(present, 0, sizeof(present));
+  tree.tree.compare_key_tree = compare;
+  tree.tree.compare_nodes = counted_compare_nodes;
+  for (i = 0; i < MAX_NODES; i += 2) {
+    insert_value(&tree, i);
+    present[i] = 1;
+  }
+
+  /* scans both ways, with writes between the steps */
+  for (dir = 1; dir >= -1; dir -= 2) {
+    cur = dir > 0 ? avl_get_first(&tree.tree, &search) :
+        avl_get_last(&tree.tree, &search);
+    writes = 0;
+    Compares = 0;
+    while (cur) {
+      last = ((mynode*)cur)->key;
+      assert(present[last]);
+      for (i = rand() % 3; i; i--) {
+        tree.key = rand() % MAX_NODES;
+        if (tree.key == last)
+          continue;
+        if (present[tree.key])
+          FreeNode((mynode*)avl_delete(&tree.tree));
+        else
+          insert_value(&tree, tree.key);
+        present[tree.key] ^= 1;
+        writes++;
+      }
+
+      /* sometimes step on from an element just deleted, through a
+         cursor placed afresh or the one the writes left stale */
+      deleted = NULL;
+      if (rand() % 8 == 0) {
+        if (rand() % 2) {
+          tree.key = last;
+          avl_get_greater_equal(&tree.tree, &search);
+        }
+        deleted = avl_delete_current(&tree.tree, &search);
+        assert(deleted == cur);
+        present[last] = 0;
+        writes++;
+      }
+      cur = dir > 0 ? avl_get_next(&search) : avl_get_prev(&search);
+      if (deleted)
+        FreeNode((mynode*)deleted);
+
+      key = last + dir;
+      while (key < MAX_NODES && !present[key])
+        key += dir;
+      if (key < MAX_NODES)
+        assert(cur && ((mynode*)cur)->key == key);
+      else
+        assert(cur == NULL);
+    }
+    /* each write costs the scan one search down the tree */
+    assert(writes > 0 && Compares <= writes * 2 * AVL_MAX_HEIGHT / 3);
+  }
+
+  /* a stale cursor on an element deleted since deletes nothing */
+  cur = avl_get_first(&tree.tree, &search);
+  tree.key = ((mynode*)cur)->key;
+  deleted = avl_delete(&tree.tree);
+  assert(deleted == cur && avl_delete_current(&tree.tree, &search) == NULL);
+  FreeNode((mynode*)deleted);
+  /* and one on an element still there deletes that element */
+  cur = avl_get_first(&tree.tree, &search);
+  key = ((mynode*)cur)->key;
+  delete_value(&tree, ((mynode*)avl_get_last(&tree.tree, &other))->key);
+  assert(avl_delete_current(&tree.tree, &search) == cur);
+  FreeNode((mynode*)cur);
+  cur = avl_get_first(&tree.tree, &search);
+  assert(cur && ((mynode*)cur)->key > key);
+
+  FreeTree(tree.tree.root);
+  assert(FreeNodeCount() == MAX_NODES);
+  printf("Test passed\n");
+}
+
+void FrozenTest(void) {
+  struct avlsearch search;
+  struct avlbind *cur;
+  unsigned i, n;
+  size_t k;
+  mytree tree;
+
+  printf("Searching a frozen tree\n");
+  for (n = 0; n <= MAX_NODES; n += n < 20 ? 1 : 101) {
+    memset(&tree, 0, sizeof(tree));
+    tree.tree.compare_key_tree = compare;
+    for (i = 0; i < n; i++)
+      insert_value(&tree, i * 2 + 1);
+    assert(avl_freeze(&tree.tree) == 0);
+
+    /* in order both ways, as the cursor steps */
+    k = avl_frozen_first(&tree.tree);
+    for (cur = avl_get_first(&tree.tree, &search); cur; cur = avl_get_next(&search)) {
+      assert(avl_frozen_node(&tree.tree, k) == cur);
+      k = avl_frozen_next(&tree.tree, k);
+    }
+    assert(k == 0);
+    k = avl_frozen_last(&tree.tree);
+    for (cur = avl_get_last(&tree.tree, &search); cur; cur = avl_get_prev(&search)) {
+      assert(avl_frozen_node(&tree.tree, k) == cur);
+      k = avl_frozen_prev(&tree.tree, k);
+    }
+    assert(k == 0);
+
+    /* every key, present and absent, finds what the tree finds */
+    for (tree.key = 0; tree.key <= n * 2 + 1; tree.key++) {
+      cur = avl_get_greater_equal(&tree.tree, &search);
+      assert(avl_frozen_node(&tree.tree, avl_frozen_greater_equal(&tree.tree)) == cur);
+      cur = avl_get_greater(&tree.tree, &search);
+      assert(avl_frozen_node(&tree.tree, avl_frozen_greater(&tree.tree)) == cur);
+      cur = avl_get_less_equal(&tree.tree, &search);
+      assert(avl_frozen_node(&tree.tree, avl_frozen_less_equal(&tree.tree)) == cur);
+      cur = avl_get_less(&tree.tree, &search);
+      assert(avl_frozen_node(&tree.tree, avl_frozen_less(&tree.tree)) == cur);
+      cur = avl_find(&tree.tree);
+      assert(tree.key & 1 && tree.key < n * 2 ? cur && ((mynode*)cur)->key == tree.key : !cur);
+    }
+
+    /* thawed, it takes changes again */
+    avl_thaw(&tree.tree);
+    assert(tree.tree.frozen == NULL);
+    if (n < MAX_NODES) {
+      insert_value(&tree, 0);
+      assert(IsAVL((mynode*)tree.tree.root) == (int)n + 1);
+    }
+    FreeTree(tree.tree.root);
+    assert(FreeNodeCount() == MAX_NODES);
+  }
+  printf("Test passed\n");
+}
+
+/****************************************************************
+ CheckRelaxed
+ Checks a relaxed tree: order, exact height differences, and
+ flags on every node out of balance and on all its ancestors.
+ returns the height of the subtree
+ ****************************************************************/
+static int CheckRelaxed(struct avlbind *node, int depth, int *dirty) {
+  int lh, rh, ldirty = 0, rdirty = 0, balance;
+  if (node == NULL) {
+    *dirty = 0;
+    return 0;
+  }
+  assert(depth < AVL_MAX_HEIGHT);
+  if (node->left)
+    assert(((mynode*)node->left)->key < ((mynode*)node)->key);
+  if (node->right)
+    assert(((mynode*)node->right)->key > ((mynode*)node)->key);
+  lh = CheckRelaxed(node->left, depth + 1, &ldirty);
+  rh = CheckRelaxed(node->right, depth + 1, &rdirty);
+  *dirty = node->balance >= AVL_DIRTY / 2;
+  balance = *dirty ? node->balance - AVL_DIRTY : node->balance;
+  assert(balance == rh - lh);
+  if (ldirty || rdirty || balance > 1 || balance < -1)
+    assert(*dirty);
+  return max(lh, rh) + 1;
+}
+
+void RelaxedTest(void) {
+  struct avlsearch search, check;
+  struct avlbind *cur;
+  unsigned long sum;
+  unsigned i, round, budget;
+  int dirty;
+  mynode *node;
+  mytree tree;
+
+  printf("Deferring rebalancing in relaxed mode\n");
+  memset(&tree, 0, sizeof(tree));
+  tree.tree.compare_key_tree = compare;
+  tree.tree.update_node = update_sum;
+  tree.tree.relaxed = 1;
+  for (round = 0; round < 200; round++) {
+    /* an ascending burst, then random churn */
+    unsigned start = rand() % 4096;
+    for (i = 0; i < 100 && tree.tree.num_nodes < 900; i++) {
+      node = GetNode();
+      tree.key = node->key = start + i;
+      if (avl_insert(&tree.tree, &node->node) != &node->node)
+        FreeNode(node);
+      CheckRelaxed(tree.tree.root, 0, &dirty);
+    }
+    for (i = 0; i < 200; i++) {
+      tree.key = rand() % 4196;
+      if (rand() & 1) {
+        node = GetNode();
+        node->key = tree.key;
+        if (tree.tree.num_nodes >= 900 ||
+            avl_insert(&tree.tree, &node->node) != &node->node)
+          FreeNode(node);
+      } else if ((node = (mynode*)avl_delete(&tree.tree)) != NULL)
+        FreeNode(node);
+      CheckRelaxed(tree.tree.root, 0, &dirty);
+      assert(CheckSums(tree.tree.root, &sum) == tree.tree.num_nodes);
+    }
+    /* lookups find every node while out of balance */
+    for (cur = avl_get_first(&tree.tree, &search); cur;
+         cur = avl_get_next(&search)) {
+      tree.key = ((mynode*)cur)->key;
+      assert(avl_get_greater_equal(&tree.tree, &check) == cur);
+    }
+
+    /* repair in small pieces, or all at once */
+    budget = round % 3 ? rand() % 20 + 1 : 0;
+    while (avl_rebalance_step(&tree.tree, budget)) {
+      CheckRelaxed(tree.tree.root, 0, &dirty);
+      assert(CheckSums(tree.tree.root, &sum) == tree.tree.num_nodes);
+    }
+    assert(IsAVL((mynode*)tree.tree.root) == tree.tree.num_nodes);
+    assert(CheckSums(tree.tree.root, &sum) == tree.tree.num_nodes);
+  }
+  FreeTree(tree.tree.root);
+  assert(FreeNodeCount() == MAX_NODES);
+  printf("Test passed\n");
+}
+
+static mynode Arena[2][MAX_NODES];
+static unsigned Moved;
+
+static void moved_node(struct avltree *tree, struct avlbind *from,
+                       struct avlbind *to, void *context) {
+  assert(((mynode*)from)->key == ((mynode*)to)->key);
+  assert(((mynode*)from)->sum == ((mynode*)to)->sum);
+  if ((mynode*)from >= Nodes && (mynode*)from < Nodes + MAX_NODES)
+    FreeNode((mynode*)from);
+  Moved++;
+}
+
+void RelayoutTest(void) {
+  struct avlsearch search;
+  struct avlbind *cur;
+  unsigned long sum;
+  unsigned i, n, pass;
+  mytree tree;
+
+  printf("Moving trees into van Emde Boas order\n");
+  for (n = 1; n <= MAX_NODES; n = n * 3 + 1) {
+    memset(&tree, 0, sizeof(tree));
+    tree.tree.compare_key_tree = compare;
+    tree.tree.update_node = update_sum;
+    for (i = 0; i < n; i++)
+      insert_value(&tree, i * 3 % n);
+    for (pass = 0; pass < 2; pass++) {
+      Moved = 0;
+      avl_relayout(&tree.tree, Arena[pass], sizeof(mynode), moved_node, NULL);
+      assert(Moved == n);
+      assert((mynode*)tree.tree.root == Arena[pass]);
+      assert(IsAVL((mynode*)tree.tree.root) == n);
+      assert(CheckSums(tree.tree.root, &sum) == n);
+      for (cur = avl_get_first(&tree.tree, &search), i = 0; cur;
+           cur = avl_get_next(&search), i++) {
+        mynode *node = (mynode*)cur;
+        assert(node->key == i);
+        assert(node >= Arena[pass] && node < Arena[pass] + n);
+      }
+      assert(i == n);
+      if (n >= 2)
+        assert((mynode*)tree.tree.root->left == Arena[pass] + 1);
+    }
+    assert(FreeNodeCount() == MAX_NODES);
+  }
+  printf("Test passed\n");
+}
+
+static size_t get_key(struct avltree *tree, unsigned char *buf, size_t max) {
+  unsigned key = ((mytree*)tree)->key;
+  assert(max >= sizeof(key));
+  memcpy(buf, &key, sizeof(key));
+  return sizeof(key);
+}
+
+void TraceTest(void) {
+  static const int expect[] = { AVL_OP_INSERT, AVL_OP_INSERT, AVL_OP_INSERT,
+      AVL_OP_FIRST, AVL_OP_NEXT, AVL_OP_NEXT, AVL_OP_NEXT, AVL_OP_GREATER_EQUAL,
+      AVL_OP_SEEK_LESS_EQUAL, AVL_OP_DELETE_CURRENT, AVL_OP_DELETE,
+      AVL_OP_LAST, AVL_OP_PREV };
+  static const unsigned keys[] = { 20, 10, 30, 0, 0, 0, 0, 15, 25, 0, 10, 0, 0 };
+  unsigned char key[AVL_TRACE_MAX_KEY];
+  struct avlsearch search;
+  struct avltrace trace;
+  struct avlbind *cur;
+  unsigned i, k;
+  mytree tree;
+  size_t len;
+  FILE *file;
+  int op;
+
+  printf("Recording a trace\n");
+  file = tmpfile();
+  assert(file);
+  memset(&tree, 0, sizeof(tree));
+  tree.tree.compare_key_tree = compare;
+  assert(avl_trace_begin(&trace, &tree.tree, file, get_key) == 0);
+  insert_value(&tree, 20);
+  insert_value(&tree, 10);
+  insert_value(&tree, 30);
+  for (cur = avl_get_first(&tree.tree, &search); cur; cur = avl_get_next(&search))
+    ;
+  tree.key = 15;
+  cur = avl_get_greater_equal(&tree.tree, &search);
+  assert(((mynode*)cur)->key == 20);
+  tree.key = 25;
+  cur = avl_seek(&tree.tree, &search, -1);
+  assert(((mynode*)cur)->key == 20);
+  /* the unlink under delete_current must not record a second DELETE */
+  FreeNode((mynode*)avl_delete_current(&tree.tree, &search));
+  delete_value(&tree, 10);
+  avl_get_last(&tree.tree, &search);
+  avl_get_prev(&search);
+  assert(avl_trace_end(&trace, &tree.tree) == 0);
+  assert(trace.records == sizeof(expect) / sizeof(expect[0]));
+
+  /* hooks are off again */
+  insert_value(&tree, 40);
+  assert(trace.records == sizeof(expect) / sizeof(expect[0]));
+
+  rewind(file);
+  assert(avl_trace_check(file) == 0);
+  for (i = 0; avl_trace_read(file, &op, key, &len) == 1; i++) {
+    assert(i < trace.records);
+    assert(op == expect[i]);
+    if (avl_trace_has_key(op)) {
+      assert(len == sizeof(k));
+      memcpy(&k, key, sizeof(k));
+      assert(k == keys[i]);
+    } else
+      assert(len == 0);
+  }
+  assert(i == trace.records);
+
+  /* a truncated record reads as damage, not as the end */
+  fclose(file);
+  file = tmpfile();
+  assert(file);
+  fputs(AVL_TRACE_MAGIC, file);
+  fputc(AVL_OP_INSERT, file);
+  fputc(4, file);
+  fputc(0, file);
+  rewind(file);
+  assert(avl_trace_check(file) == 0);
+  assert(avl_trace_read(file, &op, key, &len) == -1);
+  fclose(file);
+
+  FreeTree(tree.tree.root);
+  assert(FreeNodeCount() == MAX_NODES);
+  printf("Test passed\n");
+}
+
+/* a poor hash on purpose, so that probe runs collide and wrap */
+static unsigned long hash_key(struct avltree *tree) {
+  return ((mytree*)tree)->key / 3;
+}
+static unsigned long hash_node(struct avltree *tree, struct avlbind *node) {
+  return ((mynode*)node)->key / 3;
+}
+
+static void CheckFind(mytree *tree, unsigned range) {
+  struct avlsearch search;
+  struct avlbind *found, *expect;
+  unsigned key;
+
+  for (key = 0; key < range; key++) {
+    tree->key = key;
+    expect = avl_get_greater_equal(&tree->tree, &search);
+    if (expect && ((mynode*)expect)->key != key)
+      expect = NULL;
+    found = avl_find(&tree->tree);
+    assert(found == expect);
+  }
+  assert(tree->tree.hash == NULL || tree->tree.hash->count == tree->tree.num_nodes);
+}
+
+void HashTest(void) {
+  static struct avlbind *Array[MAX_NODES];
+  struct avlsearch search;
+  struct avlbind *cur;
+  unsigned i, range = MAX_NODES * 2;
+  mytree tree;
+
+  printf("Finding exact matches through the hash side index\n");
+  memset(&tree, 0, sizeof(tree));
+  tree.tree.compare_key_tree = compare;
+  tree.tree.compare_nodes = compare_nodes;
+  tree.tree.hash_key = hash_key;
+  tree.tree.hash_node = hash_node;
+  for (i = 0; i < 100; i++)
+    insert_value(&tree, i * 5);
+  CheckFind(&tree, range);
+  assert(avl_hash_memory(&tree.tree) == 0);
+  assert(avl_hash_enable(&tree.tree) == 0);
+  assert(avl_hash_memory(&tree.tree) > 0);
+  CheckFind(&tree, range);
+
+  /* growth on insert, and both kinds of delete */
+  for (i = 0; i < 40000; i++) {
+    tree.key = rand() % range;
+    if (rand() % 3 == 0) {
+      cur = avl_get_greater_equal(&tree.tree, &search);
+      if (cur)
+        FreeNode((mynode*)avl_delete_current(&tree.tree, &search));
+    } else if (rand() & 1) {
+      cur = avl_delete(&tree.tree);
+      if (cur)
+        FreeNode((mynode*)cur);
+    } else if (tree.tree.num_nodes < MAX_NODES) {
+      mynode *node = GetNode();
+      node->key = tree.key;
+      if (avl_insert(&tree.tree, &node->node) != &node->node)
+        FreeNode(node);
+    }
+    if (i % 4000 == 0)
+      CheckFind(&tree, range);
+  }
+  CheckFind(&tree, range);
+
+  /* the bulk operations rebuild it */
+  avl_relayout(&tree.tree, Arena[0], sizeof(mynode), moved_node, NULL);
+  CheckFind(&tree, range);
+  avl_hash_disable(&tree.tree);
+  assert(tree.tree.hash == NULL);
+  CheckFind(&tree, range);
+
+  memset(&tree, 0, sizeof(tree));
+  tree.tree.compare_key_tree = compare;
+  tree.tree.compare_nodes = compare_nodes;
+  tree.tree.hash_key = hash_key;
+  tree.tree.hash_node = hash_node;
+  assert(avl_hash_enable(&tree.tree) == 0);
+  for (i = 0; i < MAX_NODES; i++) {
+    mynode *node = GetNode();
+    node->key = rand() % range;
+    Array[i] = &node->node;
+  }
+  i = avl_build_parallel(&tree.tree, Array, MAX_NODES, 4);
+  for (; i < MAX_NODES; i++)
+    FreeNode((mynode*)Array[i]);
+  CheckFind(&tree, range);
+  avl_hash_disable(&tree.tree);
+  FreeTree(tree.tree.root);
+  assert(FreeNodeCount() == MAX_NODES);
+  printf("Test passed\n");
+}
+
+static int SameShape(struct avlbind *a, struct avlbind *b) {
+  if (a == NULL || b == NULL)
+    return a == b;
+  return ((mynode*)a)->key == ((mynode*)b)->key && a->balance == b->balance &&
+      SameShape(a->left, b->left) && SameShape(a->right, b->right);
+}
+
+void CacheTest(void) {
+  struct avlsearch search;
+  struct avlbind *cur;
+  unsigned long finds = 0;
+  unsigned i, pass, range = MAX_NODES * 2;
+  mytree tree;
+
+  printf("Finding hot keys through the front cache\n");
+  for (pass = 0; pass < 2; pass++) {
+    memset(&tree, 0, sizeof(tree));
+    tree.tree.compare_key_tree = compare;
+    tree.tree.hash_key = hash_key;
+    tree.tree.hash_node = hash_node;
+    /* with and without the side index behind it */
+    if (pass)
+      assert(avl_hash_enable(&tree.tree) == 0);
+    assert(avl_cache_enable(&tree.tree, 30) == 0);
+    assert(tree.tree.cache->sets * AVL_CACHE_WAYS >= 30);
+    finds = 0;
+    for (i = 0; i < 40000; i++) {
+      /* mostly a few hot keys, which also get deleted now and then */
+      tree.key = rand() % 4 ? rand() % 16 : rand() % range;
+      switch (rand() % 8) {
+      case 0:
+        cur = avl_get_greater_equal(&tree.tree, &search);
+        if (cur)
+          FreeNode((mynode*)avl_delete_current(&tree.tree, &search));
+        break;
+      case 1:
+        cur = avl_delete(&tree.tree);
+        if (cur)
+          FreeNode((mynode*)cur);
+        break;
+      case 2:
+      case 3:
+        if (tree.tree.num_nodes < MAX_NODES) {
+          mynode *node = GetNode();
+          node->key = tree.key;
+          if (avl_insert(&tree.tree, &node->node) != &node->node)
+            FreeNode(node);
+        }
+        break;
+      default:
+        cur = avl_get_greater_equal(&tree.tree, &search);
+        if (cur && ((mynode*)cur)->key != tree.key)
+          cur = NULL;
+        assert(avl_find(&tree.tree) == cur);
+        finds++;
+        break;
+      }
+    }
+    assert(tree.tree.cache->hits + tree.tree.cache->misses == finds);
+    assert(tree.tree.cache->hits > finds / 8);
+    avl_cache_disable(&tree.tree);
+    avl_hash_disable(&tree.tree);
+    assert(tree.tree.cache == NULL);
+    FreeTree(tree.tree.root);
+    assert(FreeNodeCount() == MAX_NODES);
+  }
+  printf("Test passed\n");
+}
+
+static unsigned Duplicates;
+
+/* keeps the node from src for odd keys, frees the other */
+static struct avlbind *keep_odd_src(struct avltree *tree, struct avlbind *dst,
+                                    struct avlbind *src) {
+  assert(((mynode*)dst)->key == ((mynode*)src)->key);
+  assert(((mynode*)dst)->count == 0 && ((mynode*)src)->count == 1);
+  Duplicates++;
+  if (((mynode*)src)->key & 1) {
+    FreeNode((mynode*)dst);
+    return src;
+  }
+  FreeNode((mynode*)src);
+  return dst;
+}
+
+static void MakeMergeTree(mytree *tree, unsigned n, unsigned base,
+                          unsigned range, unsigned side) {
+  unsigned i;
+  memset(tree, 0, sizeof(*tree));
+  tree->tree.compare_key_tree = compare;
+  tree->tree.compare_nodes = compare_nodes;
+  tree->tree.update_node = update_sum;
+  tree->tree.hash_key = hash_key;
+  tree->tree.hash_node = hash_node;
+  for (i = 0; i < n; i++) {
+    mynode *node = GetNode();
+    tree->key = node->key = base + rand() % range;
+    node->count = side;
+    if (avl_insert(&tree->tree, &node->node) != &node->node)
+      FreeNode(node);
+  }
+}
+
+/* keeps the node in dst, frees the one from src */
+static struct avlbind *keep_dst(struct avltree *tree, struct avlbind *dst,
+                                struct avlbind *src) {
+  FreeNode((mynode*)src);
+  return dst;
+}
+
+void MergeTest(void) {
+  static const unsigned sizes[] = { 0, 1, 2, 3, 10, 60, 300, 700 };
+  static mynode *Array[MAX_NODES];
+  struct avlsearch search;
+  struct avlbind *cur;
+  unsigned long sum;
+  unsigned a, b, i, range, expect, dups, pass;
+  mytree dst, src;
+
+  printf("Merging one tree into another\n");
+  for (pass = 0; pass < 3; pass++)
+  for (a = 0; a < 8; a++)
+  for (b = 0; b < 8; b++) {
+    if (sizes[a] + sizes[b] > MAX_NODES)
+      continue;
+    /* overlapping, interleaved, or all of src above dst */
+    range = pass == 0 ? sizes[a] + sizes[b] + 1 : 4 * (sizes[a] + sizes[b]) + 1;
+    MakeMergeTree(&dst, sizes[a], 0, range, 0);
+    MakeMergeTree(&src, sizes[b], pass == 2 ? range : 0, range, 1);
+    if (b & 1)
+      assert(avl_hash_enable(&dst.tree) == 0);
+    expect = dst.tree.num_nodes + src.tree.num_nodes;
+    Duplicates = 0;
+    dups = avl_merge(&dst.tree, &src.tree, keep_odd_src);
+    assert(dups == Duplicates);
+    assert(src.tree.root == NULL && src.tree.num_nodes == 0);
+    assert(dst.tree.num_nodes == expect - dups);
+    assert(IsAVL((mynode*)dst.tree.root) == dst.tree.num_nodes);
+    assert(CheckSums(dst.tree.root, &sum) == dst.tree.num_nodes);
+    for (cur = avl_get_first(&dst.tree, &search), i = 0; cur;
+         cur = avl_get_next(&search), i++) {
+      mynode *node = (mynode*)cur;
+      dst.key = node->key;
+      assert(avl_find(&dst.tree) == cur);
+    }
+    assert(i == dst.tree.num_nodes);
+    avl_hash_disable(&dst.tree);
+    FreeTree(dst.tree.root);
+    assert(FreeNodeCount() == MAX_NODES);
+  }
+
+  /* without a callback, dst's node stays and src's is dropped */
+  MakeMergeTree(&dst, 200, 0, 300, 0);
+  MakeMergeTree(&src, 200, 0, 300, 1);
+  for (cur = avl_get_first(&src.tree, &search), i = 0; cur;
+       cur = avl_get_next(&search))
+    Array[i++] = (mynode*)cur;
+  expect = dst.tree.num_nodes + src.tree.num_nodes;
+  dups = avl_merge(&dst.tree, &src.tree, NULL);
+  assert(dst.tree.num_nodes == expect - dups);
+  assert(IsAVL((mynode*)dst.tree.root) == dst.tree.num_nodes);
+  while (i--) {
+    dst.key = Array[i]->key;
+    cur = avl_find(&dst.tree);
+    assert(cur);
+    if (cur != &Array[i]->node) {
+      assert(((mynode*)cur)->count == 0);
+      FreeNode(Array[i]);
+      dups--;
+    }
+  }
+  assert(dups == 0);
+  FreeTree(dst.tree.root);
+  assert(FreeNodeCount() == MAX_NODES);
+  printf("Test passed\n");
+}
+
+void BloomTest(void) {
+  struct avlsearch search;
+  struct avlbind *cur;
+  unsigned i, range = MAX_NODES * 6;
+  unsigned long passed;
+  mytree tree, other;
+
+  printf("Turning away absent keys with a Bloom filter\n");
+  memset(&tree, 0, sizeof(tree));
+  tree.tree.compare_key_tree = compare;
+  tree.tree.compare_nodes = compare_nodes;
+  tree.tree.hash_key = hash_key;
+  tree.tree.hash_node = hash_node;
+  /* multiples of 6, so the absent odd multiples of 3 hash apart */
+  for (i = 0; i < MAX_NODES / 2; i++)
+    insert_value(&tree, i * 6);
+  assert(avl_bloom_memory(&tree.tree) == 0);
+  assert(avl_bloom_enable(&tree.tree, 10) == 0);
+  assert(avl_bloom_memory(&tree.tree) > 0);
+  CheckFind(&tree, range);
+
+  /* at 10 bits a key, about 1 in 100 of the absent keys gets by */
+  passed = tree.tree.bloom->passed;
+  for (i = 0; i < MAX_NODES / 2; i++) {
+    tree.key = i * 6 + 3;
+    assert(avl_find(&tree.tree) == NULL);
+  }
+  assert(tree.tree.bloom->passed - passed < MAX_NODES / 2 / 20);
+
+  /* no false negatives through growth and delete churn */
+  for (i = 0; i < 40000; i++) {
+    tree.key = rand() % range;
+    if (rand() % 3 == 0) {
+      cur = avl_get_greater_equal(&tree.tree, &search);
+      if (cur)
+        FreeNode((mynode*)avl_delete_current(&tree.tree, &search));
+    } else if (rand() & 1) {
+      cur = avl_delete(&tree.tree);
+      if (cur)
+        FreeNode((mynode*)cur);
+    } else if (tree.tree.num_nodes < MAX_NODES - 64) {
+      mynode *node = GetNode();
+      node->key = tree.key;
+      if (avl_insert(&tree.tree, &node->node) != &node->node)
+        FreeNode(node);
+    }
+    if (i % 4000 == 0)
+      CheckFind(&tree, range);
+  }
+  CheckFind(&tree, range);
+
+  /* merged in nodes are let through */
+  MakeMergeTree(&other, 64, range, 1000, 0);
+  assert(avl_bloom_enable(&other.tree, 4) == 0);
+  avl_merge(&tree.tree, &other.tree, NULL);
+  CheckFind(&tree, range + 1000);
+  CheckFind(&other, range + 1000);
+  avl_bloom_disable(&other.tree);
+
+  avl_bloom_disable(&tree.tree);
+  assert(tree.tree.bloom == NULL);
+  CheckFind(&tree, range + 1000);
+  FreeTree(tree.tree.root);
+  assert(FreeNodeCount() == MAX_NODES);
+
+  /* a merge that only fits the filter once the duplicates are out */
+  memset(&tree, 0, sizeof(tree));
+  memset(&other, 0, sizeof(other));
+  tree.tree.compare_key_tree = other.tree.compare_key_tree = compare;
+  tree.tree.compare_nodes = other.tree.compare_nodes = compare_nodes;
+  tree.tree.hash_key = other.tree.hash_key = hash_key;
+  tree.tree.hash_node = other.tree.hash_node = hash_node;
+  for (i = 0; i < 200; i++)
+    insert_value(&tree, i);
+  assert(avl_bloom_enable(&tree.tree, 10) == 0);
+  for (i = 0; i < 300; i++)
+    insert_value(&other, i);
+  assert(tree.tree.num_nodes + other.tree.num_nodes > tree.tree.bloom->capacity);
+  assert(avl_merge(&tree.tree, &other.tree, keep_dst) == 200);
+  assert(tree.tree.num_nodes <= tree.tree.bloom->capacity);
+  CheckFind(&tree, 400);
+  avl_bloom_disable(&tree.tree);
+  FreeTree(tree.tree.root);
+  assert(FreeNodeCount() == MAX_NODES);
+  printf("Test passed\n");
+}
+
+void BufferTest(void) {
+  static mynode *present[MAX_NODES / 2];
+  struct avlsearch search;
+  struct avlbind *cur;
+  unsigned long sum;
+  unsigned i, key, count, round;
+  mynode *node;
+  mytree tree;
+
+  printf("Buffering inserts in front of the tree\n");
+  for (round = 0; round < 2; round++) {
+    memset(&tree, 0, sizeof(tree));
+    memset(present, 0, sizeof(present));
+    tree.tree.compare_key_tree = compare;
+    tree.tree.compare_nodes = compare_nodes;
+    tree.tree.update_node = update_sum;
+    tree.tree.hash_key = hash_key;
+    tree.tree.hash_node = hash_node;
+    assert(avl_buffer_enable(&tree.tree, 16) == 0);
+    if (round) {
+      assert(avl_hash_enable(&tree.tree) == 0);
+      assert(avl_bloom_enable(&tree.tree, 10) == 0);
+    }
+
+    /* finds and deletes see buffered nodes without a flush */
+    count = 0;
+    for (i = 0; i < 20000; i++) {
+      tree.key = key = rand() % (MAX_NODES / 2);
+      switch (rand() % 4) {
+      case 0:
+        cur = avl_find(&tree.tree);
+        assert(cur == (present[key] ? &present[key]->node : NULL));
+        break;
+      case 1:
+        cur = avl_delete(&tree.tree);
+        assert(cur == (present[key] ? &present[key]->node : NULL));
+        if (cur) {
+          FreeNode((mynode*)cur);
+          present[key] = NULL;
+          count--;
+        }
+        break;
+      default:
+        node = GetNode();
+        node->key = key;
+        cur = avl_insert(&tree.tree, &node->node);
+        if (present[key]) {
+          assert(cur == &present[key]->node);
+          FreeNode(node);
+        } else {
+          assert(cur == &node->node);
+          present[key] = node;
+          count++;
+        }
+      }
+      assert(tree.tree.num_nodes == count && tree.tree.buffer->count < 16);
+
+      /* a scan flushes, and finds every node in order */
+      if (i % 1000 == 0) {
+        key = 0;
+        for (cur = avl_get_first(&tree.tree, &search); cur; cur = avl_get_next(&search)) {
+          while (present[key] == NULL)
+            key++;
+          assert(cur == &present[key++]->node);
+        }
+        assert(tree.tree.buffer->count == 0);
+        assert(IsAVL((mynode*)tree.tree.root) == (int)count);
+        assert(CheckSums(tree.tree.root, &sum) == count);
+      }
+    }
+
+    /* a cursor already out steps onto a node inserted after it */
+    cur = avl_get_first(&tree.tree, &search);
+    for (key = ((mynode*)cur)->key + 1; present[key]; key++)
+      ;
+    node = GetNode();
+    tree.key = node->key = key;
+    assert(avl_insert(&tree.tree, &node->node) == &node->node);
+    assert(tree.tree.buffer->count == 1);
+    for (cur = avl_get_next(&search); ((mynode*)cur)->key < key; cur = avl_get_next(&search))
+      ;
+    assert(cur == &node->node);
+
+    /* disabling it flushes the rest into the tree */
+    while (present[++key])
+      ;
+    node = GetNode();
+    tree.key = node->key = key;
+    assert(avl_insert(&tree.tree, &node->node) == &node->node);
+    assert(tree.tree.buffer->count == 1);
+    avl_buffer_disable(&tree.tree);
+    assert(tree.tree.buffer == NULL && IsAVL((mynode*)tree.tree.root) == (int)count + 2);
+    assert(CheckSums(tree.tree.root, &sum) == count + 2);
+    avl_hash_disable(&tree.tree);
+    avl_bloom_disable(&tree.tree);
+    FreeTree(tree.tree.root);
+  }
+  assert(FreeNodeCount() == MAX_NODES);
+  printf("Test passed\n");
+}
+
+static unsigned KMergeDups;
+static struct avlbind *count_dup(struct avltree *tree, struct avlbind *kept,
+                                 struct avlbind *dup) {
+  assert(((mynode*)kept)->key == ((mynode*)dup)->key);
+  KMergeDups++;
+  return ((mynode*)dup)->count < ((mynode*)kept)->count ? dup : kept;
+}
+
+static int compare_sources(const void *lhs, const void *rhs) {
+  const mynode *l = *(const mynode *const *)lhs, *r = *(const mynode *const *)rhs;
+  if (l->key != r->key)
+    return l->key < r->key ? -1 : 1;
+  return l->count < r->count ? -1 : l->count > r->count;
+}
+
+void KMergeTest(void) {
+  static mynode *All[MAX_NODES];
+  struct avltree *trees[7];
+  struct avlkmerge merge;
+  struct avlbind *cur;
+  mytree bucket[7];
+  mynode probe;
+  unsigned k, i, j, n, unique, start;
+
+  printf("Merging the streams of several trees\n");
+  for (k = 1; k <= 7; k++) {
+    /* keys overlap across the trees; count holds the tree */
+    n = 0;
+    for (i = 0; i < k; i++) {
+      memset(&bucket[i], 0, sizeof(bucket[i]));
+      bucket[i].tree.compare_key_tree = compare;
+      bucket[i].tree.compare_nodes = compare_nodes;
+      trees[i] = &bucket[i].tree;
+      for (j = 0; j < (i == 2 ? 0 : MAX_NODES / 8); j++) {
+        mynode *node = GetNode();
+        bucket[i].key = node->key = rand() % (MAX_NODES / 2);
+        node->count = i;
+        if (avl_insert(&bucket[i].tree, &node->node) != &node->node)
+          FreeNode(node);
+        else
+          All[n++] = node;
+      }
+    }
+    qsort(All, n, sizeof(All[0]), compare_sources);
+
+    /* all of them in order, equal keys by tree */
+    assert(avl_kmerge_init(&merge, trees, k, NULL) == 0);
+    i = 0;
+    for (cur = avl_kmerge_first(&merge); cur; cur = avl_kmerge_next(&merge))
+      assert(i < n && cur == &All[i++]->node);
+    assert(i == n);
+
+    /* from any key on */
+    for (j = 0; j < 50; j++) {
+      probe.key = rand() % (MAX_NODES / 2 + 10);
+      for (start = 0; start < n && All[start]->key < probe.key; start++)
+        ;
+      i = start;
+      for (cur = avl_kmerge_seek(&merge, &probe.node); cur && i < start + 40;
+           cur = avl_kmerge_next(&merge))
+        assert(cur == &All[i++]->node);
+      assert(cur != NULL || i == n);
+    }
+    avl_kmerge_free(&merge);
+
+    /* one of each key, the callback choosing the first tree's */
+    assert(avl_kmerge_init(&merge, trees, k, count_dup) == 0);
+    KMergeDups = 0;
+    i = unique = 0;
+    for (cur = avl_kmerge_first(&merge); cur; cur = avl_kmerge_next(&merge)) {
+      assert(cur == &All[i]->node);
+      unique++;
+      for (i++; i < n && All[i]->key == ((mynode*)cur)->key; i++)
+        ;
+    }
+    assert(i == n && unique + KMergeDups == n);
+    avl_kmerge_free(&merge);
+
+    for (i = 0; i < k; i++)
+      FreeTree(bucket[i].tree.root);
+    assert(FreeNodeCount() == MAX_NODES);
+  }
+  printf("Test passed\n");
+}
+
+static struct avltree *DiffTrees[2];
+static char DiffOnly[MAX_NODES];	/* 1 for a key only in a, 2 only in b */
+static int DiffLast;
+
+static void diff_check(struct avltree *tree, struct avlbind *node, int side) {
+  unsigned key = ((mynode*)node)->key;
+  assert(tree == DiffTrees[side - 1] && DiffOnly[key] == side);
+  assert((int)key > DiffLast);
+  DiffLast = key;
+  DiffOnly[key] = 0;
+}
+static void diff_add(struct avltree *tree, struct avlbind *node, void *context) {
+  diff_check(tree, node, 2);
+}
+static void diff_remove(struct avltree *tree, struct avlbind *node, void *context) {
+  diff_check(tree, node, 1);
+}
+
+static void InitDiff(mytree *tree) {
+  memset(tree, 0, sizeof(*tree));
+  tree->tree.compare_key_tree = compare;
+  tree->tree.compare_nodes = counted_compare_nodes;
+}
+
+static unsigned RunDiff(mytree *a, mytree *b) {
+  unsigned count, key;
+  DiffTrees[0] = &a->tree;
+  DiffTrees[1] = &b->tree;
+  DiffLast = -1;
+  Compares = 0;
+  count = avl_diff(&a->tree, &b->tree, diff_add, diff_remove, NULL);
+  for (key = 0; key < MAX_NODES; key++)
+    assert(DiffOnly[key] == 0);
+  return count;
+}
+
+void DiffTest(void) {
+  static char in_a[MAX_NODES / 2];
+  struct avlbind *left;
+  unsigned i, key, round, expect, range = MAX_NODES / 2;
+  mynode *root;
+  mytree a, b, c;
+
+  printf("Reporting the difference of two trees\n");
+
+  /* separate nodes: every key is visited once */
+  for (round = 0; round < 40; round++) {
+    InitDiff(&a);
+    InitDiff(&b);
+    memset(DiffOnly, 0, sizeof(DiffOnly));
+    expect = 0;
+    for (key = 0; key < range; key++) {
+      in_a[key] = rand() % 4 != 0 && round % 8 != 0;
+      if (in_a[key])
+        insert_value(&a, key);
+      /* mostly the same keys, sometimes unrelated ones */
+      if (round % 3 == 0 ? rand() & 1 : in_a[key] != (rand() % 16 == 0)) {
+        insert_value(&b, key);
+        if (!in_a[key]) {
+          DiffOnly[key] = 2;
+          expect++;
+        }
+      } else if (in_a[key]) {
+        DiffOnly[key] = 1;
+        expect++;
+      }
+    }
+    assert(RunDiff(&a, &b) == expect);
+    assert(Compares <= a.tree.num_nodes + b.tree.num_nodes);
+    FreeTree(a.tree.root);
+    FreeTree(b.tree.root);
+  }
+
+  /* a tree is the same as itself, without a comparison */
+  InitDiff(&a);
+  for (key = 0; key < range; key += 2)
+    insert_value(&a, key);
+  b = a;
+  assert(RunDiff(&a, &b) == 0 && Compares == 0);
+
+  /* b shares the left subtree of a, and has its own right one */
+  InitDiff(&c);
+  root = (mynode*)a.tree.root;
+  expect = 0;
+  for (key = root->key + 1; key < range; key++) {
+    if ((key & 1) == (rand() % 16 == 0)) {
+      insert_value(&c, key);
+      if (key & 1) {
+        DiffOnly[key] = 2;
+        expect++;
+      }
+    } else if (!(key & 1)) {
+      DiffOnly[key] = 1;
+      expect++;
+    }
+  }
+  InitDiff(&b);
+  b.tree.root = &GetNode()->node;
+  ((mynode*)b.tree.root)->key = root->key;
+  left = b.tree.root->left = root->node.left;
+  b.tree.root->right = c.tree.root;
+  b.tree.root->balance = avl_height(c.tree.root) - avl_height(left);
+  assert(b.tree.root->balance >= -1 && b.tree.root->balance <= 1);
+  /* only the right subtrees and the roots are compared */
+  i = IsAVL((mynode*)root->node.right) + c.tree.num_nodes + 1;
+  assert(RunDiff(&a, &b) == expect && Compares <= i);
+
+  b.tree.root->left = NULL;
+  FreeTree(b.tree.root);
+  FreeTree(a.tree.root);
+  assert(FreeNodeCount() == MAX_NODES);
+  printf("Test passed\n");
+}
+
+void TopDownTest(void) {
+  mytree tree, check;
+  mynode *node;
+  unsigned i, n, pass;
+
+  printf("Inserting top down without a path\n");
+  for (pass = 0; pass < 3; pass++) {
+    for (n = 1; n <= MAX_NODES / 2; n = n * 2 + 1) {
+      memset(&tree, 0, sizeof(tree));
+      tree.tree.compare_key_tree = compare;
+      memset(&check, 0, sizeof(check));
+      check.tree.compare_key_tree = compare;
+      for (i = 0; i < n; i++) {
+        /* ascending, descending, then random with repeats */
+        unsigned key = pass == 0 ? i : pass == 1 ? n - i : rand() % n;
+        node = GetNode();
+        tree.key = node->key = key;
+        if (avl_insert_topdown(&tree.tree, &node->node) != &node->node)
+          FreeNode(node);
+        node = GetNode();
+        check.key = node->key = key;
+        if (avl_insert(&check.tree, &node->node) != &node->node)
+          FreeNode(node);
+        assert(IsAVL((mynode*)tree.tree.root) == tree.tree.num_nodes);
+        /* the same rotations as avl_insert(), so the same tree */
+        assert(SameShape(tree.tree.root, check.tree.root));
+      }
+      FreeTree(tree.tree.root);
+      FreeTree(check.tree.root);
+      assert(FreeNodeCount() == MAX_NODES);
+    }
+  }
+  printf("Test passed\n");
+}
+
+static size_t encode_node(struct avltree *tree, struct avlbind *node,
+                          unsigned char *buf, size_t max) {
+  memcpy(buf, &((mynode*)node)->key, sizeof(unsigned));
+  memcpy(buf + sizeof(unsigned), &((mynode*)node)->count, sizeof(unsigned));
+  return 2 * sizeof(unsigned);
+}
+static struct avlbind *decode_node(struct avltree *tree,
+                                   const unsigned char *buf, size_t len) {
+  mynode *node = GetNode();
+  assert(node && len == 2 * sizeof(unsigned));
+  memcpy(&node->key, buf, sizeof(unsigned));
+  memcpy(&node->count, buf + sizeof(unsigned), sizeof(unsigned));
+  ((mytree*)tree)->key = node->key;
+  return &node->node;
+}
+static size_t encode_key(struct avltree *tree, unsigned char *buf, size_t max) {
+  memcpy(buf, &((mytree*)tree)->key, sizeof(unsigned));
+  return sizeof(unsigned);
+}
+static void decode_key(struct avltree *tree, const unsigned char *buf,
+                       size_t len) {
+  memcpy(&((mytree*)tree)->key, buf, sizeof(unsigned));
+}
+static void free_node(struct avltree *tree, struct avlbind *node) {
+  FreeNode((mynode*)node);
+}
+
+#define DURABLE_KEYS 300
+static char LogPath[64], CheckpointPath[64];
+
+static void OpenDurable(struct avldurable *d, mytree *tree, int policy) {
+  memset(tree, 0, sizeof(*tree));
+  tree->tree.compare_key_tree = compare;
+  memset(d, 0, sizeof(*d));
+  d->encode_node = encode_node;
+  d->decode_node = decode_node;
+  d->encode_key = encode_key;
+  d->decode_key = decode_key;
+  d->free_node = free_node;
+  d->sync_policy = policy;
+  d->group_records = 8;
+  d->checkpoint_bytes = 4000;
+  assert(avl_durable_open(d, &tree->tree, LogPath, CheckpointPath) == 0);
+}
+
+/* operation i of a fixed sequence: toggles one key in or out */
+static unsigned DurableKey(unsigned i) {
+  return (i * 2654435761u >> 8) % DURABLE_KEYS;
+}
+
+static void DurableOp(struct avldurable *d, mytree *tree, unsigned i) {
+  mynode *node;
+  tree->key = DurableKey(i);
+  node = (mynode*)avl_durable_delete(d);
+  if (node)
+    FreeNode(node);
+  else {
+    node = GetNode();
+    tree->key = node->key = DurableKey(i);
+    node->count = i;
+    avl_durable_insert(d, &node->node);
+  }
+}
+
+/* whether the tree holds what the first n operations leave */
+static int DurableMatches(mytree *tree, unsigned n) {
+  static unsigned Model[DURABLE_KEYS];
+  struct avlsearch search;
+  struct avlbind *cur;
+  unsigned i, k, count = 0;
+
+  memset(Model, 0, sizeof(Model));
+  for (i = 0; i < n; i++) {
+    k = DurableKey(i);
+    Model[k] = Model[k] ? 0 : i + 1;
+  }
+  for (k = 0; k < DURABLE_KEYS; k++) {
+    if (Model[k])
+      count++;
+    tree->key = k;
+    cur = avl_get_greater_equal(&tree->tree, &search);
+    if (cur && ((mynode*)cur)->key != k)
+      cur = NULL;
+    if (Model[k] ? cur == NULL || ((mynode*)cur)->count != Model[k] - 1 : cur != NULL)
+      return 0;
+  }
+  return tree->tree.num_nodes == count;
+}
+
+void DurableTest(void) {
+  static const int policies[] = { AVL_SYNC_NONE, AVL_SYNC_BATCH, AVL_SYNC_ALWAYS };
+  struct avldurable d;
+  mytree tree;
+  unsigned i, done, round, target, got;
+  int fds[2], status, policy;
+  char dir[] = "/tmp/avltestXXXXXX";
+  pid_t pid;
+  FILE *file;
+
+  printf("Recovering a durable tree after crashes\n");
+  assert(mkdtemp(dir));
+  sprintf(LogPath, "%s/log", dir);
+  sprintf(CheckpointPath, "%s/checkpoint", dir);
+
+  /* clean shutdowns keep everything, under any policy */
+  done = 0;
+  for (policy = 0; policy < 3; policy++) {
+    OpenDurable(&d, &tree, policies[policy]);
+    assert(DurableMatches(&tree, done));
+    for (i = 0; i < 1000; i++)
+      DurableOp(&d, &tree, done++);
+    assert(avl_durable_close(&d) == 0);
+    FreeTree(tree.tree.root);
+    assert(FreeNodeCount() == MAX_NODES);
+  }
+
+  /* a torn record at the end of the log is dropped */
+  OpenDurable(&d, &tree, AVL_SYNC_NONE);
+  assert(DurableMatches(&tree, done));
+  DurableOp(&d, &tree, done);
+  assert(avl_durable_close(&d) == 0);
+  FreeTree(tree.tree.root);
+  file = fopen(LogPath, "r+b");
+  assert(file);
+  fseek(file, -3, SEEK_END);
+  fputc(0x5a, file);
+  fclose(file);
+  OpenDurable(&d, &tree, AVL_SYNC_NONE);
+  assert(DurableMatches(&tree, done));
+  assert(avl_durable_close(&d) == 0);
+  FreeTree(tree.tree.root);
+  assert(FreeNodeCount() == MAX_NODES);
+
+  /* kill a writer at random points; every operation it reported
+   back as done must be there, and at most one more */
+  for (round = 0; round < 20; round++) {
+    assert(pipe(fds) == 0);
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+      close(fds[0]);
+      OpenDurable(&d, &tree, AVL_SYNC_ALWAYS);
+      for (i = done; ; i++) {
+        DurableOp(&d, &tree, i);
+        got = i + 1;
+        if (write(fds[1], &got, sizeof(got)) != sizeof(got))
+          _exit(1);
+      }
+    }
+    close(fds[1]);
+    target = 1 + rand() % 400;
+    got = done;
+    for (i = 0; i < target && read(fds[0], &got, sizeof(got)) == sizeof(got); i++)
+      ;
+    kill(pid, SIGKILL);
+    while (read(fds[0], &i, sizeof(i)) == sizeof(i))
+      got = i;
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+    assert(WIFSIGNALED(status));
+
+    OpenDurable(&d, &tree, AVL_SYNC_ALWAYS);
+    if (DurableMatches(&tree, got))
+      done = got;
+    else {
+      assert(DurableMatches(&tree, got + 1));
+      done = got + 1;
+    }
+    assert(avl_durable_close(&d) == 0);
+    FreeTree(tree.tree.root);
+    assert(FreeNodeCount() == MAX_NODES);
+  }
+
+  unlink(LogPath);
+  unlink(CheckpointPath);
+  rmdir(dir);
+  printf("Test passed\n");
+}
+
+typedef struct mypaged_ {
+  struct avlpaged tree;
+  unsigned key;
+} mypaged;
+
+static int compare_paged(struct avlpaged *tree, const struct avlpnode *node) {
+  unsigned lhs = ((mypaged*)tree)->key;
+  unsigned rhs = *(const unsigned*)AVL_PAGED_DATA(node);
+  return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+
+/* checks balances and order from the file, returns the height */
+static int CheckPaged(mypaged *tree, unsigned long id, unsigned *count) {
+  struct avlpnode *node;
+  unsigned long left, right;
+  int balance, lh, rh;
+
+  if (id == 0)
+    return 0;
+  node = avl_paged_pin(&tree->tree, id);
+  left = node->left;
+  right = node->right;
+  balance = node->balance;
+  avl_paged_unpin(&tree->tree, id, 0);
+  lh = CheckPaged(tree, left, count);
+  ++*count;
+  rh = CheckPaged(tree, right, count);
+  assert(balance == rh - lh && (unsigned)(balance + 1) <= 2);
+  return (lh > rh ? lh : rh) + 1;
+}
+
+static unsigned PagedKey(mypaged *tree, unsigned long id) {
+  struct avlpnode *node = avl_paged_pin(&tree->tree, id);
+  unsigned key = *(unsigned*)AVL_PAGED_DATA(node);
+
+  avl_paged_unpin(&tree->tree, id, 0);
+  return key;
+}
+
+void PagedTest(void) {
+  static unsigned char Present[40000];
+  struct avlpagedcursor cursor;
+  unsigned long id, prev;
+  unsigned i, key, count, expect, found;
+  char dir[] = "/tmp/avltestXXXXXX", path[64];
+  int inserted, pass;
+  mypaged tree;
+
+  printf("Paging a tree through a small buffer pool\n");
+  assert(mkdtemp(dir));
+  sprintf(path, "%s/paged", dir);
+  memset(Present, 0, sizeof(Present));
+  expect = 0;
+  for (pass = 0; pass < 2; pass++) {
+    /* 8 pages of pool for a file of a few hundred, then the least;
+       the second pass reinserts into the slots the first freed */
+    memset(&tree, 0, sizeof(tree));
+    tree.tree.compare_key = compare_paged;
+    assert(avl_paged_open(&tree.tree, path, sizeof(struct avlpnode) + sizeof(unsigned),
+                          pass ? AVL_PAGED_MIN_FRAMES : 8) == 0);
+    assert(tree.tree.num_nodes == expect);
+    for (i = 0; i < 20000; i++) {
+      tree.key = key = rand() % 40000;
+      id = avl_paged_insert(&tree.tree, &key, &inserted);
+      assert(id != 0 && inserted == !Present[key]);
+      if (inserted) {
+        Present[key] = 1;
+        expect++;
+      }
+      assert(tree.tree.num_nodes == expect);
+    }
+    assert(tree.tree.num_pages > 40 * 8);
+    count = 0;
+    CheckPaged(&tree, tree.tree.root, &count);
+    assert(count == expect);
+
+    count = 0;
+    prev = 0;
+    for (id = avl_paged_first(&tree.tree, &cursor); id;
+         id = avl_paged_next(&tree.tree, &cursor), count++) {
+      key = PagedKey(&tree, id);
+      assert(Present[key] && (count == 0 || key > prev));
+      prev = key;
+    }
+    assert(count == expect);
+
+    count = 0;
+    for (id = avl_paged_last(&tree.tree, &cursor); id;
+         id = avl_paged_prev(&tree.tree, &cursor), count++) {
+      key = PagedKey(&tree, id);
+      assert(Present[key] && (count == 0 || key < prev));
+      prev = key;
+    }
+    assert(count == expect);
+
+    for (key = 0; key < 40000; key += 7) {
+      tree.key = key;
+      assert((avl_paged_search(&tree.tree) != 0) == Present[key]);
+      id = avl_paged_greater_equal(&tree.tree, &cursor);
+      for (i = key; i < 40000 && !Present[i]; i++)
+        ;
+      if (id == 0)
+        assert(i == 40000);
+      else {
+        assert(PagedKey(&tree, id) == i);
+        /* the cursor steps back from where the seek left it */
+        for (i = key; i > 0 && !Present[i - 1]; i--)
+          ;
+        id = avl_paged_prev(&tree.tree, &cursor);
+        assert(i == 0 ? id == 0 : PagedKey(&tree, id) == i - 1);
+      }
+    }
+
+    /* delete about a third, checking the shape as it goes */
+    for (i = 0; i < 10000; i++) {
+      tree.key = key = rand() % 40000;
+      found = ~0u;
+      assert(avl_paged_delete(&tree.tree, &found) == Present[key]);
+      if (Present[key]) {
+        assert(found == key);
+        Present[key] = 0;
+        expect--;
+      } else
+        assert(found == ~0u);
+      assert(tree.tree.num_nodes == expect);
+      if (i % 1000 == 0) {
+        count = 0;
+        CheckPaged(&tree, tree.tree.root, &count);
+        assert(count == expect);
+      }
+    }
+    count = 0;
+    CheckPaged(&tree, tree.tree.root, &count);
+    assert(count == expect);
+    for (i = 0; i < tree.tree.num_frames; i++)
+      assert(tree.tree.frames[i].pins == 0);
+    /* the second pass reopens the file and carries on */
+    assert(avl_paged_close(&tree.tree) == 0);
+  }
+  unlink(path);
+  rmdir(dir);
+  printf("Test passed\n");
+}
+
 int main(int argc, char *argv[]) {
+  /* avltest [keys [height [part/parts]]] widens the exhaustive
+     checks; the deletions of each height are split into parts,
+     and only the given one is run */
+  if (argc > 1)
+    VerifyKeys = (unsigned)atoi(argv[1]);
+  if (argc > 2)
+    VerifyHeight = (unsigned)atoi(argv[2]);
+  if (argc > 3 && sscanf(argv[3], "%u/%u", &VerifyPart, &VerifyParts) != 2)
+    VerifyParts = 0;
+  assert(VerifyKeys <= VERIFY_MAX_KEYS && VerifyHeight <= VERIFY_MAX_HEIGHT);
+  assert(VerifyPart < VerifyParts);
+  BuildTest();
+  ReduceTest();
+  AggregateTest();
+  IntervalTest();
+  StringTest();
+  SeekTest();
+  RangeTest();
+  CursorTest();
+  FrozenTest();
+  RelaxedTest();
+  RelayoutTest();
+  TraceTest();
+  HashTest();
+  CacheTest();
+  TopDownTest();
+  MergeTest();
+  BloomTest();
+  BufferTest();
+  KMergeTest();
+  DiffTest();
+  DurableTest();
+  PagedTest();
   TreeTest();
   DeleteTest();
   RandomTreeTest();
@@ -0,0 +1,151 @@
+/****************************************************************
+
+	AVL tree operation traces
+
+	records the calls made on a tree, through its trace_op hook,
+	as a compact binary file that avlreplay can play back.
+	After an 8 byte header, each record is the AVL_OP_ code in
+	one byte and, for the operations that take a search key, the
+	key length as a base-128 varint followed by the key bytes
+
+	this software is placed in the public domain
+	provided that you use it at your own risk
+
+****************************************************************/
+
+#ifndef AVLTRACE_H
+#define AVLTRACE_H
+
+#include <stdio.h>
+#include "avlsearch.h"
+
+#define AVL_TRACE_MAGIC "AVLTRC1\n"
+#define AVL_TRACE_MAX_KEY 1024
+
+struct avltrace
+{
+	FILE *file;
+	/* copies the tree's search key into buf, returns its length */
+	size_t (*get_key)(struct avltree *tree, unsigned char *buf, size_t max);
+	unsigned long records;
+	int error;
+};
+
+/****************************************************************
+	avl_trace_has_key()
+	whether records of an operation carry the search key
+****************************************************************/
+static int avl_trace_has_key(int op)
+{
+	return (op >= AVL_OP_INSERT && op <= AVL_OP_SEEK_LESS_EQUAL) || op == AVL_OP_FIND;
+}
+
+/****************************************************************
+	avl_trace_record()
+	the trace_op hook, appends one record to the trace file
+****************************************************************/
+static void avl_trace_record(struct avltree *tree, int op, void *context)
+{
+	struct avltrace *trace = (struct avltrace *)context;
+	unsigned char key[AVL_TRACE_MAX_KEY];
+	unsigned char head[8], *p = head;
+	size_t len, rest;
+
+	*p++ = (unsigned char)op;
+	len = 0;
+	if (avl_trace_has_key(op))
+	{
+		len = (*trace->get_key)(tree, key, sizeof(key));
+		if (len > sizeof(key))
+			len = sizeof(key);
+		rest = len;
+		do
+		{
+			*p++ = (unsigned char)((rest & 0x7f) | (rest > 0x7f ? 0x80 : 0));
+			rest >>= 7;
+		} while (rest);
+	}
+	if (fwrite(head, 1, p - head, trace->file) != (size_t)(p - head) ||
+		fwrite(key, 1, len, trace->file) != len)
+		trace->error = 1;
+	trace->records++;
+}
+
+/****************************************************************
+	avl_trace_begin()
+		starts recording the operations on a tree into a file
+		opened for writing. returns 0, or -1 on a write error
+****************************************************************/
+int avl_trace_begin(struct avltrace *trace, struct avltree *tree, FILE *file,
+	size_t (*get_key)(struct avltree *tree, unsigned char *buf, size_t max))
+{
+	trace->file = file;
+	trace->get_key = get_key;
+	trace->records = 0;
+	trace->error = 0;
+	if (fwrite(AVL_TRACE_MAGIC, 1, 8, file) != 8)
+		return -1;
+	tree->trace_op = avl_trace_record;
+	tree->trace_context = trace;
+	return 0;
+}
+
+/****************************************************************
+	avl_trace_end()
+		stops recording and flushes the file, which the caller
+		then closes. returns 0, or -1 if any write failed
+****************************************************************/
+int avl_trace_end(struct avltrace *trace, struct avltree *tree)
+{
+	tree->trace_op = NULL;
+	tree->trace_context = NULL;
+	if (fflush(trace->file) != 0)
+		trace->error = 1;
+	return trace->error ? -1 : 0;
+}
+
+/****************************************************************
+	avl_trace_check()
+		reads and checks the header of a trace file
+		returns 0, or -1 if it is not a trace
+****************************************************************/
+int avl_trace_check(FILE *file)
+{
+	char magic[8];
+
+	if (fread(magic, 1, 8, file) != 8 || memcmp(magic, AVL_TRACE_MAGIC, 8) != 0)
+		return -1;
+	return 0;
+}
+
+/****************************************************************
+	avl_trace_read()
+		reads the next record, with its key into a buffer of
+		AVL_TRACE_MAX_KEY bytes. returns 1 for a record, 0 at the
+		end of the file, or -1 if the file is damaged
+****************************************************************/
+int avl_trace_read(FILE *file, int *op, unsigned char *key, size_t *len)
+{
+	int c, shift;
+
+	if ((c = getc(file)) == EOF)
+		return 0;
+	*op = c;
+	*len = 0;
+	if (!avl_trace_has_key(c))
+		return c >= AVL_OP_INSERT && c <= AVL_OP_FIND ? 1 : -1;
+
+	shift = 0;
+	do
+	{
+		if ((c = getc(file)) == EOF || shift > 14)
+			return -1;
+		*len |= (size_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	if (*len > AVL_TRACE_MAX_KEY || fread(key, 1, *len, file) != *len)
+		return -1;
+	return 1;
+}
+
+#endif /* AVLTRACE_H */